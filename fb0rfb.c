@@ -6,7 +6,8 @@
  * - Opens the Linux framebuffer device (default: /dev/fb0) READ-ONLY.
  * - Memory-maps the framebuffer so it can copy pixels efficiently.
  * - Listens on TCP port 5900 (default) and speaks the RFB 3.8 protocol (VNC).
- * - Serves a single client at a time (listen backlog=1), sending RAW pixel data.
+ * - Serves up to --max-clients viewers at once (default 4) from one epoll event loop; the
+ *   framebuffer is scanned once per tick for all of them and encoded tiles are shared.
  *
  * Why is it written this way
  * -------------------------
@@ -16,15 +17,23 @@
  *
  * What it does NOT do (current limitations)
  * -----------------------------------------
- * - No input injection (keyboard/mouse/touch). We only parse & ignore input-related messages.
+ * - No input injection (keyboard/mouse/touch). Key events are parsed & ignored; pointer events
+ *   only move the pointer the viewers draw themselves (see "Pointer").
  * - No authentication / encryption (SecurityType = "None").
- * - No advanced encodings (only RAW).
- * - No incremental updates / dirty-rect tracking (always sends a full-frame update).
+ *
+ * Dirty-rectangle tracking
+ * ------------------------
+ * The screen is split into fixed TILE_SIZE x TILE_SIZE tiles. A shadow copy of the last
+ * frame we scanned is compared against fbmem once per tick; only tiles that changed are
+ * merged into rectangles and sent. An idle UI therefore costs a compare pass, not 1 MB/frame.
  *
  * Notes on pixel format
  * ---------------------
- * We assume 32bpp framebuffer and expose an RFB PixelFormat that matches common little-endian
- * ARGB/XRGB layouts where R is in bits 16..23, G in 8..15, B in 0..7, depth=24.
+ * A 32bpp framebuffer is exposed as an RFB PixelFormat built from the driver's channel
+ * bitfields; on the Centauri that is the common little-endian ARGB/XRGB layout where R is in
+ * bits 16..23, G in 8..15, B in 0..7, depth=24. 16bpp and 24bpp framebuffers are widened to
+ * XRGB as they are read (see "Capture kernels"). Clients may request another format with
+ * SetPixelFormat (e.g. RGB565 or BGR233 to halve/quarter the bandwidth) and we convert.
  *
  * Centauri Carbon screen specs:
  *   virtual_size: 480,544
@@ -33,98 +42,6215 @@
  *
  * That matches width=480 and line_length (stride)=1920 bytes per scanline.
  *
- * If your device uses a different channel order (e.g., BGRA), colors may appear swapped.
- * You can fix that by changing the PixelFormat shifts or swizzling during copy.
+ * If your device uses a different channel order (e.g., BGRA) and its driver reports it in
+ * fb_var_screeninfo, the advertised shifts follow it. If colors still appear swapped, the
+ * driver's bitfields are wrong.
+ */
+
+#define _GNU_SOURCE
+
+/* Networking / sockets */
+#include <arpa/inet.h>
+#include <linux/sockios.h>
+#include <netinet/in.h>
+#include <netinet/tcp.h>
+#include <sys/socket.h>
+
+/* Linux framebuffer ioctls */
+#include <linux/fb.h>
+#include <sys/ioctl.h>
+
+/* Memory mapping & I/O primitives */
+#include <errno.h>
+#include <poll.h>
+#include <pthread.h>
+#include <sched.h>
+#include <stdatomic.h>
+#include <stddef.h>
+#include <fcntl.h>
+#include <signal.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/epoll.h>
+#include <sys/eventfd.h>
+#include <sys/mman.h>
+#include <sys/resource.h>
+#include <sys/stat.h>
+#include <sys/syscall.h>
+#include <sys/time.h>
+#include <sys/timerfd.h>
+#include <sys/types.h>
+#include <sys/uio.h>
+#include <sys/wait.h>
+#include <sys/un.h>
+#include <time.h>
+#include <unistd.h>
+
+/*
+ * Optional zlib support (ZRLE encoding).
+ *
+ * The static musl build in the README has no zlib, so it is opt-in:
+ *   zig cc ... -DHAVE_ZLIB -o OpenCentauri-VNC fb0rfb.c -lz
+ * Without it the server still works and negotiates RAW.
+ */
+#ifdef HAVE_ZLIB
+#include <zlib.h>
+#endif
+
+/*
+ * Optional libjpeg support (lossy Tight-JPEG tiles, needs zlib too for Tight itself):
+ *   zig cc ... -DHAVE_ZLIB -DHAVE_LIBJPEG -o OpenCentauri-VNC fb0rfb.c -ljpeg -lz
+ */
+#if defined(HAVE_LIBJPEG) && !defined(HAVE_ZLIB)
+#error "HAVE_LIBJPEG needs HAVE_ZLIB (JPEG tiles are part of the Tight encoding)"
+#endif
+#ifdef HAVE_LIBJPEG
+#include <jpeglib.h>
+#include <setjmp.h>
+#endif
+
+/*
+ * NEON pixel kernels are used when the compiler targets it, e.g. add
+ *   -mcpu=generic+v7a+neon -mfpu=neon   (ARMv7)  or any AArch64 target.
+ * Every kernel has a portable scalar path, which also handles the tail of each row.
+ */
+#if defined(__ARM_NEON) || defined(__ARM_NEON__)
+#include <arm_neon.h>
+#define HAVE_NEON 1
+#endif
+
+/* ARMv8 CRC32 instructions (e.g. -march=armv8-a+crc) speed up the scan hashes */
+#if defined(__ARM_FEATURE_CRC32)
+#include <arm_acle.h>
+#define HAVE_ARM_CRC32 1
+#endif
+
+/* Print perror() and exit. Used for fatal setup errors. */
+static void die(const char* msg) {
+    perror(msg);
+    exit(1);
+}
+
+/* now_ms() — monotonic clock in milliseconds (frame pacing; immune to wall-clock steps) */
+static int64_t now_ms(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000 + ts.tv_nsec / 1000000;
+}
+
+/* now_us() — the same clock in microseconds, for timing single scans */
+static int64_t now_us(void) {
+    struct timespec ts;
+    clock_gettime(CLOCK_MONOTONIC, &ts);
+    return (int64_t)ts.tv_sec * 1000000 + ts.tv_nsec / 1000;
+}
+
+/*
+ * Tile grid / shadow framebuffer
+ *
+ * TILE_SIZE is a trade-off: smaller tiles send fewer unchanged pixels around a small
+ * change (e.g. a ticking progress percentage), larger tiles mean fewer rectangles and
+ * less per-rect header overhead. 32x32 keeps a 480x544 screen at 15x17 = 255 tiles.
+ */
+#define TILE_SIZE 32
+
+/* A rectangle in framebuffer pixel coordinates (what goes into an RFB rect header) */
+struct rect {
+    int x, y, w, h;
+};
+
+/*
+ * How fbmem pixels become shadow pixels (see "Capture kernels"). The shadow is always
+ * 32bpp; fn converts npix pixels of bytespp bytes each into it.
+ */
+struct fbconv;
+typedef void (*fbconv_fn)(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv);
+struct fbconv {
+    const char* name;    /* kernel, for the startup log */
+    int bytespp;         /* bytes per fbmem pixel */
+    int same;            /* fbmem pixels are shadow pixels: fbmem may be diffed in place */
+    fbconv_fn fn;
+    int shift[3];               /* generic kernels: R, G, B bitfields of a fbmem pixel */
+    uint32_t mask[3];
+    uint8_t lut[3][256];        /* generic kernels: channel value -> 8 bits */
+};
+
+/*
+ * The tile grid is shared by all clients:
+ * - shadow + changed/version describe the framebuffer as of the last scan (one scan per
+ *   tick, no matter how many viewers are connected);
+ * - each client keeps its own dirty flags (tiles it hasn't been sent since they changed),
+ *   which every scan ORs the changed flags into.
+ */
+struct tilemap {
+    int width, height;   /* framebuffer geometry in pixels */
+    int cols, rows;      /* tile grid geometry (edge tiles may be partial) */
+    int ntiles;
+    uint8_t* shadow;     /* last scanned frame, packed width*4 bytes per line */
+    uint8_t* changed;    /* ntiles flags: tile changed during the last scan */
+    uint32_t* version;   /* ntiles: scan number at which the tile last changed */
+    uint32_t seq;        /* number of the last scan */
+    int use_hash;        /* detect changes by segment hash instead of diffing (--scan) */
+    uint64_t* hashes;    /* height*cols: hash of each tile's slice of each scanline */
+    int bulk;            /* read each band of fbmem into stage first (--fb-read) */
+    uint8_t* stage;      /* one band: TILE_SIZE lines of width*4 bytes */
+    struct fbconv conv;  /* reads fbmem pixels into stage, picked by fbconv_pick() */
+};
+
+/*
+ * Frame diff kernels
+ * ------------------
+ * diff_seg() answers one question: do these n bytes (one tile's slice of a scanline)
+ * differ? It's the innermost loop of every scan, so it gets its own kernels instead of
+ * memcmp(), which musl implements as a byte loop and which computes an ordering we don't
+ * need. Both kernels OR together XORs of wide loads and only branch once per 64 bytes.
+ * n is a multiple of 4 (whole pixels).
+ */
+static int diff_seg_scalar(const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t x[8], y[8], d = 0;
+        memcpy(x, a + i, 64);
+        memcpy(y, b + i, 64);
+        for (int k = 0; k < 8; k++) d |= x[k] ^ y[k];
+        if (d) return 1;
+    }
+    for (; i + 8 <= n; i += 8) {
+        uint64_t x, y;
+        memcpy(&x, a + i, 8);
+        memcpy(&y, b + i, 8);
+        if (x != y) return 1;
+    }
+    for (; i + 4 <= n; i += 4) {
+        uint32_t x, y;
+        memcpy(&x, a + i, 4);
+        memcpy(&y, b + i, 4);
+        if (x != y) return 1;
+    }
+    return 0;
+}
+
+#ifdef HAVE_NEON
+/* Non-zero if any byte of v is non-zero */
+static inline uint32_t neon_any(uint8x16_t v) {
+#if defined(__aarch64__)
+    return vmaxvq_u32(vreinterpretq_u32_u8(v));
+#else
+    uint32x4_t w = vreinterpretq_u32_u8(v);
+    uint32x2_t t = vorr_u32(vget_low_u32(w), vget_high_u32(w));
+    return vget_lane_u32(vpmax_u32(t, t), 0);
+#endif
+}
+
+static int diff_seg_neon(const uint8_t* a, const uint8_t* b, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint8x16_t d0 = veorq_u8(vld1q_u8(a + i),      vld1q_u8(b + i));
+        uint8x16_t d1 = veorq_u8(vld1q_u8(a + i + 16), vld1q_u8(b + i + 16));
+        uint8x16_t d2 = veorq_u8(vld1q_u8(a + i + 32), vld1q_u8(b + i + 32));
+        uint8x16_t d3 = veorq_u8(vld1q_u8(a + i + 48), vld1q_u8(b + i + 48));
+        if (neon_any(vorrq_u8(vorrq_u8(d0, d1), vorrq_u8(d2, d3)))) return 1;
+    }
+    for (; i + 16 <= n; i += 16) {
+        if (neon_any(veorq_u8(vld1q_u8(a + i), vld1q_u8(b + i)))) return 1;
+    }
+    return diff_seg_scalar(a + i, b + i, n - i);
+}
+#define diff_seg diff_seg_neon
+#else
+#define diff_seg diff_seg_scalar
+#endif
+
+/*
+ * Segment hashes
+ * --------------
+ * The default scan doesn't diff against the shadow at all: it hashes each tile's slice of
+ * every scanline and compares the result with the hash stored for that slice. An idle
+ * frame then costs one sequential read of fbmem plus a 64 KB hash table, instead of
+ * reading the framebuffer and the 1 MB shadow side by side, and only tiles that changed
+ * get copied. The hashes describe content independently of its position, which is what
+ * scroll (CopyRect) detection needs too.
+ *
+ * 64 bits from two independent 32-bit families that both see every word:
+ * - ARMv8 CRC: CRC-32C and CRC-32 side by side (different polynomials);
+ * - otherwise: two multiply-rotate (xxHash32-style) families with different constants,
+ *   each split over two interleaved chains for instruction-level parallelism. 32-bit
+ *   multiplies only, so ARMv7 is fine.
+ * Every round is a bijection of its chain's state, so a change of any one word always
+ * changes the hash; other changes go unnoticed with odds of about 2^-64.
+ */
+#ifdef HAVE_ARM_CRC32
+static uint64_t seg_hash_crc(const uint8_t* p, size_t n) {
+    uint32_t a = 0xffffffffu, b = 0xffffffffu;
+    for (size_t i = 0; i + 4 <= n; i += 4) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        a = __crc32cw(a, w);
+        b = __crc32w(b, w);
+    }
+    return ((uint64_t)a << 32) | b;
+}
+#endif
+
+static inline uint32_t rotl32(uint32_t v, int r) {
+    return (v << r) | (v >> (32 - r));
+}
+
+static uint64_t seg_hash_scalar(const uint8_t* p, size_t n) {
+    uint32_t a0 = 0x9e3779b1u, a1 = 0x165667b1u; /* family A: words 0,2,4.. / 1,3,5.. */
+    uint32_t b0 = 0x85ebca77u, b1 = 0xc2b2ae3du; /* family B: same split */
+    size_t i = 0;
+    for (; i + 8 <= n; i += 8) {
+        uint32_t w[2];
+        memcpy(w, p + i, 8);
+        a0 = rotl32(a0 + w[0] * 0x85ebca77u, 13) * 0x9e3779b1u;
+        a1 = rotl32(a1 + w[1] * 0x85ebca77u, 13) * 0x9e3779b1u;
+        b0 = rotl32(b0 ^ (w[0] * 0xc2b2ae3du), 17) * 0x27d4eb2fu;
+        b1 = rotl32(b1 ^ (w[1] * 0xc2b2ae3du), 17) * 0x27d4eb2fu;
+    }
+    if (i < n) {
+        uint32_t w;
+        memcpy(&w, p + i, 4);
+        a0 = rotl32(a0 + w * 0x85ebca77u, 13) * 0x9e3779b1u;
+        b0 = rotl32(b0 ^ (w * 0xc2b2ae3du), 17) * 0x27d4eb2fu;
+    }
+    /* Merging keeps a change in any one chain visible: only that chain's term moves */
+    return ((uint64_t)(a0 ^ rotl32(a1, 16)) << 32) | (b0 ^ rotl32(b1, 16));
+}
+
+#ifdef HAVE_ARM_CRC32
+#define seg_hash seg_hash_crc
+#else
+#define seg_hash seg_hash_scalar
+#endif
+
+/*
+ * Bulk framebuffer reads
+ * ----------------------
+ * On many ARM display controllers the framebuffer is mapped uncached or write-combined:
+ * every load goes out to DRAM on its own, and nothing is cached for the next one. A scan
+ * reading fbmem one tile slice at a time between shadow accesses, and a second time to
+ * copy a changed tile, pays that over and over. With bulk reads each band of TILE_SIZE
+ * lines is read exactly once, in long runs of the widest loads the core has, into a
+ * cached staging buffer (tm->stage); hashing or diffing and the copy into the shadow
+ * then only touch that. On a cached framebuffer the extra copy is pure overhead, so
+ * --fb-read auto times both ways at startup (see tilemap_pick_scan()).
+ */
+#define BULK_PREFETCH 256 /* bytes ahead; a few bus bursts */
+
+#ifdef HAVE_NEON
+static void bulk_read(uint8_t* dst, const uint8_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        __builtin_prefetch(src + i + BULK_PREFETCH);
+        uint8x16_t a = vld1q_u8(src + i);
+        uint8x16_t b = vld1q_u8(src + i + 16);
+        uint8x16_t c = vld1q_u8(src + i + 32);
+        uint8x16_t d = vld1q_u8(src + i + 48);
+        vst1q_u8(dst + i, a);
+        vst1q_u8(dst + i + 16, b);
+        vst1q_u8(dst + i + 32, c);
+        vst1q_u8(dst + i + 48, d);
+    }
+    memcpy(dst + i, src + i, n - i);
+}
+#else
+static void bulk_read(uint8_t* dst, const uint8_t* src, size_t n) {
+    size_t i = 0;
+    for (; i + 64 <= n; i += 64) {
+        uint64_t w[8];
+        __builtin_prefetch(src + i + BULK_PREFETCH);
+        memcpy(w, src + i, 64);
+        memcpy(dst + i, w, 64);
+    }
+    memcpy(dst + i, src + i, n - i);
+}
+#endif
+
+/*
+ * Capture kernels
+ * ---------------
+ * The shadow and everything downstream of it (encoders, CopyRect, scaled views) work on
+ * 32bpp pixels. Framebuffers that are 32bpp already are read as they are, so their bands
+ * may be diffed in place. 16bpp and 24bpp panels go through a kernel that reads the band
+ * and widens it into tm->stage, which is then scanned like a bulk read.
+ *
+ * fbconv_pick() chooses the kernel once at startup, from the driver's bitfields: the common
+ * layouts (RGB565, BGR565, RGB555, RGB888, BGR888) have their own, with the shifts fixed
+ * at compile time; anything else gets a generic one that goes through per-channel lookup
+ * tables. Like bulk_read() the kernels read fbmem in runs of CONV_CHUNK pixels, and a band
+ * whose lines have no padding (stride == width * bytespp) is converted in a single call.
+ */
+#define CONV_CHUNK 32 /* pixels per read from fbmem */
+
+enum { CONV_RGB565, CONV_BGR565, CONV_RGB555, CONV_RGB888, CONV_BGR888, CONV_ANY };
+
+/* fbconv_run() — the loop of every kernel; bytespp and kind are constants after inlining */
+static inline __attribute__((always_inline)) void fbconv_run(uint8_t* dst, const uint8_t* src,
+                                                          size_t npix, int bytespp, int kind,
+                                                          const struct fbconv* cv) {
+    uint8_t in[CONV_CHUNK * 3];
+    uint32_t out[CONV_CHUNK];
+
+    for (size_t i = 0; i < npix; i += CONV_CHUNK) {
+        size_t n = npix - i < CONV_CHUNK ? npix - i : CONV_CHUNK;
+        __builtin_prefetch(src + i * (size_t)bytespp + BULK_PREFETCH);
+        memcpy(in, src + i * (size_t)bytespp, n * (size_t)bytespp);
+        for (size_t k = 0; k < n; k++) {
+            const uint8_t* p = in + k * (size_t)bytespp;
+            uint32_t v = (uint32_t)p[0] | (uint32_t)p[1] << 8;
+            uint32_t r, g, b;
+            if (bytespp == 3) v |= (uint32_t)p[2] << 16;
+            switch (kind) {
+            case CONV_RGB565:
+                r = v >> 11; g = v >> 5 & 63; b = v & 31;
+                r = r << 3 | r >> 2; g = g << 2 | g >> 4; b = b << 3 | b >> 2;
+                break;
+            case CONV_BGR565:
+                b = v >> 11; g = v >> 5 & 63; r = v & 31;
+                r = r << 3 | r >> 2; g = g << 2 | g >> 4; b = b << 3 | b >> 2;
+                break;
+            case CONV_RGB555:
+                r = v >> 10 & 31; g = v >> 5 & 31; b = v & 31;
+                r = r << 3 | r >> 2; g = g << 3 | g >> 2; b = b << 3 | b >> 2;
+                break;
+            case CONV_RGB888:
+                r = v >> 16; g = v >> 8 & 255; b = v & 255;
+                break;
+            case CONV_BGR888:
+                b = v >> 16; g = v >> 8 & 255; r = v & 255;
+                break;
+            default:
+                r = cv->lut[0][v >> cv->shift[0] & cv->mask[0]];
+                g = cv->lut[1][v >> cv->shift[1] & cv->mask[1]];
+                b = cv->lut[2][v >> cv->shift[2] & cv->mask[2]];
+                break;
+            }
+            out[k] = r << 16 | g << 8 | b;
+        }
+        memcpy(dst + i * 4, out, n * 4);
+    }
+}
+
+static void fbconv_copy32(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    (void)cv;
+    bulk_read(dst, src, npix * 4);
+}
+
+#ifdef HAVE_NEON
+/* 8 pixels per step: each channel's top bits are replicated into the low ones (vsri) */
+static void fbconv_rgb565(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    size_t i = 0;
+    for (; i + 8 <= npix; i += 8) {
+        __builtin_prefetch(src + i * 2 + BULK_PREFETCH);
+        uint16x8_t v = vld1q_u16((const uint16_t*)(const void*)(src + i * 2));
+        uint8x8x4_t px;
+        uint8x8_t r = vshrn_n_u16(v, 8);
+        uint8x8_t g = vshrn_n_u16(v, 3);
+        uint8x8_t b = vmovn_u16(vshlq_n_u16(v, 3));
+        px.val[0] = vsri_n_u8(b, b, 5);
+        px.val[1] = vsri_n_u8(g, g, 6);
+        px.val[2] = vsri_n_u8(r, r, 5);
+        px.val[3] = vdup_n_u8(0);
+        vst4_u8(dst + i * 4, px);
+    }
+    fbconv_run(dst + i * 4, src + i * 2, npix - i, 2, CONV_RGB565, cv);
+}
+#else
+static void fbconv_rgb565(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 2, CONV_RGB565, cv);
+}
+#endif
+static void fbconv_bgr565(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 2, CONV_BGR565, cv);
+}
+static void fbconv_rgb555(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 2, CONV_RGB555, cv);
+}
+static void fbconv_rgb888(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 3, CONV_RGB888, cv);
+}
+static void fbconv_bgr888(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 3, CONV_BGR888, cv);
+}
+static void fbconv_any16(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 2, CONV_ANY, cv);
+}
+static void fbconv_any24(uint8_t* dst, const uint8_t* src, size_t npix, const struct fbconv* cv) {
+    fbconv_run(dst, src, npix, 3, CONV_ANY, cv);
+}
+
+/*
+ * fbconv_pick() — choose the capture kernel for the driver's pixel layout
+ *
+ * 16bpp and 24bpp drivers that leave the bitfields empty are taken to be RGB565 / RGB888.
+ * Returns 0 on success, -1 for a layout we can't read (another bpp, or a channel wider
+ * than 8 bits or outside the pixel).
+ */
+static int fbconv_pick(struct fbconv* cv, const struct fb_var_screeninfo* v) {
+    static const struct {
+        int bpp;
+        int shift[3], len[3];
+        const char* name;
+        fbconv_fn fn;
+    } known[] = {
+        { 16, { 11, 5, 0 }, { 5, 6, 5 }, "rgb565", fbconv_rgb565 },
+        { 16, { 0, 5, 11 }, { 5, 6, 5 }, "bgr565", fbconv_bgr565 },
+        { 16, { 10, 5, 0 }, { 5, 5, 5 }, "rgb555", fbconv_rgb555 },
+        { 24, { 16, 8, 0 }, { 8, 8, 8 }, "rgb888", fbconv_rgb888 },
+        { 24, { 0, 8, 16 }, { 8, 8, 8 }, "bgr888", fbconv_bgr888 },
+    };
+    const struct fb_bitfield* f[3] = { &v->red, &v->green, &v->blue };
+    int bpp = (int)v->bits_per_pixel;
+    int shift[3], len[3];
+
+    memset(cv, 0, sizeof(*cv));
+    cv->bytespp = bpp / 8;
+    if (bpp == 32) {
+        cv->name = "as is";
+        cv->same = 1;
+        cv->fn = fbconv_copy32;
+        return 0;
+    }
+    if (bpp != 16 && bpp != 24) return -1;
+
+    int empty = !v->red.length && !v->green.length && !v->blue.length;
+    for (int c = 0; c < 3; c++) {
+        shift[c] = empty ? known[bpp == 16 ? 0 : 3].shift[c] : (int)f[c]->offset;
+        len[c] = empty ? known[bpp == 16 ? 0 : 3].len[c] : (int)f[c]->length;
+        if (len[c] < 1 || len[c] > 8 || shift[c] + len[c] > bpp) return -1;
+    }
+    for (size_t k = 0; k < sizeof(known) / sizeof(known[0]); k++) {
+        if (known[k].bpp != bpp || memcmp(known[k].shift, shift, sizeof(shift)) ||
+            memcmp(known[k].len, len, sizeof(len))) continue;
+        cv->name = known[k].name;
+        cv->fn = known[k].fn;
+        return 0;
+    }
+
+    cv->name = "generic";
+    cv->fn = bpp == 16 ? fbconv_any16 : fbconv_any24;
+    for (int c = 0; c < 3; c++) {
+        cv->shift[c] = shift[c];
+        cv->mask[c] = (1u << len[c]) - 1;
+        for (uint32_t x = 0; x <= cv->mask[c]; x++) {
+            cv->lut[c][x] = (uint8_t)((x * 255 + cv->mask[c] / 2) / cv->mask[c]);
+        }
+    }
+    return 0;
+}
+
+/*
+ * tilemap_init() — allocate the shadow buffer and tile bookkeeping for a framebuffer
+ *
+ * use_hash selects the scan method: segment hashes (see seg_hash()) or a straight diff
+ * against the shadow (see diff_seg()).
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int tilemap_init(struct tilemap* tm, int width, int height, int use_hash) {
+    memset(tm, 0, sizeof(*tm));
+    tm->width  = width;
+    tm->height = height;
+    tm->cols   = (width + TILE_SIZE - 1) / TILE_SIZE;
+    tm->rows   = (height + TILE_SIZE - 1) / TILE_SIZE;
+    tm->ntiles = tm->cols * tm->rows;
+
+    tm->shadow  = (uint8_t*)calloc((size_t)width * (size_t)height, 4);
+    tm->changed = (uint8_t*)calloc((size_t)tm->ntiles, 1);
+    tm->version = (uint32_t*)calloc((size_t)tm->ntiles, sizeof(uint32_t));
+    tm->stage   = (uint8_t*)malloc((size_t)width * TILE_SIZE * 4);
+    if (!tm->shadow || !tm->changed || !tm->version || !tm->stage) return -1;
+
+    /* 32bpp until the caller picks the kernel for its framebuffer */
+    struct fb_var_screeninfo v32;
+    memset(&v32, 0, sizeof(v32));
+    v32.bits_per_pixel = 32;
+    fbconv_pick(&tm->conv, &v32);
+
+    /* Hashes start out describing the all-black shadow, like everything else */
+    tm->use_hash = use_hash;
+    if (use_hash) {
+        static const uint8_t black[TILE_SIZE * 4];
+        int last_w = width - (tm->cols - 1) * TILE_SIZE;
+        uint64_t h_full = seg_hash(black, TILE_SIZE * 4);
+        uint64_t h_last = seg_hash(black, (size_t)last_w * 4);
+
+        tm->hashes = (uint64_t*)malloc((size_t)height * (size_t)tm->cols * sizeof(uint64_t));
+        if (!tm->hashes) return -1;
+        for (int y = 0; y < height; y++) {
+            uint64_t* h = tm->hashes + (size_t)y * (size_t)tm->cols;
+            for (int tx = 0; tx < tm->cols; tx++) h[tx] = tx == tm->cols - 1 ? h_last : h_full;
+        }
+    }
+    return 0;
+}
+
+/*
+ * tilemap_diff_band() — diff one tile row against the shadow, line by line
+ *
+ * band is the first line of tile row ty, in fbmem or the staging buffer, stride bytes
+ * apart. Fills chg[0..cols) with a change map for the band: chg[tx] is set on the first
+ * line where tile tx differs. From then on that tile is no longer compared (early exit)
+ * and its remaining lines are just copied into the shadow. Walking whole scanlines rather than
+ * tile by tile keeps framebuffer reads sequential, which the prefetcher likes.
+ *
+ * Returns the number of tiles in the band that changed.
+ */
+static int tilemap_diff_band(struct tilemap* tm, const uint8_t* band, int stride, int ty,
+                             uint8_t* chg) {
+    size_t shadow_stride = (size_t)tm->width * 4;
+    int y0 = ty * TILE_SIZE;
+    int th = tm->height - y0 < TILE_SIZE ? tm->height - y0 : TILE_SIZE;
+    int last_w = tm->width - (tm->cols - 1) * TILE_SIZE; /* width of the rightmost tile */
+    int changed = 0;
+
+    memset(chg, 0, (size_t)tm->cols);
+    for (int y = y0; y < y0 + th; y++) {
+        const uint8_t* src = band + (size_t)(y - y0) * (size_t)stride;
+        uint8_t* dst = tm->shadow + (size_t)y * shadow_stride;
+
+        for (int tx = 0; tx < tm->cols; tx++) {
+            size_t off = (size_t)tx * TILE_SIZE * 4;
+            size_t nbytes = (size_t)(tx == tm->cols - 1 ? last_w : TILE_SIZE) * 4;
+
+            if (!chg[tx]) {
+                if (!diff_seg(src + off, dst + off, nbytes)) continue;
+                chg[tx] = 1;
+                changed++;
+            }
+            memcpy(dst + off, src + off, nbytes);
+        }
+    }
+    return changed;
+}
+
+/*
+ * tilemap_hash_band() — hash one tile row and compare with the stored hashes
+ *
+ * Same contract as tilemap_diff_band(). Every slice is hashed (the hashes must stay
+ * current), the shadow is only touched to copy the tiles that changed.
+ */
+static int tilemap_hash_band(struct tilemap* tm, const uint8_t* band, int stride, int ty,
+                             uint8_t* chg) {
+    size_t shadow_stride = (size_t)tm->width * 4;
+    int y0 = ty * TILE_SIZE;
+    int th = tm->height - y0 < TILE_SIZE ? tm->height - y0 : TILE_SIZE;
+    int last_w = tm->width - (tm->cols - 1) * TILE_SIZE;
+    int changed = 0;
+
+    memset(chg, 0, (size_t)tm->cols);
+    for (int y = y0; y < y0 + th; y++) {
+        const uint8_t* src = band + (size_t)(y - y0) * (size_t)stride;
+        uint64_t* h = tm->hashes + (size_t)y * (size_t)tm->cols;
+
+        for (int tx = 0; tx < tm->cols; tx++) {
+            size_t nbytes = (size_t)(tx == tm->cols - 1 ? last_w : TILE_SIZE) * 4;
+            uint64_t v = seg_hash(src + (size_t)tx * TILE_SIZE * 4, nbytes);
+            if (v == h[tx]) continue;
+            h[tx] = v;
+            if (!chg[tx]) changed++;
+            chg[tx] = 1;
+        }
+    }
+    if (!changed) return 0;
+
+    for (int tx = 0; tx < tm->cols; tx++) {
+        if (!chg[tx]) continue;
+        size_t off = (size_t)tx * TILE_SIZE * 4;
+        size_t nbytes = (size_t)(tx == tm->cols - 1 ? last_w : TILE_SIZE) * 4;
+        for (int y = y0; y < y0 + th; y++) {
+            memcpy(tm->shadow + (size_t)y * shadow_stride + off,
+                   band + (size_t)(y - y0) * (size_t)stride + off, nbytes);
+        }
+    }
+    return changed;
+}
+
+/*
+ * tilemap_scan() — compare fbmem against the last scan and record changed tiles
+ *
+ * - Every tile row goes through tilemap_hash_band() or tilemap_diff_band(); changed tiles
+ *   are copied into the shadow. With bulk reads, or a framebuffer that isn't 32bpp, the
+ *   row is first read out of fbmem in one pass by the capture kernel, and only the copy is
+ *   looked at.
+ * - tm->changed only describes this scan; callers fold it into per-client dirty flags.
+ *   A scan that finds nothing changed costs no further work at all: no rectangles, no
+ *   FramebufferUpdate.
+ *
+ * Returns the number of tiles that changed during this scan.
+ */
+static int tilemap_scan(struct tilemap* tm, const uint8_t* fbmem, int stride) {
+    int changed = 0;
+
+    tm->seq++;
+    for (int ty = 0; ty < tm->rows; ty++) {
+        uint8_t* chg = tm->changed + ty * tm->cols;
+        const uint8_t* band = fbmem + (size_t)ty * TILE_SIZE * (size_t)stride;
+        int bstride = stride;
+        if (tm->bulk || !tm->conv.same) {
+            size_t line = (size_t)tm->width * 4;
+            size_t w = (size_t)tm->width;
+            int th = tm->height - ty * TILE_SIZE < TILE_SIZE ? tm->height - ty * TILE_SIZE : TILE_SIZE;
+            if ((size_t)stride == w * (size_t)tm->conv.bytespp) {
+                tm->conv.fn(tm->stage, band, w * (size_t)th, &tm->conv);
+            } else {
+                for (int y = 0; y < th; y++) {
+                    tm->conv.fn(tm->stage + (size_t)y * line, band + (size_t)y * (size_t)stride, w, &tm->conv);
+                }
+            }
+            band = tm->stage;
+            bstride = (int)line;
+        }
+        int n = tm->use_hash ? tilemap_hash_band(tm, band, bstride, ty, chg)
+                             : tilemap_diff_band(tm, band, bstride, ty, chg);
+        if (!n) continue;
+
+        for (int tx = 0; tx < tm->cols; tx++) {
+            if (chg[tx]) tm->version[ty * tm->cols + tx] = tm->seq;
+        }
+        changed += n;
+    }
+    return changed;
+}
+
+/*
+ * tilemap_pick_scan() — --scan auto / --fb-read auto: time the scan methods and ways of
+ * reading on the real framebuffer and keep the fastest
+ *
+ * Which one wins depends on the SoC: hashing reads fbmem only but costs arithmetic, the
+ * diff is nearly free per byte but also reads the shadow. On an uncached or write-combined
+ * framebuffer the fbmem reads dominate both, which is what bulk reads are for.
+ * pick_hash / pick_bulk say which choices are open; the tilemap's use_hash / bulk hold the
+ * fixed ones. Picking the scan method needs a tilemap set up with hashes.
+ *
+ * Each candidate is primed once first. Hash scans run last because they recompute every
+ * hash, so whichever method is kept starts from a shadow and hashes that agree.
+ */
+static void tilemap_pick_scan(struct tilemap* tm, const uint8_t* fbmem, int stride,
+                              int pick_hash, int pick_bulk) {
+    static const char* const names[4] = { "diff", "diff+bulk", "hash", "hash+bulk" };
+    int64_t cost[4] = { -1, -1, -1, -1 };
+    int best = -1;
+    char report[160];
+    int n = 0;
+
+    for (int c = 0; c < 4; c++) {
+        int use_hash = c >> 1, bulk = c & 1;
+        if ((!pick_hash && use_hash != tm->use_hash) || (!pick_bulk && bulk != tm->bulk)) continue;
+        int prev_hash = tm->use_hash, prev_bulk = tm->bulk;
+        tm->use_hash = use_hash;
+        tm->bulk = bulk;
+        tilemap_scan(tm, fbmem, stride);
+
+        int64_t t0 = now_us();
+        for (int i = 0; i < 3; i++) tilemap_scan(tm, fbmem, stride);
+        cost[c] = (now_us() - t0) / 3;
+        if (best < 0 || cost[c] < cost[best]) best = c;
+        tm->use_hash = prev_hash;
+        tm->bulk = prev_bulk;
+        n += snprintf(report + n, sizeof(report) - (size_t)n, "%s%s %lld us", n ? ", " : "",
+                      names[c], (long long)cost[c]);
+    }
+    tm->use_hash = best >> 1;
+    tm->bulk = best & 1;
+    fprintf(stderr, "fb0rfb: scan method %s (%s per frame)\n", names[best], report);
+}
+
+/* Intersect *r with *clip in place. Returns 0 if the result is empty. */
+static int rect_clip(struct rect* r, const struct rect* clip) {
+    int x0 = r->x > clip->x ? r->x : clip->x;
+    int y0 = r->y > clip->y ? r->y : clip->y;
+    int x1 = r->x + r->w < clip->x + clip->w ? r->x + r->w : clip->x + clip->w;
+    int y1 = r->y + r->h < clip->y + clip->h ? r->y + r->h : clip->y + clip->h;
+    if (x1 <= x0 || y1 <= y0) {
+        r->w = r->h = 0;
+        return 0;
+    }
+    r->x = x0; r->y = y0; r->w = x1 - x0; r->h = y1 - y0;
+    return 1;
+}
+
+/* Grow *r to the bounding box of *r and *o */
+static void rect_union(struct rect* r, const struct rect* o) {
+    if (o->w <= 0 || o->h <= 0) return;
+    if (r->w <= 0 || r->h <= 0) { *r = *o; return; }
+    int x1 = r->x + r->w > o->x + o->w ? r->x + r->w : o->x + o->w;
+    int y1 = r->y + r->h > o->y + o->h ? r->y + r->h : o->y + o->h;
+    r->x = r->x < o->x ? r->x : o->x;
+    r->y = r->y < o->y ? r->y : o->y;
+    r->w = x1 - r->x;
+    r->h = y1 - r->y;
+}
+
+/* Pixel bounds of tile (tx, ty); edge tiles are clipped to the framebuffer */
+static struct rect tile_rect(const struct tilemap* tm, int tx, int ty) {
+    struct rect r;
+    r.x = tx * TILE_SIZE;
+    r.y = ty * TILE_SIZE;
+    r.w = tm->width - r.x < TILE_SIZE ? tm->width - r.x : TILE_SIZE;
+    r.h = tm->height - r.y < TILE_SIZE ? tm->height - r.y : TILE_SIZE;
+    return r;
+}
+
+/* True if tile rect t lies entirely inside area */
+static int rect_contains(const struct rect* area, const struct rect* t) {
+    return t->x >= area->x && t->y >= area->y &&
+           t->x + t->w <= area->x + area->w && t->y + t->h <= area->y + area->h;
+}
+
+/* Range of tiles intersecting area: [*tx0, *tx1) x [*ty0, *ty1) */
+static void tile_range(const struct rect* area, int* tx0, int* tx1, int* ty0, int* ty1) {
+    *tx0 = area->x / TILE_SIZE;
+    *tx1 = (area->x + area->w + TILE_SIZE - 1) / TILE_SIZE;
+    *ty0 = area->y / TILE_SIZE;
+    *ty1 = (area->y + area->h + TILE_SIZE - 1) / TILE_SIZE;
+}
+
+/* Set every dirty flag of tiles intersecting area (a client lost its copy of it) */
+static void tiles_mark(const struct tilemap* tm, uint8_t* dirty, const struct rect* area) {
+    int tx0, tx1, ty0, ty1;
+    tile_range(area, &tx0, &tx1, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        memset(dirty + ty * tm->cols + tx0, 1, (size_t)(tx1 - tx0));
+    }
+}
+
+/*
+ * tiles_clear() — forget dirty tiles that the client now has in full
+ *
+ * Only tiles entirely inside *area are cleared. A tile that straddles the edge of the
+ * area was only partly sent, so it stays dirty for a later request that covers the rest.
+ */
+static void tiles_clear(const struct tilemap* tm, uint8_t* dirty, const struct rect* area) {
+    int tx0, tx1, ty0, ty1;
+    tile_range(area, &tx0, &tx1, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = tx0; tx < tx1; tx++) {
+            struct rect t = tile_rect(tm, tx, ty);
+            if (rect_contains(area, &t)) dirty[ty * tm->cols + tx] = 0;
+        }
+    }
+}
+
+/*
+ * tiles_merge() — turn dirty tiles inside *area into a short list of rectangles
+ *
+ * - Horizontal runs of dirty tiles in a tile row become one rectangle.
+ * - A run that exactly matches (same x/width) a rectangle ending on the row above is
+ *   merged into it, so a dirty block of tiles becomes a single rectangle.
+ * - Rectangles are clipped to *area (the region the client asked for).
+ *
+ * Used for payloads that are cheapest in big pieces (zero-copy RAW). Clears the dirty
+ * flags of tiles that were sent completely. Returns the number of rectangles in rects.
+ */
+static int tiles_merge(const struct tilemap* tm, uint8_t* dirty, const struct rect* area,
+                       struct rect* rects) {
+    int nrects = 0;
+    if (area->w <= 0 || area->h <= 0) return 0;
+
+    int tx_lo, tx_hi, ty_lo, ty_hi;
+    tile_range(area, &tx_lo, &tx_hi, &ty_lo, &ty_hi);
+
+    for (int ty = ty_lo; ty < ty_hi; ty++) {
+        int row_start = nrects; /* rects created on this row can't be extended by it */
+        const uint8_t* d = dirty + ty * tm->cols;
+
+        for (int tx = tx_lo; tx < tx_hi; ) {
+            if (!d[tx]) { tx++; continue; }
+
+            int tx0 = tx;
+            while (tx < tx_hi && d[tx]) tx++;
+
+            struct rect run = tile_rect(tm, tx0, ty);
+            run.w = (tx * TILE_SIZE < tm->width ? tx * TILE_SIZE : tm->width) - run.x;
+            rect_clip(&run, area);
+
+            /* Try to extend a rectangle that ends on the row above */
+            struct rect* r = NULL;
+            for (int i = 0; i < row_start; i++) {
+                struct rect* p = &rects[i];
+                if (p->x == run.x && p->w == run.w && p->y + p->h == run.y) { r = p; break; }
+            }
+            if (r) {
+                r->h += run.h;
+            } else {
+                rects[nrects++] = run;
+            }
+        }
+    }
+
+    tiles_clear(tm, dirty, area);
+    return nrects;
+}
+
+/*
+ * tiles_list() — one rectangle per dirty tile inside *area
+ *
+ * Used for encodings whose output is cached per tile and shared between clients.
+ * tiles[i] is the tile index of rects[i] when the tile is sent whole (cacheable), or -1
+ * when it was clipped by the request area. Clears the flags of completely sent tiles.
+ */
+static int tiles_list(const struct tilemap* tm, uint8_t* dirty, const struct rect* area,
+                      struct rect* rects, int* tiles) {
+    int nrects = 0;
+    if (area->w <= 0 || area->h <= 0) return 0;
+
+    int tx0, tx1, ty0, ty1;
+    tile_range(area, &tx0, &tx1, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = tx0; tx < tx1; tx++) {
+            int t = ty * tm->cols + tx;
+            if (!dirty[t]) continue;
+            struct rect r = tile_rect(tm, tx, ty);
+            tiles[nrects] = rect_contains(area, &r) ? t : -1;
+            rect_clip(&r, area);
+            rects[nrects++] = r;
+        }
+    }
+
+    tiles_clear(tm, dirty, area);
+    return nrects;
+}
+
+/*
+ * Pending FramebufferUpdateRequest state
+ *
+ * RFB is request/response: the viewer asks for a region and we answer with exactly one
+ * FramebufferUpdate. Requests that arrive before we answer are folded together; the
+ * answer covers the union of their regions.
+ *
+ * - incremental: only changed pixels are wanted; if nothing in the area changed we hold
+ *   the request until something does (that is what makes an idle viewer cost nothing).
+ * - non-incremental: the viewer lost its copy of the area and wants all of it now. The
+ *   tiles it covers are marked dirty for that client on arrival, so the answer is built
+ *   exactly like an incremental one and is guaranteed not to be empty.
+ *
+ * With continuous updates (EnableContinuousUpdates) a standing request for the enabled
+ * region is answered over and over, without waiting for the viewer to ask again; only
+ * backpressure paces it. Real requests still arrive and widen the next answer.
+ */
+struct update_request {
+    int pending;        /* a request is waiting for an answer */
+    struct rect area;   /* union of requested regions, clipped to the screen */
+    int continuous;     /* continuous updates enabled */
+    struct rect cont;   /* ... for this region, clipped to the screen */
+};
+
+/* Does the viewer want an update, asked for or standing? */
+static int request_waiting(const struct update_request* req) {
+    return req->pending || req->continuous;
+}
+
+/* The region the next update covers: the requests since the last one, and the standing one */
+static struct rect request_area(const struct update_request* req) {
+    struct rect area = { 0, 0, 0, 0 };
+    if (req->pending) area = req->area;
+    if (req->continuous) rect_union(&area, &req->cont);
+    return area;
+}
+
+/* Big-endian (network order) stores into a message buffer */
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t)(v >> 8);
+    p[1] = (uint8_t)v;
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    p[0] = (uint8_t)(v >> 24);
+    p[1] = (uint8_t)(v >> 16);
+    p[2] = (uint8_t)(v >> 8);
+    p[3] = (uint8_t)v;
+}
+
+/* RFB rectangle header: x(2), y(2), w(2), h(2), encoding-type(4) */
+static void put_rect_header(uint8_t* p, const struct rect* r, int32_t encoding) {
+    put16(p + 0, (uint16_t)r->x);
+    put16(p + 2, (uint16_t)r->y);
+    put16(p + 4, (uint16_t)r->w);
+    put16(p + 6, (uint16_t)r->h);
+    put32(p + 8, (uint32_t)encoding);
+}
+
+/*
+ * Memory arenas
+ * -------------
+ * The memory the frame loop works in is reserved once at startup and sized from the
+ * framebuffer geometry (see server_reserve()). It is one anonymous mapping, carved into
+ * the event loop's update scratch, one pool per viewer slot and one per encode cache
+ * group:
+ * - carving is bump allocation. A pool is released as a whole when its client or group
+ *   goes away, and its pages go back to the kernel (MADV_DONTNEED), so carved memory
+ *   always starts out zeroed;
+ * - the mapping is MAP_NORESERVE, so the reservation is the peak and is known up front,
+ *   while only the pages actually touched are resident;
+ * - buffers get slices sized for a full-screen update, so they don't grow in steady state.
+ *   One that outgrows its slice anyway moves to the heap instead of failing, for example
+ *   a viewer whose link keeps a long backlog, or a connection accepted before a dropped
+ *   one was reaped. Heap allocations are counted in the stats.
+ */
+#define ARENA_ALIGN 64 /* cache line */
+
+struct arena {
+    uint8_t* base;
+    size_t size, used;
+    int busy;                   /* pools: handed out to a client or group */
+};
+
+/* Bytes a carve of n takes, alignment included */
+static size_t arena_need(size_t n) {
+    return (n + ARENA_ALIGN - 1) & ~(size_t)(ARENA_ALIGN - 1);
+}
+
+static size_t page_round(size_t n) {
+    size_t pg = (size_t)sysconf(_SC_PAGESIZE);
+    return (n + pg - 1) / pg * pg;
+}
+
+/* arena_map() — reserve size bytes of address space. Returns 0 on success, -1 on failure. */
+static int arena_map(struct arena* a, size_t size) {
+    void* p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS | MAP_NORESERVE, -1, 0);
+    if (p == MAP_FAILED) return -1;
+    a->base = (uint8_t*)p;
+    a->size = size;
+    a->used = 0;
+    return 0;
+}
+
+/* arena_alloc() — carve n zeroed bytes; NULL when the arena is full */
+static void* arena_alloc(struct arena* a, size_t n) {
+    size_t off = arena_need(a->used);
+    if (!a->base || off > a->size || n > a->size - off) return NULL;
+    a->used = off + n;
+    return a->base + off;
+}
+
+/* arena_sub() — carve a pool, page aligned so that it can be released on its own */
+static int arena_sub(struct arena* parent, struct arena* a, size_t size) {
+    size_t off = page_round(parent->used);
+    size = page_round(size);
+    if (off > parent->size || size > parent->size - off) return -1;
+    a->base = parent->base + off;
+    a->size = size;
+    a->used = 0;
+    a->busy = 0;
+    parent->used = off + size;
+    return 0;
+}
+
+/* pool_take() — hand out a free pool of n, or NULL if all are busy */
+static struct arena* pool_take(struct arena* pools, int n) {
+    for (int i = 0; i < n; i++) {
+        if (pools[i].base && !pools[i].busy) {
+            pools[i].busy = 1;
+            return &pools[i];
+        }
+    }
+    return NULL;
+}
+
+/* pool_release() — give back everything carved from a pool, pages included */
+static void pool_release(struct arena* a) {
+    if (a->used) madvise(a->base, page_round(a->used), MADV_DONTNEED);
+    a->used = 0;
+    a->busy = 0;
+}
+
+/* Heap allocations made by the encoders and queues since startup (all threads) */
+static _Atomic uint64_t heap_allocs;
+
+/*
+ * Growable byte buffer for encoded output.
+ *
+ * Buffers are kept per client and only ever grow. They start out as an arena slice where
+ * one is available (buf_attach()), so the encoders run without touching the allocator.
+ */
+struct buf {
+    uint8_t* data;
+    size_t len, cap;
+    int borrowed;               /* data is an arena slice, not ours to realloc/free */
+};
+
+/* buf_attach() — give an empty buffer a cap-byte slice of a (it stays empty if a is full) */
+static void buf_attach(struct buf* b, struct arena* a, size_t cap) {
+    uint8_t* p = a ? (uint8_t*)arena_alloc(a, cap) : NULL;
+    if (!p) return;
+    b->data = p;
+    b->len = 0;
+    b->cap = cap;
+    b->borrowed = 1;
+}
+
+/* Make room for extra more bytes. Returns 0 on success, -1 on allocation failure. */
+static int buf_reserve(struct buf* b, size_t extra) {
+    if (b->len + extra <= b->cap) return 0;
+    size_t cap = b->cap ? b->cap : 4096;
+    while (cap < b->len + extra) cap *= 2;
+    uint8_t* p;
+    if (b->borrowed) { /* outgrew its slice: move to the heap */
+        p = (uint8_t*)malloc(cap);
+        if (p) memcpy(p, b->data, b->len);
+    } else {
+        p = (uint8_t*)realloc(b->data, cap);
+    }
+    if (!p) return -1;
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    b->data = p;
+    b->cap = cap;
+    b->borrowed = 0;
+    return 0;
+}
+
+/* Append n bytes and return a pointer to them (NULL on allocation failure) */
+static uint8_t* buf_append(struct buf* b, size_t n) {
+    if (buf_reserve(b, n)) return NULL;
+    uint8_t* p = b->data + b->len;
+    b->len += n;
+    return p;
+}
+
+static void buf_free(struct buf* b) {
+    if (!b->borrowed) free(b->data);
+    memset(b, 0, sizeof(*b));
+}
+
+/*
+ * Pixel formats
+ * -------------
+ * The server format is what the framebuffer holds (32bpp, channel offsets from vinfo), and
+ * what we advertise in ServerInit. A client may ask for any true-color format with
+ * SetPixelFormat; from then on every pixel we send it goes through a conversion kernel
+ * picked once for that (server, client) pair.
+ */
+struct pixfmt {
+    int bpp;                      /* bits per pixel: 8, 16 or 32 */
+    int depth;
+    int big_endian;
+    int true_color;
+    int rmax, gmax, bmax;
+    int rshift, gshift, bshift;
+};
+
+/* Decode the 16-byte RFB PixelFormat structure */
+static void pixfmt_parse(struct pixfmt* pf, const uint8_t* p) {
+    pf->bpp        = p[0];
+    pf->depth      = p[1];
+    pf->big_endian = p[2] != 0;
+    pf->true_color = p[3] != 0;
+    pf->rmax       = (p[4] << 8) | p[5];
+    pf->gmax       = (p[6] << 8) | p[7];
+    pf->bmax       = (p[8] << 8) | p[9];
+    pf->rshift     = p[10];
+    pf->gshift     = p[11];
+    pf->bshift     = p[12];
+}
+
+/* Encode the 16-byte RFB PixelFormat structure (3 trailing padding bytes) */
+static void pixfmt_write(uint8_t* p, const struct pixfmt* pf) {
+    memset(p, 0, 16);
+    p[0] = (uint8_t)pf->bpp;
+    p[1] = (uint8_t)pf->depth;
+    p[2] = (uint8_t)pf->big_endian;
+    p[3] = (uint8_t)pf->true_color;
+    put16(p + 4, (uint16_t)pf->rmax);
+    put16(p + 6, (uint16_t)pf->gmax);
+    put16(p + 8, (uint16_t)pf->bmax);
+    p[10] = (uint8_t)pf->rshift;
+    p[11] = (uint8_t)pf->gshift;
+    p[12] = (uint8_t)pf->bshift;
+}
+
+/* Formats are equal if they produce the same bytes (depth is informational only) */
+static int pixfmt_equal(const struct pixfmt* a, const struct pixfmt* b) {
+    return a->bpp == b->bpp &&
+           (a->bpp == 8 || a->big_endian == b->big_endian) &&
+           a->rmax == b->rmax && a->gmax == b->gmax && a->bmax == b->bmax &&
+           a->rshift == b->rshift && a->gshift == b->gshift && a->bshift == b->bshift;
+}
+
+/* 32bpp x8r8g8b8 little-endian: the Centauri panel and the target of the fast kernels */
+static int pixfmt_is_xrgb8888(const struct pixfmt* pf) {
+    return pf->bpp == 32 && !pf->big_endian &&
+           pf->rmax == 255 && pf->gmax == 255 && pf->bmax == 255 &&
+           pf->rshift == 16 && pf->gshift == 8 && pf->bshift == 0;
+}
+
+/* 32bpp with three 8-bit channels on byte boundaries (can be converted by byte shuffles) */
+static int pixfmt_is_bytewise32(const struct pixfmt* pf) {
+    return pf->bpp == 32 &&
+           pf->rmax == 255 && pf->gmax == 255 && pf->bmax == 255 &&
+           pf->rshift % 8 == 0 && pf->gshift % 8 == 0 && pf->bshift % 8 == 0 &&
+           pf->rshift <= 24 && pf->gshift <= 24 && pf->bshift <= 24;
+}
+
+struct pixconv;
+typedef void (*pixconv_fn)(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc);
+
+/*
+ * A server-to-client pixel conversion.
+ *
+ * The kernel writes packed client pixels (1, 2 or 4 bytes each, client byte order).
+ * Encoders then treat client pixels as opaque values: pix_load()/pix_store() just move the
+ * bytes, so palettes and runs are computed on exactly what the client will see (two
+ * framebuffer colors that collapse to one RGB565 value count as one color).
+ */
+struct pixconv {
+    struct pixfmt src, dst;
+    int bytes;                  /* client bytes per pixel */
+    int identity;               /* client format == server format: RAW can stay zero-copy */
+    int cpixel_len;             /* ZRLE CPIXEL size (3 for 32bpp pixels with a spare byte) */
+    int cpixel_off;             /* first byte of the CPIXEL within a packed client pixel */
+    pixconv_fn fn;
+    const char* name;
+    uint32_t mask;              /* conv_mask32: bits that carry color */
+    uint8_t shuf[4];            /* conv_shuffle32: dst byte i = src byte shuf[i], 0xff = 0 */
+    uint32_t lut_r[256], lut_g[256], lut_b[256]; /* conv_generic: channel -> client bits */
+};
+
+/* Load/store one packed client pixel as an opaque value */
+static inline uint32_t pix_load(const uint8_t* p, int bytes) {
+    if (bytes == 4) { uint32_t v; memcpy(&v, p, 4); return v; }
+    if (bytes == 2) { uint16_t v; memcpy(&v, p, 2); return v; }
+    return p[0];
+}
+
+static inline uint8_t* pix_store(uint8_t* p, uint32_t v, int bytes) {
+    if (bytes == 4) { memcpy(p, &v, 4); return p + 4; }
+    if (bytes == 2) { uint16_t h = (uint16_t)v; memcpy(p, &h, 2); return p + 2; }
+    p[0] = (uint8_t)v;
+    return p + 1;
+}
+
+/* Same format, but zero the X/alpha byte so encoders see stable colors */
+static void conv_mask32(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc) {
+    for (int i = 0; i < n; i++) {
+        uint32_t v;
+        memcpy(&v, src + (size_t)i * 4, 4);
+        v &= pc->mask;
+        memcpy(dst + (size_t)i * 4, &v, 4);
+    }
+}
+
+/*
+ * Byte-shuffling 32bpp kernel: channel reordering (BGRX <-> XRGB) and byte-swapped
+ * (big-endian) 32bpp are both pure byte permutations.
+ */
+static void conv_shuffle32(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc) {
+    int i = 0;
+#ifdef HAVE_NEON
+    const uint8x16_t zero = vdupq_n_u8(0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t in = vld4q_u8(src + (size_t)i * 4), out;
+        out.val[0] = pc->shuf[0] == 0xff ? zero : in.val[pc->shuf[0]];
+        out.val[1] = pc->shuf[1] == 0xff ? zero : in.val[pc->shuf[1]];
+        out.val[2] = pc->shuf[2] == 0xff ? zero : in.val[pc->shuf[2]];
+        out.val[3] = pc->shuf[3] == 0xff ? zero : in.val[pc->shuf[3]];
+        vst4q_u8(dst + (size_t)i * 4, out);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint8_t* s = src + (size_t)i * 4;
+        uint8_t* d = dst + (size_t)i * 4;
+        for (int k = 0; k < 4; k++) d[k] = pc->shuf[k] == 0xff ? 0 : s[pc->shuf[k]];
+    }
+}
+
+/* XRGB8888 -> RGB565 (R 11..15, G 5..10, B 0..4), either byte order */
+static void conv_rgb565(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc) {
+    int i = 0;
+    int be = pc->dst.big_endian;
+#ifdef HAVE_NEON
+    for (; i + 16 <= n; i += 16) {
+        /* Deinterleave 16 pixels into B, G, R, X planes */
+        uint8x16x4_t in = vld4q_u8(src + (size_t)i * 4);
+        uint16x8_t lo = vshll_n_u8(vget_low_u8(in.val[2]), 8);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(in.val[1]), 8), 5);
+        lo = vsriq_n_u16(lo, vshll_n_u8(vget_low_u8(in.val[0]), 8), 11);
+        uint16x8_t hi = vshll_n_u8(vget_high_u8(in.val[2]), 8);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(in.val[1]), 8), 5);
+        hi = vsriq_n_u16(hi, vshll_n_u8(vget_high_u8(in.val[0]), 8), 11);
+        uint8x16_t blo = vreinterpretq_u8_u16(lo), bhi = vreinterpretq_u8_u16(hi);
+        if (be) {
+            blo = vrev16q_u8(blo);
+            bhi = vrev16q_u8(bhi);
+        }
+        vst1q_u8(dst + (size_t)i * 2, blo);
+        vst1q_u8(dst + (size_t)i * 2 + 16, bhi);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint8_t* s = src + (size_t)i * 4;
+        unsigned v = ((unsigned)(s[2] >> 3) << 11) | ((unsigned)(s[1] >> 2) << 5) | (s[0] >> 3);
+        uint8_t* d = dst + (size_t)i * 2;
+        d[be ? 1 : 0] = (uint8_t)v;
+        d[be ? 0 : 1] = (uint8_t)(v >> 8);
+    }
+}
+
+/* XRGB8888 -> BGR233 (R 0..2, G 3..5, B 6..7), the classic 8bpp true-color format */
+static void conv_bgr233(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc) {
+    int i = 0;
+    (void)pc;
+#ifdef HAVE_NEON
+    const uint8x16_t bmask = vdupq_n_u8(0xc0);
+    for (; i + 16 <= n; i += 16) {
+        uint8x16x4_t in = vld4q_u8(src + (size_t)i * 4);
+        uint8x16_t v = vshrq_n_u8(in.val[2], 5);
+        v = vorrq_u8(v, vshlq_n_u8(vshrq_n_u8(in.val[1], 5), 3));
+        v = vorrq_u8(v, vandq_u8(in.val[0], bmask));
+        vst1q_u8(dst + i, v);
+    }
+#endif
+    for (; i < n; i++) {
+        const uint8_t* s = src + (size_t)i * 4;
+        dst[i] = (uint8_t)((s[2] >> 5) | ((s[1] >> 5) << 3) | (s[0] & 0xc0));
+    }
+}
+
+/* Any true-color format: per-channel lookup tables, then pack into 1/2/4 bytes */
+static void conv_generic(uint8_t* dst, const uint8_t* src, int n, const struct pixconv* pc) {
+    const struct pixfmt* sf = &pc->src;
+    int be = pc->dst.big_endian;
+    for (int i = 0; i < n; i++) {
+        uint32_t s;
+        memcpy(&s, src + (size_t)i * 4, 4);
+        uint32_t v = pc->lut_r[(s >> sf->rshift) & (uint32_t)sf->rmax] |
+                     pc->lut_g[(s >> sf->gshift) & (uint32_t)sf->gmax] |
+                     pc->lut_b[(s >> sf->bshift) & (uint32_t)sf->bmax];
+        uint8_t* d = dst + (size_t)i * (size_t)pc->bytes;
+        for (int k = 0; k < pc->bytes; k++) {
+            int sh = 8 * (be ? pc->bytes - 1 - k : k);
+            d[k] = (uint8_t)(v >> sh);
+        }
+    }
+}
+
+/*
+ * Scale a channel value from [0, smax] to [0, dmax].
+ * Bit-replication-compatible truncation when both maxima are 2^n - 1 (what the fast
+ * kernels do with plain shifts), proportional otherwise.
+ */
+static uint32_t scale_channel(uint32_t v, int smax, int dmax) {
+    if (((smax + 1) & smax) == 0 && ((dmax + 1) & dmax) == 0 && dmax <= smax) {
+        int sbits = 0, dbits = 0;
+        while ((1 << sbits) <= smax) sbits++;
+        while ((1 << dbits) <= dmax) dbits++;
+        return v >> (sbits - dbits);
+    }
+    return (uint32_t)(((uint64_t)v * (uint64_t)dmax + (uint64_t)smax / 2) / (uint64_t)smax);
+}
+
+/*
+ * pixconv_init() — pick the tightest conversion kernel for a (server, client) format pair
+ *
+ * Returns 0 on success, -1 if the client format is unsupported (color maps, odd bpp).
+ */
+static int pixconv_init(struct pixconv* pc, const struct pixfmt* src, const struct pixfmt* dst) {
+    if (!dst->true_color) return -1;
+    if (dst->bpp != 8 && dst->bpp != 16 && dst->bpp != 32) return -1;
+    if (!dst->rmax || !dst->gmax || !dst->bmax) return -1;
+    if (dst->rmax > 255 || dst->gmax > 255 || dst->bmax > 255) return -1;
+
+    memset(pc, 0, sizeof(*pc));
+    pc->src = *src;
+    pc->dst = *dst;
+    pc->bytes = dst->bpp / 8;
+
+    /* ZRLE CPIXEL: a 32bpp pixel whose color bits fit into 3 of its 4 bytes */
+    uint32_t used = ((uint32_t)dst->rmax << dst->rshift) |
+                    ((uint32_t)dst->gmax << dst->gshift) |
+                    ((uint32_t)dst->bmax << dst->bshift);
+    pc->cpixel_len = pc->bytes;
+    if (dst->bpp == 32 && dst->depth <= 24) {
+        if (used < (1u << 24)) {              /* in the least significant 3 bytes */
+            pc->cpixel_len = 3;
+            pc->cpixel_off = dst->big_endian ? 1 : 0;
+        } else if ((used & 0xff) == 0) {      /* in the most significant 3 bytes */
+            pc->cpixel_len = 3;
+            pc->cpixel_off = dst->big_endian ? 0 : 1;
+        }
+    }
+
+    if (pixfmt_equal(src, dst)) {
+        pc->identity = 1;
+        pc->mask = ((uint32_t)src->rmax << src->rshift) |
+                   ((uint32_t)src->gmax << src->gshift) |
+                   ((uint32_t)src->bmax << src->bshift);
+        pc->fn = conv_mask32;
+        pc->name = "native";
+        return 0;
+    }
+
+    if (pixfmt_is_bytewise32(src) && !src->big_endian && pixfmt_is_bytewise32(dst)) {
+        memset(pc->shuf, 0xff, sizeof(pc->shuf));
+        int sh[3][2] = { { src->rshift, dst->rshift },
+                         { src->gshift, dst->gshift },
+                         { src->bshift, dst->bshift } };
+        for (int c = 0; c < 3; c++) {
+            int db = sh[c][1] / 8;
+            if (dst->big_endian) db = 3 - db;
+            pc->shuf[db] = (uint8_t)(sh[c][0] / 8);
+        }
+        pc->fn = conv_shuffle32;
+        pc->name = dst->big_endian ? "32bpp byte-swapped" : "32bpp reordered";
+        return 0;
+    }
+
+    if (pixfmt_is_xrgb8888(src) && dst->bpp == 16 &&
+        dst->rmax == 31 && dst->gmax == 63 && dst->bmax == 31 &&
+        dst->rshift == 11 && dst->gshift == 5 && dst->bshift == 0) {
+        pc->fn = conv_rgb565;
+        pc->name = "RGB565";
+        return 0;
+    }
+
+    if (pixfmt_is_xrgb8888(src) && dst->bpp == 8 &&
+        dst->rmax == 7 && dst->gmax == 7 && dst->bmax == 3 &&
+        dst->rshift == 0 && dst->gshift == 3 && dst->bshift == 6) {
+        pc->fn = conv_bgr233;
+        pc->name = "BGR233";
+        return 0;
+    }
+
+    for (int v = 0; v < 256; v++) {
+        if (v <= src->rmax) pc->lut_r[v] = scale_channel((uint32_t)v, src->rmax, dst->rmax) << dst->rshift;
+        if (v <= src->gmax) pc->lut_g[v] = scale_channel((uint32_t)v, src->gmax, dst->gmax) << dst->gshift;
+        if (v <= src->bmax) pc->lut_b[v] = scale_channel((uint32_t)v, src->bmax, dst->bmax) << dst->bshift;
+    }
+    pc->fn = conv_generic;
+    pc->name = "generic";
+    return 0;
+}
+
+/* RFB encoding numbers we know about */
+#define ENC_RAW      0
+#define ENC_COPYRECT 1
+#define ENC_HEXTILE  5
+#define ENC_TIGHT    7
+#define ENC_ZRLE     16
+
+/* Pseudo-encodings: capabilities announced in SetEncodings, never used for rectangles */
+#define ENC_FENCE             -312
+#define ENC_CONTINUOUS        -313
+#define ENC_EXT_DESKTOP_SIZE  -308  /* ExtendedDesktopSize: the viewer picks its view */
+#define ENC_CURSOR            -239  /* Cursor: the viewer draws the pointer from our shape */
+#define ENC_POINTER_POS       -232  /* PointerPos: ... and moves it where we say */
+#define ENC_QUALITY_0         -32   /* JPEG quality levels 0 (-32) to 9 (-23) */
+#define ENC_QUALITY_9         -23
+
+/* Fence flags (see client_fence()) */
+#define FENCE_BLOCK_BEFORE    (1u << 0)
+#define FENCE_BLOCK_AFTER     (1u << 1)
+#define FENCE_SYNC_NEXT       (1u << 2)
+#define FENCE_REQUEST         (1u << 31)
+#define FENCE_FLAGS           (FENCE_BLOCK_BEFORE | FENCE_BLOCK_AFTER | FENCE_SYNC_NEXT)
+#define FENCE_PAYLOAD_MAX     64
+
+/*
+ * A detected move (see "Move detection" below), sent as CopyRect: dst, in whole tiles,
+ * holds what the previous frame had at dst shifted by (-dx, -dy).
+ */
+struct move {
+    struct rect dst;
+    int dx, dy;
+};
+
+/* CopyRects queued for one client until its next update */
+#define MAX_COPIES 64
+
+/* Longest SetEncodings list we remember (real viewers send ~20 entries) */
+#define MAX_ENCODINGS 64
+
+struct enc_group;
+
+/*
+ * Per-connection state
+ *
+ * Everything that depends on what one viewer asked for lives here: its outstanding update
+ * request, the tiles it has not seen yet, the encodings it advertised in SetEncodings, and
+ * the encoder state that must persist across updates for it (ZRLE uses one zlib stream for
+ * the whole connection). Up to --max-clients of these are served at once.
+ */
+enum client_state {
+    CL_VERSION,     /* waiting for the client's ProtocolVersion */
+    CL_SECURITY,    /* waiting for its security type choice */
+    CL_INIT,        /* waiting for ClientInit */
+    CL_NORMAL,      /* handshake done: normal client messages */
+};
+
+struct client {
+    int fd;                           /* -1 once dropped (freed after the event batch) */
+    enum client_state state;
+    int refused;                      /* over --max-clients: send a reason, then close */
+    int local;                        /* connected over --unix: no TCP state to ask about */
+    int record;                       /* the --record viewer: fd is the recording file */
+    int closing;                      /* close as soon as the output queue has drained */
+    int64_t deadline;                 /* handshake must be done by then (now_ms()), or 0 */
+    int64_t connected_us;             /* now_us() at accept, 0 once its first frame is out */
+    int first_sent;                   /* its first update has been handed to the socket */
+    uint32_t events;                  /* epoll interest currently registered */
+    struct client* next_dead;
+
+    struct buf in;                    /* received bytes not parsed yet (partial message) */
+    uint32_t skip;                    /* ClientCutText bytes still to be discarded */
+    struct buf wq;                    /* output the socket didn't take yet */
+    size_t wq_off;                    /* first unsent byte in wq */
+
+    struct update_request req;
+
+    /* Backpressure and adaptive frame rate (see client_due()) */
+    uint64_t tx_bytes;                /* bytes handed to the kernel so far */
+    uint64_t acked_prev;              /* tx_bytes - SIOCOUTQ at the previous sample */
+    int64_t sample_at;                /* now_ms() of the previous sample */
+    int busy_prev;                    /* socket had a backlog at the previous sample */
+    uint32_t rate;                    /* measured drain rate in bytes/s, 0 = unknown */
+    uint32_t rtt_ms;                  /* smoothed RTT from TCP_INFO */
+    int interval;                     /* this client's frame interval in ms */
+    int64_t last_frame;               /* now_ms() when the last update went out */
+    size_t last_size;                 /* bytes in the last update */
+    unsigned skipped;                 /* frame ticks held back because of backlog */
+    int due;                          /* scratch: may be answered in this frame */
+    int64_t fps_logged;               /* rate-limits the "client fps" log line */
+
+    int32_t encodings[MAX_ENCODINGS]; /* SetEncodings list, in the client's preference order */
+    int nencodings;
+    int32_t encoding;                 /* what we actually send: first supported entry */
+    int copyrect;                     /* CopyRect is in the list */
+    int quality;                      /* Tight JPEG quality (1-100), 0 = lossless only */
+    struct move copies[MAX_COPIES];   /* moves for the next update, in order (see client_take_moves()) */
+    int ncopies;
+    int fence;                        /* Fence supported, and our own fence sent to say so */
+    int continuous;                   /* ContinuousUpdates supported, and announced */
+    uint8_t sync_fence[9 + FENCE_PAYLOAD_MAX]; /* reply held for a SyncNext fence ... */
+    size_t sync_len;                  /* ... its length, 0 = none */
+    int scale;                        /* 1, 2 or 4: the view of the screen it is sent (--scale) */
+    int ext_desktop;                  /* ExtendedDesktopSize supported */
+    int layout_due;                   /* screen layout owed at the head of the next update ... */
+    uint8_t layout_reason;            /* ... its reason (0 = server, 1 = this client asked) ... */
+    uint8_t layout_status;            /* ... and the result of the client's SetDesktopSize */
+    int cursor;                       /* Cursor supported: it draws the pointer itself */
+    int cursor_due;                   /* cursor shape owed in the next update */
+    int pointer_pos;                  /* PointerPos supported */
+    uint32_t pointer_seen;            /* srv->pointer.seq it was last sent, or moved it to */
+
+    struct pixconv conv;              /* server -> client pixel format (SetPixelFormat) */
+    struct enc_group* group;          /* shared encode cache; NULL for zero-copy RAW */
+    uint8_t* dirty;                   /* ntiles flags (of its view): changed since last sent */
+
+    struct arena* mem;                /* this viewer's pool (see client_attach_mem()), NULL = heap */
+    struct buf out;                   /* headers + encoded rectangle payloads */
+    struct buf scratch;               /* per-rect encoder scratch (e.g. ZRLE before zlib) */
+#ifdef HAVE_ZLIB
+    z_stream zs;                      /* persistent ZRLE deflate stream */
+    int zs_ready;
+    int zs_restart;                   /* full flush before the next ZRLE data (--record keyframe) */
+    z_stream tz[3];                   /* Tight streams: full colour, mono, indexed */
+    int tz_ready[3];
+#endif
+};
+
+static const char* encoding_name(int32_t enc) {
+    switch (enc) {
+    case ENC_RAW:     return "RAW";
+    case ENC_HEXTILE: return "Hextile";
+    case ENC_TIGHT:   return "Tight";
+    case ENC_ZRLE:    return "ZRLE";
+    default:       return "?";
+    }
+}
+
+/*
+ * client_pick_encoding() — choose the encoding for a client from its SetEncodings list
+ *
+ * Viewers list encodings in order of preference, so the first one we implement wins.
+ * RAW is mandatory in RFB and is the fallback when nothing else matches. CopyRect
+ * isn't an alternative but an addition, so wherever it appears it is used for moves.
+ * With Tight, a JPEG quality level in the list sets the JPEG quality, as TigerVNC maps
+ * them; without one the client gets --jpeg-quality (default_quality, 0 = lossless).
+ */
+static void client_pick_encoding(struct client* cl, int default_quality) {
+    static const uint8_t level_quality[10] = { 15, 29, 41, 42, 62, 77, 79, 86, 92, 100 };
+    int level = -1;
+    cl->encoding = ENC_RAW;
+    cl->copyrect = 0;
+    cl->quality = 0;
+    for (int i = 0; i < cl->nencodings; i++) {
+        int32_t e = cl->encodings[i];
+        if (e == ENC_COPYRECT) cl->copyrect = 1;
+        if (e >= ENC_QUALITY_0 && e <= ENC_QUALITY_9 && level < 0) level = e - ENC_QUALITY_0;
+    }
+    for (int i = 0; i < cl->nencodings; i++) {
+        int32_t e = cl->encodings[i];
+        if (e == ENC_RAW) break;
+        if (e == ENC_HEXTILE) { cl->encoding = e; break; }
+#ifdef HAVE_ZLIB
+        if (e == ENC_ZRLE || e == ENC_TIGHT) { cl->encoding = e; break; }
+#endif
+    }
+#ifdef HAVE_LIBJPEG
+    if (cl->encoding == ENC_TIGHT) cl->quality = level >= 0 ? level_quality[level] : default_quality;
+#else
+    (void)level_quality;
+    (void)default_quality;
+#endif
+}
+
+/* Release per-client encoder state and buffers (the socket is closed by the caller) */
+static void client_free(struct client* cl) {
+#ifdef HAVE_ZLIB
+    if (cl->zs_ready) deflateEnd(&cl->zs);
+    cl->zs_ready = 0;
+    for (int i = 0; i < 3; i++) {
+        if (cl->tz_ready[i]) deflateEnd(&cl->tz[i]);
+        cl->tz_ready[i] = 0;
+    }
+#endif
+    buf_free(&cl->out);
+    buf_free(&cl->scratch);
+    buf_free(&cl->in);
+    buf_free(&cl->wq);
+    free(cl->dirty);
+    cl->dirty = NULL;
+    if (cl->mem) pool_release(cl->mem);
+    cl->mem = NULL;
+}
+
+/*
+ * Statistics
+ * ----------
+ * Process-wide counters, to show what the server costs the printer. They are reported
+ * by --stats-log (a periodic stderr summary) and --stats (a scrape endpoint).
+ * Times go into log2 histograms in microseconds: bucket i counts samples below 2^i us.
+ * System calls are counted where the event loop makes them.
+ */
+#define HIST_BUCKETS 24 /* the last one also takes everything above ~8 s */
+
+struct hist {
+    uint64_t count;
+    uint64_t sum_us;
+    uint64_t bucket[HIST_BUCKETS];
+};
+
+/* Encodings as counted by the statistics */
+enum { ST_RAW, ST_HEXTILE, ST_ZRLE, ST_TIGHT, ST_ENCODINGS };
+
+/* System calls, by kind */
+enum { SYS_EPOLL, SYS_READ, SYS_WRITE, SYS_IOCTL, SYS_SOCKOPT, SYS_TIMER, SYS_ACCEPT, SYS_KINDS };
+
+static const char* const sys_names[SYS_KINDS] = {
+    "epoll", "read", "write", "ioctl", "sockopt", "timer", "accept"
+};
+
+struct stats {
+    uint64_t scans;             /* framebuffer scans (frames captured) */
+    uint64_t scans_changed;     /* ... that found changed tiles */
+    uint64_t ticks_idle;        /* frame ticks with no client due: no scan */
+    uint64_t ticks_gated;       /* scans skipped: page-flipping UI, no flip */
+    uint64_t updates;           /* FramebufferUpdates sent */
+    uint64_t updates_held;      /* updates held back by backpressure */
+    uint64_t heap_allocs;       /* buffers that outgrew their arena slice (see heap_allocs) */
+    uint64_t moves;             /* moves detected (see moves_find()) */
+    uint64_t copyrects;         /* CopyRect rectangles sent */
+    uint64_t tiles_cached;      /* whole tiles sent from a current cache entry, not encoded */
+    uint64_t shm_frames;        /* frames published to the --shm ring */
+    uint64_t record_bytes;      /* bytes written to the --record file */
+    uint64_t rects[ST_ENCODINGS];
+    uint64_t bytes[ST_ENCODINGS];
+    uint64_t sys[SYS_KINDS];
+    struct hist capture;        /* one framebuffer scan */
+    struct hist encode;         /* building one update (encoding, cache lookups) */
+    struct hist send;           /* handing one update to the socket */
+    struct hist first_frame;    /* accept to the first update fully written to the socket */
+};
+
+static struct stats stats;
+
+static int stats_slot(int32_t enc) {
+    switch (enc) {
+    case ENC_HEXTILE: return ST_HEXTILE;
+    case ENC_ZRLE:    return ST_ZRLE;
+    case ENC_TIGHT:   return ST_TIGHT;
+    default:          return ST_RAW;
+    }
+}
+
+static void hist_add(struct hist* h, int64_t us) {
+    int b = 0;
+    if (us < 0) us = 0;
+    while (b < HIST_BUCKETS - 1 && (us >> b)) b++;
+    h->count++;
+    h->sum_us += (uint64_t)us;
+    h->bucket[b]++;
+}
+
+/* hist_quantile() — upper bound (us) of the bucket holding quantile q of cur minus prev */
+static uint64_t hist_quantile(const struct hist* cur, const struct hist* prev, double q) {
+    uint64_t n = cur->count - prev->count, seen = 0;
+    if (!n) return 0;
+    for (int b = 0; b < HIST_BUCKETS; b++) {
+        seen += cur->bucket[b] - prev->bucket[b];
+        if ((double)seen >= q * (double)n) return (uint64_t)1 << b;
+    }
+    return (uint64_t)1 << (HIST_BUCKETS - 1);
+}
+
+/*
+ * Transport tuning
+ * ----------------
+ * Socket defaults suit bulk transfers, not a frame that should arrive as soon as it is
+ * complete, so viewer connections are set up for latency:
+ * - TCP_NODELAY: with Nagle, the tail segment of an update (and small messages such as
+ *   fence replies) waits for the previous segment's ACK, which a viewer's delayed ACK can
+ *   hold back for 40 ms or more.
+ * - MSG_MORE: without Nagle, an update that takes several writev() batches could leave
+ *   as a short segment per batch; all batches but the last are sent with MSG_MORE (a
+ *   cork for just that call), so segments go out full and the last one right away.
+ * - SO_SNDBUF: about one frame (--sndbuf), so an update normally goes straight into the
+ *   socket instead of trickling out of the output queue on EPOLLOUT, while a slow link
+ *   still backs up early enough for backpressure (client_due()) to notice. The kernel
+ *   doubles the value, capped by net.core.wmem_max; what it granted is logged.
+ * Accepted sockets inherit what the listening socket was given; they are set again anyway.
+ * Viewers on the --unix socket only get SO_SNDBUF: there is no Nagle to turn off there.
+ */
+struct transport {
+    int nodelay;                /* TCP_NODELAY */
+    int sndbuf;                 /* SO_SNDBUF to ask for in bytes, 0 = kernel autotuning */
+};
+
+/* transport_tune() — apply the options to a socket */
+static void transport_tune(int fd, const struct transport* tp) {
+    if (tp->nodelay) {
+        stats.sys[SYS_SOCKOPT]++;
+        setsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &tp->nodelay, sizeof(tp->nodelay));
+    }
+    if (tp->sndbuf) {
+        stats.sys[SYS_SOCKOPT]++;
+        setsockopt(fd, SOL_SOCKET, SO_SNDBUF, &tp->sndbuf, sizeof(tp->sndbuf));
+    }
+}
+
+/* transport_report() — log what a tuned socket actually got */
+static void transport_report(int fd, const struct transport* tp) {
+    int nodelay = 0, sndbuf = 0;
+    socklen_t len = sizeof(nodelay);
+    getsockopt(fd, IPPROTO_TCP, TCP_NODELAY, &nodelay, &len);
+    len = sizeof(sndbuf);
+    getsockopt(fd, SOL_SOCKET, SO_SNDBUF, &sndbuf, &len);
+    if (tp->sndbuf) {
+        fprintf(stderr, "fb0rfb: tcp: nodelay %s, sndbuf %d KB (asked %d KB), updates batched with MSG_MORE\n",
+                nodelay ? "on" : "off", sndbuf / 1024, tp->sndbuf / 1024);
+    } else {
+        fprintf(stderr, "fb0rfb: tcp: nodelay %s, sndbuf autotuned (%d KB now), updates batched with MSG_MORE\n",
+                nodelay ? "on" : "off", sndbuf / 1024);
+    }
+}
+
+/*
+ * Output queue
+ * ------------
+ * Client sockets are non-blocking. Data is offered to the socket directly first; only what
+ * the kernel did not take is copied into cl->wq and sent later from the EPOLLOUT handler.
+ * Zero-copy payloads (shadow lines, cached tiles) are therefore never referenced after the
+ * call that sends them: the next scan may overwrite them.
+ */
+static size_t client_queued(const struct client* cl) {
+    return cl->wq.len - cl->wq_off;
+}
+
+static int client_queue(struct client* cl, const void* data, size_t len) {
+    uint8_t* p = buf_append(&cl->wq, len);
+    if (!p) return -1;
+    memcpy(p, data, len);
+    return 0;
+}
+
+/*
+ * client_sendv() — send an iovec now if the socket takes it, queue the unsent remainder
+ *
+ * more is set when the caller has the rest of the message to follow right away (see
+ * "Transport tuning"). Returns 0 on success (sent or queued), -1 if the connection failed.
+ */
+static int client_sendv(struct client* cl, const struct iovec* iov, int iovcnt, int more) {
+    size_t sent = 0;
+    if (!client_queued(cl)) {
+        struct msghdr msg = { .msg_iov = (struct iovec*)iov, .msg_iovlen = (size_t)iovcnt };
+        ssize_t n;
+        do {
+            stats.sys[SYS_WRITE]++;
+            n = cl->record ? writev(cl->fd, iov, iovcnt) : sendmsg(cl->fd, &msg, more ? MSG_MORE : 0);
+        } while (n < 0 && errno == EINTR);
+        if (n < 0) {
+            if (errno != EAGAIN && errno != EWOULDBLOCK) return -1;
+            n = 0;
+        }
+        sent = (size_t)n;
+        cl->tx_bytes += sent;
+    }
+
+    for (int i = 0; i < iovcnt; i++) {
+        size_t len = iov[i].iov_len;
+        if (sent >= len) {
+            sent -= len;
+            continue;
+        }
+        if (client_queue(cl, (const uint8_t*)iov[i].iov_base + sent, len - sent)) return -1;
+        sent = 0;
+    }
+    return 0;
+}
+
+static int client_send(struct client* cl, const void* data, size_t len) {
+    struct iovec iov = { (void*)data, len };
+    return client_sendv(cl, &iov, 1, 0);
+}
+
+/* client_flush() — push queued output into the socket. Returns -1 if the connection failed. */
+static int client_flush(struct client* cl) {
+    while (client_queued(cl)) {
+        stats.sys[SYS_WRITE]++;
+        ssize_t n = write(cl->fd, cl->wq.data + cl->wq_off, client_queued(cl));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            if (errno == EAGAIN || errno == EWOULDBLOCK) return 0;
+            return -1;
+        }
+        cl->wq_off += (size_t)n;
+        cl->tx_bytes += (size_t)n;
+    }
+    cl->wq.len = 0;
+    cl->wq_off = 0;
+    return 0;
+}
+
+/*
+ * Small color palette with a hash index, used to classify tiles.
+ *
+ * ZRLE palettes hold up to 127 colors (Hextile reuses it to find the background); counting
+ * stops once we see a 128th distinct color (the tile is then "many colors" and only
+ * RLE/raw apply). Colors are packed client pixels (see pix_load()).
+ */
+#define PAL_MAX  127
+#define PAL_HASH 256 /* power of two, > 2 * PAL_MAX keeps probe chains short */
+
+struct palette {
+    int n;                     /* number of colors, PAL_MAX + 1 means "overflowed" */
+    uint32_t colors[PAL_MAX];
+    uint32_t key[PAL_HASH];
+    int16_t  idx[PAL_HASH];    /* -1 = empty slot */
+};
+
+static void palette_reset(struct palette* pal) {
+    pal->n = 0;
+    memset(pal->idx, 0xff, sizeof(pal->idx));
+}
+
+static inline unsigned palette_slot(uint32_t px) {
+    return (px * 2654435761u) >> 24; /* Knuth multiplicative hash, top 8 bits */
+}
+
+/* Index of px in the palette, adding it if new. Returns -1 once the palette overflowed. */
+static int palette_add(struct palette* pal, uint32_t px) {
+    unsigned h = palette_slot(px);
+    while (pal->idx[h] >= 0) {
+        if (pal->key[h] == px) return pal->idx[h];
+        h = (h + 1) & (PAL_HASH - 1);
+    }
+    if (pal->n >= PAL_MAX) {
+        pal->n = PAL_MAX + 1;
+        return -1;
+    }
+    pal->key[h] = px;
+    pal->idx[h] = (int16_t)pal->n;
+    pal->colors[pal->n] = px;
+    return pal->n++;
+}
+
+/*
+ * Hextile encoding (RFB encoding 5)
+ * ---------------------------------
+ * Dependency-free alternative to ZRLE for builds without zlib. A rectangle is cut into
+ * 16x16 subtiles (left-to-right, top-to-bottom), each starting with a flags byte:
+ *   Raw(1)                 raw pixels follow, nothing else
+ *   BackgroundSpecified(2) new background pixel follows
+ *   ForegroundSpecified(4) new foreground pixel follows
+ *   AnySubrects(8)         subrect count + subrects follow
+ *   SubrectsColoured(16)   every subrect carries its own pixel
+ * Background/foreground carry over between subtiles, so a run of flat tiles with the same
+ * color costs one byte each. A subrect is (x<<4|y, (w-1)<<4|(h-1)).
+ *
+ * Subrects are found greedily: each uncovered non-background pixel grows right, then down,
+ * as far as the color holds. If that costs more than raw pixels the subtile is sent raw.
+ */
+#define HEXTILE_RAW        1
+#define HEXTILE_BG         2
+#define HEXTILE_FG         4
+#define HEXTILE_SUBRECTS   8
+#define HEXTILE_COLOURED   16
+
+struct hextile_state {
+    uint32_t bg, fg;
+    int bg_valid, fg_valid; /* cleared after a raw subtile (decoders disagree on it) */
+};
+
+static int hextile_encode_subtile(struct buf* out, struct hextile_state* st, struct palette* pal,
+                                  const uint8_t* src, int pitch, int bpp, int tw, int th) {
+    uint32_t px[256];
+    uint16_t count[PAL_MAX];
+    uint8_t covered[256];
+    int npix = tw * th;
+    size_t raw_cost = (size_t)npix * (size_t)bpp;
+
+    /* Worst case: flags + raw pixels (anything costlier than that is sent raw) */
+    if (buf_reserve(out, 1 + raw_cost)) return -1;
+    uint8_t* start = out->data + out->len;
+
+    /* Load the subtile and find the most frequent color (the background) */
+    palette_reset(pal);
+    int bg_idx = 0;
+    for (int y = 0; y < th; y++) {
+        const uint8_t* row = src + (size_t)y * (size_t)pitch;
+        for (int x = 0; x < tw; x++) {
+            uint32_t v = pix_load(row + (size_t)x * (size_t)bpp, bpp);
+            px[y * tw + x] = v;
+            if (pal->n > PAL_MAX) continue;
+            int n0 = pal->n;
+            int i = palette_add(pal, v);
+            if (i < 0) continue;
+            if (i == n0) count[i] = 0;
+            if (++count[i] > count[bg_idx]) bg_idx = i;
+        }
+    }
+
+    if (pal->n <= PAL_MAX) {
+        int ncolors = pal->n;
+        int mono = ncolors == 2;
+        uint32_t bg = pal->colors[bg_idx];
+        uint32_t fg = mono ? pal->colors[bg_idx ^ 1] : 0;
+        uint8_t flags = 0;
+        uint8_t* p = start + 1;
+        uint8_t* end = start + 1 + raw_cost;
+
+        if (!st->bg_valid || st->bg != bg) {
+            flags |= HEXTILE_BG;
+            p = pix_store(p, bg, bpp);
+        }
+        if (mono && (!st->fg_valid || st->fg != fg)) {
+            flags |= HEXTILE_FG;
+            p = pix_store(p, fg, bpp);
+        }
+
+        int ok = 1;
+        if (ncolors > 1) {
+            flags |= HEXTILE_SUBRECTS | (mono ? 0 : HEXTILE_COLOURED);
+            uint8_t* nsub = p++;
+            int nsubrects = 0;
+            int sub_cost = mono ? 2 : 2 + bpp;
+            memset(covered, 0, (size_t)npix);
+
+            for (int y = 0; y < th && ok; y++) {
+                for (int x = 0; x < tw; x++) {
+                    int i = y * tw + x;
+                    uint32_t c = px[i];
+                    if (c == bg || covered[i]) continue;
+
+                    int w = 1;
+                    while (x + w < tw && px[i + w] == c && !covered[i + w]) w++;
+                    int h = 1;
+                    for (; y + h < th; h++) {
+                        const uint32_t* r = &px[(y + h) * tw + x];
+                        const uint8_t* cv = &covered[(y + h) * tw + x];
+                        int k = 0;
+                        while (k < w && r[k] == c && !cv[k]) k++;
+                        if (k < w) break;
+                    }
+                    for (int yy = 0; yy < h; yy++) memset(&covered[(y + yy) * tw + x], 1, (size_t)w);
+
+                    if (p + sub_cost > end) { ok = 0; break; }
+                    if (!mono) p = pix_store(p, c, bpp);
+                    *p++ = (uint8_t)((x << 4) | y);
+                    *p++ = (uint8_t)(((w - 1) << 4) | (h - 1));
+                    nsubrects++;
+                    x += w - 1;
+                }
+            }
+            *nsub = (uint8_t)nsubrects;
+        }
+
+        if (ok) {
+            start[0] = flags;
+            out->len += (size_t)(p - start);
+            st->bg = bg;
+            st->bg_valid = 1;
+            if (mono) {
+                st->fg = fg;
+                st->fg_valid = 1;
+            }
+            return 0;
+        }
+        /* Too many subrects: fall through to raw */
+    }
+
+    uint8_t* p = start;
+    *p++ = HEXTILE_RAW;
+    for (int i = 0; i < npix; i++) p = pix_store(p, px[i], bpp);
+    out->len += (size_t)(p - start);
+    st->bg_valid = st->fg_valid = 0;
+    return 0;
+}
+
+/*
+ * hextile_encode_rect() — append the Hextile subtiles of a w x h block of client pixels
+ *
+ * pal is the calling thread's classification scratch.
+ */
+static int hextile_encode_rect(const uint8_t* src, int pitch, int bpp, int w, int h,
+                               struct palette* pal, struct buf* out) {
+    struct hextile_state st;
+    memset(&st, 0, sizeof(st));
+
+    for (int ty = 0; ty < h; ty += 16) {
+        int th = h - ty < 16 ? h - ty : 16;
+        for (int tx = 0; tx < w; tx += 16) {
+            int tw = w - tx < 16 ? w - tx : 16;
+            const uint8_t* tsrc = src + (size_t)ty * (size_t)pitch + (size_t)tx * (size_t)bpp;
+            if (hextile_encode_subtile(out, &st, pal, tsrc, pitch, bpp, tw, th)) return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/*
+ * ZRLE encoding (RFB encoding 16)
+ * -------------------------------
+ * A rectangle is cut into 64x64 tiles (left-to-right, top-to-bottom). Each tile starts with
+ * a subencoding byte:
+ *   0        raw CPIXELs
+ *   1        solid color: one CPIXEL
+ *   2..16    packed palette: palette + 1/2/4-bit indices, each row padded to a byte
+ *   128      plain RLE: (CPIXEL, run length) pairs
+ *   130..255 palette RLE: palette + (index | 0x80 + run length) or bare index for runs of 1
+ * Run lengths are coded as (len-1) in base 255: 255,255,...,rest. Runs continue across rows.
+ *
+ * The per-rect tile stream is then deflated on the client's single zlib stream and sent as
+ * u32 length + data. A CPIXEL is a client pixel, minus the spare byte when a 32bpp format
+ * only uses three (see pixconv_init()).
+ *
+ * The flat Centauri UI mostly ends up as solid or small-palette tiles.
+ */
+#define ZRLE_TILE 64
+#define ZLIB_LEVEL 3 /* cheap on the printer's ARM core; flat UI compresses well anyway */
+
+/* Index of a color already in the palette */
+static int palette_find(const struct palette* pal, uint32_t px) {
+    unsigned h = palette_slot(px);
+    while (pal->key[h] != px) h = (h + 1) & (PAL_HASH - 1);
+    return pal->idx[h];
+}
+
+static inline uint8_t* put_cpixel(uint8_t* p, uint32_t px, const struct pixconv* pc) {
+    uint8_t tmp[4];
+    pix_store(tmp, px, pc->bytes);
+    memcpy(p, tmp + pc->cpixel_off, (size_t)pc->cpixel_len);
+    return p + pc->cpixel_len;
+}
+
+/* Bytes needed for a ZRLE run length */
+static inline size_t zrle_runlen_bytes(size_t len) {
+    return (len - 1) / 255 + 1;
+}
+
+static uint8_t* zrle_put_runlen(uint8_t* p, size_t len) {
+    len -= 1;
+    while (len >= 255) { *p++ = 255; len -= 255; }
+    *p++ = (uint8_t)len;
+    return p;
+}
+
+/* Emit one finished run (plain RLE or palette RLE) */
+static uint8_t* zrle_put_run(uint8_t* p, const struct palette* pal, int use_pal,
+                             uint32_t px, size_t run, const struct pixconv* pc) {
+    if (!use_pal) {
+        p = put_cpixel(p, px, pc);
+        return zrle_put_runlen(p, run);
+    }
+    int idx = palette_find(pal, px);
+    if (run == 1) {
+        *p++ = (uint8_t)idx;
+        return p;
+    }
+    *p++ = (uint8_t)(idx | 0x80);
+    return zrle_put_runlen(p, run);
+}
+
+/*
+ * zrle_encode_tile() — append one ZRLE tile of client pixels to out
+ *
+ * One pass collects the palette and the RLE costs, then the cheapest subencoding is
+ * emitted in a second pass. Returns 0 on success, -1 on allocation failure.
+ */
+static int zrle_encode_tile(struct buf* out, struct palette* pal, const struct pixconv* pc,
+                            const uint8_t* src, int pitch, int tw, int th) {
+    const int bpp = pc->bytes;
+    const size_t cl = (size_t)pc->cpixel_len;
+    size_t npix = (size_t)tw * (size_t)th;
+
+    /* Pass 1: palette + run statistics */
+    palette_reset(pal);
+    size_t plain_rle = 0, pal_rle = 0, run = 0;
+    uint32_t run_px = 0;
+    for (int y = 0; y < th; y++) {
+        const uint8_t* row = src + (size_t)y * (size_t)pitch;
+        for (int x = 0; x < tw; x++) {
+            uint32_t px = pix_load(row + (size_t)x * (size_t)bpp, bpp);
+            if (run && px == run_px) { run++; continue; }
+            if (run) {
+                plain_rle += cl + zrle_runlen_bytes(run);
+                pal_rle   += run == 1 ? 1 : 1 + zrle_runlen_bytes(run);
+            }
+            run_px = px;
+            run = 1;
+            if (pal->n <= PAL_MAX) palette_add(pal, px);
+        }
+    }
+    plain_rle += cl + zrle_runlen_bytes(run);
+    pal_rle   += run == 1 ? 1 : 1 + zrle_runlen_bytes(run);
+
+    int n = pal->n;
+    if (n == 1) {
+        uint8_t* p = buf_append(out, 1 + cl);
+        if (!p) return -1;
+        p[0] = 1;
+        put_cpixel(p + 1, pal->colors[0], pc);
+        return 0;
+    }
+
+    /* Cost of each candidate subencoding (bytes before zlib) */
+    size_t best = npix * cl;
+    int sub = 0;
+    int bits = n <= 2 ? 1 : n <= 4 ? 2 : 4;
+    if (n <= 16) {
+        size_t packed = (size_t)n * cl + (size_t)th * (((size_t)tw * (size_t)bits + 7) / 8);
+        if (packed < best) { best = packed; sub = n; }
+    }
+    if (n <= PAL_MAX) {
+        size_t prle = (size_t)n * cl + pal_rle;
+        if (prle < best) { best = prle; sub = 128 + n; }
+    }
+    if (plain_rle < best) { best = plain_rle; sub = 128; }
+
+    uint8_t* p = buf_append(out, 1 + best);
+    if (!p) return -1;
+    uint8_t* end = p + 1 + best;
+    *p++ = (uint8_t)sub;
+
+    if (sub == 0) {
+        for (int y = 0; y < th; y++) {
+            const uint8_t* row = src + (size_t)y * (size_t)pitch;
+            for (int x = 0; x < tw; x++) p = put_cpixel(p, pix_load(row + (size_t)x * (size_t)bpp, bpp), pc);
+        }
+    } else if (sub <= 16) {
+        for (int i = 0; i < n; i++) p = put_cpixel(p, pal->colors[i], pc);
+        for (int y = 0; y < th; y++) {
+            const uint8_t* row = src + (size_t)y * (size_t)pitch;
+            unsigned acc = 0, nbits = 0;
+            for (int x = 0; x < tw; x++) {
+                acc = (acc << bits) | (unsigned)palette_find(pal, pix_load(row + (size_t)x * (size_t)bpp, bpp));
+                nbits += (unsigned)bits;
+                if (nbits == 8) { *p++ = (uint8_t)acc; acc = 0; nbits = 0; }
+            }
+            if (nbits) *p++ = (uint8_t)(acc << (8 - nbits));
+        }
+    } else {
+        int use_pal = sub != 128;
+        if (use_pal) {
+            for (int i = 0; i < n; i++) p = put_cpixel(p, pal->colors[i], pc);
+        }
+        run = 0;
+        for (int y = 0; y < th; y++) {
+            const uint8_t* row = src + (size_t)y * (size_t)pitch;
+            for (int x = 0; x < tw; x++) {
+                uint32_t px = pix_load(row + (size_t)x * (size_t)bpp, bpp);
+                if (run && px == run_px) { run++; continue; }
+                if (run) p = zrle_put_run(p, pal, use_pal, run_px, run, pc);
+                run_px = px;
+                run = 1;
+            }
+        }
+        p = zrle_put_run(p, pal, use_pal, run_px, run, pc);
+    }
+    return p == end ? 0 : -1;
+}
+
+/*
+ * zrle_encode_tiles() — append the (not yet compressed) ZRLE tile stream for a block of
+ * client pixels
+ *
+ * This part only depends on the pixels and the pixel format, so its output can be cached
+ * and shared by every ZRLE client with the same format; only the deflate step below is
+ * per client. pal is the calling thread's classification scratch. Returns 0 on success,
+ * -1 on allocation failure.
+ */
+static int zrle_encode_tiles(const struct pixconv* pc, const uint8_t* src, int pitch, int w, int h,
+                             struct palette* pal, struct buf* out) {
+    const int bpp = pc->bytes;
+
+    for (int ty = 0; ty < h; ty += ZRLE_TILE) {
+        int th = h - ty < ZRLE_TILE ? h - ty : ZRLE_TILE;
+        for (int tx = 0; tx < w; tx += ZRLE_TILE) {
+            int tw = w - tx < ZRLE_TILE ? w - tx : ZRLE_TILE;
+            const uint8_t* tsrc = src + (size_t)ty * (size_t)pitch + (size_t)tx * (size_t)bpp;
+            if (zrle_encode_tile(out, pal, pc, tsrc, pitch, tw, th)) return -1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * zlib's allocator hooks: the deflate state (~270 KB at the default window and memLevel)
+ * comes from the viewer's pool, and is released with it.
+ */
+static voidpf zlib_alloc(voidpf opaque, uInt items, uInt size) {
+    void* p = arena_alloc((struct arena*)opaque, (size_t)items * size);
+    if (p) return p;
+    atomic_fetch_add_explicit(&heap_allocs, 1, memory_order_relaxed);
+    return calloc(items, size);
+}
+
+static void zlib_free(voidpf opaque, voidpf p) {
+    const struct arena* a = (const struct arena*)opaque;
+    if ((uint8_t*)p < a->base || (uint8_t*)p >= a->base + a->size) free(p);
+}
+
+/*
+ * stream_deflate() — append data compressed on one of the client's zlib streams
+ *
+ * The stream is set up on first use (window 2^wbits, zlib memLevel mem_level) and flushed
+ * with Z_SYNC_FLUSH, so the viewer can decode this rectangle right away while the
+ * dictionary keeps paying off across updates. Returns 0 on success, -1 on failure.
+ */
+static int stream_deflate(struct client* cl, z_stream* zs, int* ready, int wbits, int mem_level,
+                          const uint8_t* data, size_t len, struct buf* out) {
+    if (!*ready) {
+        memset(zs, 0, sizeof(*zs));
+        if (cl->mem) {
+            zs->zalloc = zlib_alloc;
+            zs->zfree = zlib_free;
+            zs->opaque = cl->mem;
+        }
+        if (deflateInit2(zs, ZLIB_LEVEL, Z_DEFLATED, wbits, mem_level, Z_DEFAULT_STRATEGY) != Z_OK) return -1;
+        *ready = 1;
+    }
+
+    zs->next_in  = (Bytef*)data;
+    zs->avail_in = (uInt)len;
+    do {
+        if (buf_reserve(out, deflateBound(zs, zs->avail_in) + 64)) return -1;
+        zs->next_out  = out->data + out->len;
+        zs->avail_out = (uInt)(out->cap - out->len);
+        if (deflate(zs, Z_SYNC_FLUSH) == Z_STREAM_ERROR) return -1;
+        out->len = out->cap - zs->avail_out;
+    } while (zs->avail_out == 0 || zs->avail_in > 0);
+    return 0;
+}
+
+/* zrle_deflate() — append u32 length + a tile stream compressed on the client's ZRLE stream */
+static int zrle_deflate(struct client* cl, const uint8_t* data, size_t len, struct buf* out) {
+    size_t len_off = out->len;
+    if (!buf_append(out, 4)) return -1;
+    if (cl->zs_restart && cl->zs_ready) {
+        /* A full flush before the data: nothing after it refers back (see "Recording") */
+        cl->zs.next_in = NULL;
+        cl->zs.avail_in = 0;
+        do {
+            if (buf_reserve(out, 64)) return -1;
+            cl->zs.next_out  = out->data + out->len;
+            cl->zs.avail_out = (uInt)(out->cap - out->len);
+            if (deflate(&cl->zs, Z_FULL_FLUSH) == Z_STREAM_ERROR) return -1;
+            out->len = out->cap - cl->zs.avail_out;
+        } while (cl->zs.avail_out == 0);
+    }
+    cl->zs_restart = 0;
+    if (stream_deflate(cl, &cl->zs, &cl->zs_ready, MAX_WBITS, 8, data, len, out)) return -1;
+    put32(out->data + len_off, (uint32_t)(out->len - len_off - 4));
+    return 0;
+}
+
+/* zrle_encode_rect() — append a complete ZRLE payload (built in cl->scratch, then deflated) */
+static int zrle_encode_rect(struct client* cl, const uint8_t* src, int pitch, int w, int h,
+                            struct palette* pal, struct buf* out) {
+    cl->scratch.len = 0;
+    if (zrle_encode_tiles(&cl->conv, src, pitch, w, h, pal, &cl->scratch)) return -1;
+    return zrle_deflate(cl, cl->scratch.data, cl->scratch.len, out);
+}
+
+/*
+ * Tight encoding (RFB encoding 7)
+ * -------------------------------
+ * Every rectangle (at most a tile here, see tiles_list()) starts with a compression
+ * control byte. Its low nibble would ask the viewer to reset zlib streams (we never do);
+ * the high nibble picks the method:
+ *   8      fill: one TPIXEL
+ *   9      JPEG: compact length + a JFIF image (HAVE_LIBJPEG builds)
+ *   0..7   basic: bits 4-5 pick one of the client's zlib streams, bit 6 says a filter
+ *          byte follows. Copy (no filter): TPIXELs. Palette (1): colours - 1, TPIXELs,
+ *          then 1-bit indices for 2 colours or 8-bit ones, rows padded to a byte.
+ *          Under 12 bytes the data is sent as is, else compact length + zlib data.
+ * A TPIXEL is R, G, B in 3 bytes for 32bpp formats with 8-bit channels, else a client
+ * pixel. A compact length is 1 to 3 bytes, 7 bits each, low bits first.
+ *
+ * The colour count of the tile decides: one colour is a fill, up to PAL_MAX a palette
+ * (lossless, and tiny on the flat UI); more is a camera image, a rendered thumbnail or a
+ * gradient, sent as JPEG at the client's quality, or as full colour on zlib if it wants
+ * no loss. Like ZRLE, the cache holds a tile before compression (tight_encode_tile()),
+ * and each client compresses on its own streams (tight_finish()). Full colour, mono and
+ * indexed data each get a stream of their own, their statistics differ.
+ */
+#define TIGHT_FILL      0x80
+#define TIGHT_JPEG      0x90
+#define TIGHT_FILTER    0x40        /* basic: explicit filter byte follows */
+#define TIGHT_PALETTE   1           /* filter id */
+#define TIGHT_MIN_ZLIB  12          /* smaller data is sent uncompressed */
+#define TIGHT_WBITS     13          /* tiles are small: an 8 KB window is plenty, at 1/4 the state */
+#define TIGHT_MEMLEVEL  6
+#define TIGHT_ZLIB_MEM  ((1 << (TIGHT_WBITS + 2)) + (1 << (TIGHT_MEMLEVEL + 9)) + 8192)
+
+/* TPIXEL size: 3 for 32bpp formats with 8-bit channels, else the client pixel size */
+static int tight_pixel_len(const struct pixconv* pc) {
+    const struct pixfmt* f = &pc->dst;
+    if (f->bpp == 32 && f->depth == 24 && f->rmax == 255 && f->gmax == 255 && f->bmax == 255) return 3;
+    return pc->bytes;
+}
+
+static uint8_t* tight_put_pixel(uint8_t* p, uint32_t px, const struct pixconv* pc, int len) {
+    if (len != 3) return pix_store(p, px, pc->bytes);
+    const struct pixfmt* f = &pc->dst;
+    if (f->big_endian) px = __builtin_bswap32(px);
+    *p++ = (uint8_t)(px >> f->rshift);
+    *p++ = (uint8_t)(px >> f->gshift);
+    *p++ = (uint8_t)(px >> f->bshift);
+    return p;
+}
+
+static size_t tight_put_length(uint8_t* p, size_t n) {
+    size_t k = 0;
+    p[k++] = (uint8_t)(n & 0x7f);
+    if (n > 0x7f) {
+        p[k - 1] |= 0x80;
+        p[k++] = (uint8_t)((n >> 7) & 0x7f);
+        if (n > 0x3fff) {
+            p[k - 1] |= 0x80;
+            p[k++] = (uint8_t)(n >> 14);
+        }
+    }
+    return k;
+}
+
+/*
+ * A cached Tight tile: control byte, u16 header length (host order), the header bytes that
+ * precede the data on the wire (filter, palette), then the data: what gets compressed,
+ * or for fills and JPEG everything else, sent as is.
+ */
+static uint8_t* tight_begin(struct buf* out, uint8_t ctl, size_t hdr_len) {
+    uint8_t* p = buf_append(out, 3 + hdr_len);
+    if (!p) return NULL;
+    uint16_t h = (uint16_t)hdr_len;
+    p[0] = ctl;
+    memcpy(p + 1, &h, 2);
+    return p + 3;
+}
+
+#ifdef HAVE_LIBJPEG
+/*
+ * JPEG tiles
+ *
+ * One compressor per encoding thread, in its enc_scratch, writing straight into the
+ * output buffer. libjpeg reports errors by calling error_exit(), which must not return:
+ * it jumps back to tight_jpeg(), and the tile is sent losslessly instead. libjpeg takes
+ * its per-image working memory from its own allocator, outside the arena.
+ */
+struct tight_jpeg {
+    struct jpeg_compress_struct c;
+    struct jpeg_error_mgr err;
+    struct jpeg_destination_mgr dest;
+    jmp_buf fail;
+    struct buf* out;
+    int ready;
+};
+
+static void jpeg_fail(j_common_ptr c) {
+    struct tight_jpeg* j = (struct tight_jpeg*)c->client_data;
+    longjmp(j->fail, 1);
+}
+
+static void jpeg_quiet(j_common_ptr c, int level) {
+    (void)c;
+    (void)level;
+}
+
+static void jpeg_dest_init(j_compress_ptr c) {
+    struct tight_jpeg* j = (struct tight_jpeg*)c->client_data;
+    if (buf_reserve(j->out, 2048)) longjmp(j->fail, 1);
+    j->dest.next_output_byte = j->out->data + j->out->len;
+    j->dest.free_in_buffer = j->out->cap - j->out->len;
+}
+
+static boolean jpeg_dest_full(j_compress_ptr c) {
+    struct tight_jpeg* j = (struct tight_jpeg*)c->client_data;
+    j->out->len = j->out->cap;
+    jpeg_dest_init(c);
+    return TRUE;
+}
+
+static void jpeg_dest_done(j_compress_ptr c) {
+    struct tight_jpeg* j = (struct tight_jpeg*)c->client_data;
+    j->out->len = j->out->cap - j->dest.free_in_buffer;
+}
+
+/*
+ * tight_jpeg() — append a JPEG tile, compressed from w x h server pixels at src
+ *
+ * Returns 0 on success, -1 if libjpeg failed (out is left as it was).
+ */
+static int tight_jpeg(struct tight_jpeg* j, const struct pixfmt* pf, int quality,
+                      const uint8_t* src, int stride, int w, int h, struct buf* out) {
+    size_t start = out->len;
+    JSAMPLE rgb[TILE_SIZE * 3];
+    JSAMPROW row = rgb;
+
+    if (!j->ready) {
+        j->c.err = jpeg_std_error(&j->err);
+        j->err.error_exit = jpeg_fail;
+        j->err.emit_message = jpeg_quiet;
+        j->c.client_data = j;
+        if (setjmp(j->fail)) return -1;
+        jpeg_create_compress(&j->c);
+        j->dest.init_destination = jpeg_dest_init;
+        j->dest.empty_output_buffer = jpeg_dest_full;
+        j->dest.term_destination = jpeg_dest_done;
+        j->c.dest = &j->dest;
+        j->ready = 1;
+    }
+
+    j->out = out;
+    if (setjmp(j->fail)) {
+        jpeg_abort_compress(&j->c);
+        out->len = start;
+        return -1;
+    }
+    j->c.image_width = (JDIMENSION)w;
+    j->c.image_height = (JDIMENSION)h;
+    j->c.input_components = 3;
+    j->c.in_color_space = JCS_RGB;
+    jpeg_set_defaults(&j->c);
+    jpeg_set_quality(&j->c, quality, TRUE);
+    jpeg_start_compress(&j->c, TRUE);
+    for (int y = 0; y < h; y++) {
+        const uint8_t* line = src + (size_t)y * (size_t)stride;
+        for (int x = 0; x < w; x++) {
+            uint32_t v;
+            memcpy(&v, line + (size_t)x * 4, 4);
+            rgb[x * 3 + 0] = (JSAMPLE)(((v >> pf->rshift) & pf->rmax) * 255 / pf->rmax);
+            rgb[x * 3 + 1] = (JSAMPLE)(((v >> pf->gshift) & pf->gmax) * 255 / pf->gmax);
+            rgb[x * 3 + 2] = (JSAMPLE)(((v >> pf->bshift) & pf->bmax) * 255 / pf->bmax);
+        }
+        jpeg_write_scanlines(&j->c, &row, 1);
+    }
+    jpeg_finish_compress(&j->c);
+    return 0;
+}
+#endif /* HAVE_LIBJPEG */
+#endif /* HAVE_ZLIB */
+
+/*
+ * Encoder scratch, one per thread that encodes (the event loop and each --threads worker):
+ * the rectangle converted to the client pixel format, and the colour classification
+ * palette. Both are reused, so after the first frames encoding allocates nothing but
+ * growth of the output buffers.
+ */
+struct enc_scratch {
+    struct buf pixels;
+    struct palette pal;               /* ~2 KB, too big for comfort on the stack */
+#ifdef HAVE_LIBJPEG
+    struct tight_jpeg jpeg;           /* set up on this thread's first JPEG tile */
+#endif
+};
+
+#ifdef HAVE_ZLIB
+/*
+ * tight_encode_tile() — append one rectangle in cached Tight form (see tight_begin())
+ *
+ * px holds the w x h rectangle in client pixels (pitch bytes per line), src the same
+ * rectangle in server pixels, which JPEG encodes from (quality 0: no JPEG). Shared by
+ * every Tight client with the same format and quality. Returns 0 on success, -1 on
+ * allocation failure.
+ */
+static int tight_encode_tile(const struct pixconv* pc, int quality, const uint8_t* px, int pitch,
+                             const uint8_t* src, int stride, int w, int h, struct enc_scratch* es,
+                             struct buf* out) {
+    const int bpp = pc->bytes;
+    const int tp = tight_pixel_len(pc);
+    struct palette* pal = &es->pal;
+    uint8_t* p;
+
+    palette_reset(pal);
+    for (int y = 0; y < h && pal->n <= PAL_MAX; y++) {
+        const uint8_t* row = px + (size_t)y * (size_t)pitch;
+        for (int x = 0; x < w; x++) {
+            if (palette_add(pal, pix_load(row + (size_t)x * (size_t)bpp, bpp)) < 0) break;
+        }
+    }
+
+    if (pal->n == 1) {
+        if (!(p = tight_begin(out, TIGHT_FILL, 0)) || !buf_append(out, (size_t)tp)) return -1;
+        tight_put_pixel(out->data + out->len - tp, pal->colors[0], pc, tp);
+        return 0;
+    }
+
+    if (pal->n <= PAL_MAX) {
+        int mono = pal->n == 2;
+        size_t rowb = mono ? (size_t)(w + 7) / 8 : (size_t)w;
+        uint8_t ctl = (uint8_t)(TIGHT_FILTER | (mono ? 1 : 2) << 4);
+        if (!(p = tight_begin(out, ctl, 2 + (size_t)pal->n * (size_t)tp))) return -1;
+        *p++ = TIGHT_PALETTE;
+        *p++ = (uint8_t)(pal->n - 1);
+        for (int i = 0; i < pal->n; i++) p = tight_put_pixel(p, pal->colors[i], pc, tp);
+
+        if (!(p = buf_append(out, rowb * (size_t)h))) return -1;
+        memset(p, 0, rowb * (size_t)h);
+        for (int y = 0; y < h; y++) {
+            const uint8_t* row = px + (size_t)y * (size_t)pitch;
+            uint8_t* d = p + (size_t)y * rowb;
+            for (int x = 0; x < w; x++) {
+                int idx = palette_find(pal, pix_load(row + (size_t)x * (size_t)bpp, bpp));
+                if (!mono) d[x] = (uint8_t)idx;
+                else if (idx) d[x >> 3] |= (uint8_t)(0x80 >> (x & 7));
+            }
+        }
+        return 0;
+    }
+
+#ifdef HAVE_LIBJPEG
+    /*
+     * Many colours. JPEG headers cost ~600 bytes, which a 32x32 tile doesn't always
+     * recover: keep the JPEG only if it is under half the raw TPIXEL size.
+     */
+    if (quality > 0 && pc->dst.bpp >= 16) {
+        size_t start = out->len;
+        if (!tight_begin(out, TIGHT_JPEG, 0) || !buf_append(out, 3)) return -1;
+        size_t at = out->len;
+        if (!tight_jpeg(&es->jpeg, &pc->src, quality, src, stride, w, h, out)) {
+            size_t n = out->len - at;
+            if (n < (size_t)w * (size_t)h * (size_t)tp / 2) {
+                /* Compact length in front: shift the image down over the unused bytes */
+                uint8_t len[3];
+                size_t k = tight_put_length(len, n);
+                memmove(out->data + at - 3 + k, out->data + at, n);
+                memcpy(out->data + at - 3, len, k);
+                out->len = at - 3 + k + n;
+                return 0;
+            }
+        }
+        out->len = start;
+    }
+#else
+    (void)quality;
+    (void)src;
+    (void)stride;
+#endif
+
+    /* Full colour, no filter */
+    if (!tight_begin(out, 0, 0) || !(p = buf_append(out, (size_t)w * (size_t)h * (size_t)tp))) return -1;
+    for (int y = 0; y < h; y++) {
+        const uint8_t* row = px + (size_t)y * (size_t)pitch;
+        for (int x = 0; x < w; x++) p = tight_put_pixel(p, pix_load(row + (size_t)x * (size_t)bpp, bpp), pc, tp);
+    }
+    return 0;
+}
+
+/*
+ * tight_finish() — append a cached Tight tile the way this client's streams need it
+ *
+ * Returns 0 on success, -1 on failure.
+ */
+static int tight_finish(struct client* cl, const uint8_t* data, size_t len, struct buf* out) {
+    uint16_t hdr_len;
+    memcpy(&hdr_len, data + 1, 2);
+    const uint8_t ctl = data[0];
+    const uint8_t* body = data + 3 + hdr_len;
+    size_t body_len = len - 3 - hdr_len;
+
+    uint8_t* p = buf_append(out, 1 + (size_t)hdr_len);
+    if (!p) return -1;
+    p[0] = ctl;
+    memcpy(p + 1, data + 3, hdr_len);
+    if ((ctl & TIGHT_FILL) || body_len < TIGHT_MIN_ZLIB) {
+        if (!(p = buf_append(out, body_len))) return -1;
+        memcpy(p, body, body_len);
+        return 0;
+    }
+
+    int s = (ctl >> 4) & 3;
+    size_t at = out->len;
+    if (!buf_append(out, 3)) return -1;
+    if (stream_deflate(cl, &cl->tz[s], &cl->tz_ready[s], TIGHT_WBITS, TIGHT_MEMLEVEL,
+                       body, body_len, out)) return -1;
+    size_t n = out->len - at - 3;
+    uint8_t clen[3];
+    size_t k = tight_put_length(clen, n);
+    memmove(out->data + at + k, out->data + at + 3, n);
+    memcpy(out->data + at, clen, k);
+    out->len = at + k + n;
+    return 0;
+}
+#endif /* HAVE_ZLIB */
+
+/* Convert a rectangle of server pixels into packed client pixels at dst (pitch w*bytes) */
+static void convert_rect(const struct pixconv* pc, uint8_t* dst, const uint8_t* frame, int stride,
+                         const struct rect* r) {
+    size_t dpitch = (size_t)r->w * (size_t)pc->bytes;
+    const uint8_t* src = frame + (size_t)r->y * (size_t)stride + (size_t)r->x * 4;
+    for (int y = 0; y < r->h; y++) {
+        pc->fn(dst + (size_t)y * dpitch, src + (size_t)y * (size_t)stride, r->w, pc);
+    }
+}
+
+/*
+ * encode_rect() — append the payload of one rectangle in the client's encoding and format
+ *
+ * Used for rectangles that can't come from the shared encode cache. frame is the shadow
+ * snapshot (server pixels), es the event loop's encoder scratch. RAW in the server's own
+ * format appends nothing: its pixels are sent zero-copy. Returns 0 on success, -1 on
+ * allocation/encoder failure.
+ */
+static int encode_rect(struct client* cl, struct enc_scratch* es, const uint8_t* frame, int stride,
+                       const struct rect* r, struct buf* out) {
+    const struct pixconv* pc = &cl->conv;
+    size_t size = (size_t)r->w * (size_t)r->h * (size_t)pc->bytes;
+
+    if (cl->encoding == ENC_RAW) {
+        if (pc->identity) return 0;
+        uint8_t* p = buf_append(out, size);
+        if (!p) return -1;
+        convert_rect(pc, p, frame, stride, r);
+        return 0;
+    }
+
+    es->pixels.len = 0;
+    uint8_t* px = buf_append(&es->pixels, size);
+    if (!px) return -1;
+    convert_rect(pc, px, frame, stride, r);
+    int pitch = r->w * pc->bytes;
+
+    switch (cl->encoding) {
+    case ENC_HEXTILE:
+        return hextile_encode_rect(px, pitch, pc->bytes, r->w, r->h, &es->pal, out);
+#ifdef HAVE_ZLIB
+    case ENC_ZRLE:
+        return zrle_encode_rect(cl, px, pitch, r->w, r->h, &es->pal, out);
+    case ENC_TIGHT:
+        cl->scratch.len = 0;
+        if (tight_encode_tile(pc, cl->quality, px, pitch,
+                              frame + (size_t)r->y * (size_t)stride + (size_t)r->x * 4, stride,
+                              r->w, r->h, es, &cl->scratch)) return -1;
+        return tight_finish(cl, cl->scratch.data, cl->scratch.len, out);
+#endif
+    default:
+        return -1;
+    }
+}
+
+/* True if this rect's payload is sent zero-copy from the shadow frame (not from cl->out) */
+static int rect_is_zero_copy(const struct client* cl) {
+    return cl->encoding == ENC_RAW && cl->conv.identity;
+}
+
+/*
+ * Shared encode cache
+ * -------------------
+ * Viewers that negotiated the same encoding and pixel format produce byte-identical
+ * payloads for the same tile, so they share an enc_group holding one cache slot per tile,
+ * tagged with the scan at which the tile last changed (tm->version). A tile that changed
+ * on screen is encoded once, by whichever client needs it first, and reused by the rest:
+ * - RAW (converted) and Hextile payloads are self-contained and sent straight from the cache;
+ * - ZRLE and Tight cache the tile before compression, as each client has its own zlib
+ *   streams; Tight groups also split by JPEG quality.
+ * Viewers of a scaled view (--scale) have groups of their own, over that view's tiles.
+ * A group outlives its last viewer: the next one to connect with the same settings gets
+ * its first update from the cache (see group_put()).
+ * Only whole tiles are cached; a tile clipped by the request area is encoded uncached.
+ * RAW in the server format needs no group: it is sent zero-copy from the shadow frame.
+ * Groups live as long as some client uses them, each in its own pool of the arena: the
+ * slot array and a fixed slice per tile.
+ */
+
+/* Worst-case cached payload of one tile: 4-byte pixels, all Hextile subtiles raw */
+#define TILE_CACHE_MAX (TILE_SIZE * TILE_SIZE * 4 + 64)
+
+struct tile_cache {
+    int valid;
+    uint32_t version;           /* tm->version of the tile when it was encoded */
+    struct buf data;
+};
+
+struct enc_group {
+    int32_t encoding;
+    struct pixconv conv;
+    int scale;                  /* the view whose tiles it caches */
+    int quality;                /* Tight JPEG quality, 0 for everything else */
+    int refs;                   /* clients using this group, 0 = kept for reconnects */
+    int64_t idle_since;         /* now_ms() when refs last dropped to 0 */
+    struct tile_cache* tiles;   /* ntiles slots */
+    struct arena* mem;          /* the group's pool, NULL if it lives on the heap */
+};
+
+/* Hard limit for --max-clients (every client costs a dirty map and possibly a group) */
+#define MAX_CLIENTS 16
+
+/* Connections we track at once: viewers plus a few being refused or timing out */
+#define MAX_CONNS (MAX_CLIENTS + 8)
+
+/* The desktop name in ServerInit (and in recordings) */
+#define SERVER_NAME "OpenCentauri fb0"
+
+/*
+ * Idle backoff
+ * ------------
+ * Scans only run while somebody waits for a frame (see server_sync()), but a viewer that
+ * keeps its request open in front of a screen that doesn't change (the status page of a
+ * multi-hour print) would still cost a full framebuffer read per frame period, forever.
+ * So once nothing has changed for --idle-backoff seconds, every scan that finds nothing
+ * doubles the scan interval, up to SCAN_IDLE_MAX_MS, and the first one that finds a
+ * change snaps it back to the frame period. The first change on an idle screen is seen
+ * at most SCAN_IDLE_MAX_MS late; what follows it goes out at the full frame rate.
+ */
+#define SCAN_IDLE_MAX_MS 1000
+
+struct scan_pace {
+    int period;                 /* the frame period: the interval while the screen changes */
+    int idle_after;             /* --idle-backoff in ms, 0 = never back off */
+    int interval;               /* the current scan interval */
+    int64_t last_change;        /* now_ms() of the last scan that found changes */
+};
+
+/* scan_pace_next() — account for one scan's result; returns the interval until the next */
+static int scan_pace_next(struct scan_pace* sp, int changed, int64_t now) {
+    if (changed) {
+        sp->last_change = now;
+        sp->interval = sp->period;
+    } else if (sp->idle_after && now - sp->last_change >= sp->idle_after) {
+        sp->interval = sp->interval >= SCAN_IDLE_MAX_MS / 2 ? SCAN_IDLE_MAX_MS : sp->interval * 2;
+        if (sp->interval < sp->period) sp->interval = sp->period; /* a period over the cap */
+    }
+    return sp->interval;
+}
+
+/* Where one rectangle's bytes come from when the update is sent, see send_update() */
+struct txrect {
+    size_t hdr_end;             /* end of this rect's buffered bytes in cl->out */
+    const uint8_t* src;         /* external payload (cache entry / shadow lines) or NULL */
+    size_t linelen;             /* bytes per line of the external payload */
+    size_t pitch;               /* distance between those lines */
+    int lines;
+};
+
+/*
+ * Server-wide state: the framebuffer, the shared snapshot/tile tracking, the connected
+ * clients and their encode cache groups.
+ */
+struct capture;
+struct pool;
+struct movefind;
+
+/* The shared pointer: last PointerEvent from any viewer, in framebuffer coordinates */
+struct pointer {
+    int x, y;
+    uint32_t seq;               /* bumped on every move, 0 = never moved */
+    int moved;                  /* moved while handling the current input */
+};
+
+struct server {
+    const uint8_t* fbmem;       /* displayed page inside fbbase, as of the last scan */
+    int stride;
+    int fbfd;                   /* framebuffer device, kept open for pan/vsync queries; -1 if a file */
+    const uint8_t* fbbase;      /* mmap'd framebuffer, every virtual line (read-only) */
+    int vlines;                 /* lines mapped at fbbase */
+    uint32_t xoffset, yoffset;  /* pan position of the displayed page */
+    int vsync;                  /* FBIO_WAITFORVSYNC works on this driver */
+    int flips;                  /* page flips seen; -1 once the front page is drawn into */
+    int64_t last_full;          /* now_ms() of the last scan not gated on a flip */
+    struct capture* cap;        /* --capture-thread, NULL when the event loop scans */
+    struct pool* pool;          /* --threads encoder helpers, NULL when the event loop encodes alone */
+    struct movefind* moves;     /* CopyRect move detection, NULL if off */
+    struct enc_scratch enc;     /* the event loop's encoder scratch */
+    struct arena arena;         /* the frame loop's memory, see server_reserve() */
+    struct arena viewer_mem[MAX_CLIENTS];   /* one pool per --max-clients slot */
+    struct arena group_mem[MAX_CLIENTS + 1]; /* one pool per encode cache group */
+    struct pixfmt pf;           /* server pixel format, advertised in ServerInit */
+    uint8_t server_init[3][24 + sizeof(SERVER_NAME) - 1]; /* ServerInit per view (1, 1/2, 1/4) */
+    struct tilemap tm;          /* shadow snapshot + per-scan change tracking */
+    struct tilemap scaled[2];   /* half and quarter size views, set up on first use */
+    int scaled_live[2];         /* ... and in step with tm (see view_open()) */
+    int scale;                  /* --scale: the view new viewers get */
+    int can_scale;              /* the pixel format can be box-filtered (see view_downsample()) */
+    int fps;
+    int period;                 /* frame period in ms (1000 / fps) */
+    struct scan_pace pace;      /* the frame clock's interval (see "Idle backoff") */
+    int jpeg_quality;           /* --jpeg-quality: Tight viewers without a quality level */
+    int max_clients;
+
+    int epfd;                   /* epoll instance */
+    int lfd;                    /* TCP listening socket (non-blocking), -1 with -p 0 */
+    int ufd;                    /* --unix listening socket, -1 if none */
+    struct shmring* shm;        /* --shm snapshot ring, NULL if none */
+    struct client* recorder;    /* --record viewer (also in clients[]), NULL if none */
+    int rec_idx;                /* its keyframe index */
+    int rec_key_every;          /* --record-keyframe in ms */
+    int64_t rec_key_next;       /* now_ms() from which the next record is a keyframe */
+    int rec_keyframe;           /* the record being written is one */
+    struct transport tp;        /* socket options for viewer connections */
+    struct pointer pointer;     /* where the viewers' pointer is (see "Pointer") */
+    int tfd;                    /* timerfd frame clock, armed only while a request waits */
+    int clock_armed;
+    int64_t last_scan;          /* now_ms() of the last framebuffer scan */
+    int sfd;                    /* --stats listening socket, -1 if none */
+    int stats_every;            /* --stats-log period in ms, 0 if off */
+    int64_t stats_next;         /* now_ms() of the next stderr summary */
+    int64_t stats_since;        /* now_ms() of the previous one */
+    struct stats stats_prev;    /* counters as of the previous summary */
+    int64_t cpu_prev;           /* process CPU time (us) as of the previous summary */
+
+    struct client* clients[MAX_CONNS];
+    int nclients;               /* connections, including refused ones */
+    int nviewers;               /* connections counted against --max-clients */
+    struct client* dead;        /* dropped during this event batch, freed after it */
+    struct enc_group* groups[MAX_CLIENTS + 1]; /* one per client, +1 while one switches */
+    int ngroups;
+
+    /* Update assembly scratch, ntiles+1 entries each (shared: clients are served in turn) */
+    struct rect* rects;
+    int* tiles;
+    struct txrect* tx;
+};
+
+/* server_view() — the tile grid viewers at a scale are served from: tm itself at full size */
+static struct tilemap* server_view(struct server* srv, int scale) {
+    return scale == 1 ? &srv->tm : &srv->scaled[scale == 2 ? 0 : 1];
+}
+
+/* group_free() — free a group and its cached tiles */
+static void group_free(struct server* srv, struct enc_group* g) {
+    for (int i = 0; i < srv->ngroups; i++) {
+        if (srv->groups[i] == g) {
+            srv->groups[i] = srv->groups[--srv->ngroups];
+            break;
+        }
+    }
+    for (int t = 0; t < srv->tm.ntiles; t++) buf_free(&g->tiles[t].data);
+    if (g->mem) {
+        pool_release(g->mem);
+        return;
+    }
+    free(g->tiles);
+    free(g);
+}
+
+/* group_evict() — free the idle group unused the longest; returns 0 if there is none */
+static int group_evict(struct server* srv) {
+    struct enc_group* victim = NULL;
+    for (int i = 0; i < srv->ngroups; i++) {
+        struct enc_group* g = srv->groups[i];
+        if (!g->refs && (!victim || g->idle_since < victim->idle_since)) victim = g;
+    }
+    if (!victim) return 0;
+    group_free(srv, victim);
+    return 1;
+}
+
+/*
+ * group_get() — find or create the group for an encoding + client format + view (takes a
+ * reference)
+ */
+static struct enc_group* group_get(struct server* srv, int32_t encoding, const struct pixconv* pc,
+                                   int quality, int scale) {
+    for (int i = 0; i < srv->ngroups; i++) {
+        struct enc_group* g = srv->groups[i];
+        if (g->encoding == encoding && g->quality == quality && g->scale == scale &&
+            pixfmt_equal(&g->conv.dst, &pc->dst)) {
+            g->refs++;
+            return g;
+        }
+    }
+    if (srv->ngroups == MAX_CLIENTS + 1 && !group_evict(srv)) return NULL;
+
+    struct enc_group* g;
+    struct arena* a = pool_take(srv->group_mem, srv->max_clients + 1);
+    if (!a && group_evict(srv)) a = pool_take(srv->group_mem, srv->max_clients + 1);
+    if (a) {
+        g = (struct enc_group*)arena_alloc(a, sizeof(*g));
+        g->tiles = (struct tile_cache*)arena_alloc(a, (size_t)srv->tm.ntiles * sizeof(struct tile_cache));
+        for (int t = 0; t < srv->tm.ntiles; t++) buf_attach(&g->tiles[t].data, a, TILE_CACHE_MAX);
+        g->mem = a;
+    } else {
+        g = (struct enc_group*)calloc(1, sizeof(*g));
+        if (!g) return NULL;
+        g->tiles = (struct tile_cache*)calloc((size_t)srv->tm.ntiles, sizeof(struct tile_cache));
+        if (!g->tiles) {
+            free(g);
+            return NULL;
+        }
+    }
+    g->encoding = encoding;
+    g->conv = *pc;
+    g->quality = quality;
+    g->scale = scale;
+    g->refs = 1;
+    srv->groups[srv->ngroups++] = g;
+    return g;
+}
+
+/*
+ * group_put() — drop a reference
+ *
+ * A group nobody uses is kept with its cached tiles: a dashboard that reconnects (Wi-Fi
+ * roaming, viewer restarts) finds the tiles that haven't changed since still current,
+ * by their version, and only what changed is encoded for its first update. Idle groups
+ * are freed when their slot or pool is wanted for a new one (see group_evict()).
+ */
+static void group_put(struct enc_group* g) {
+    if (!g || --g->refs > 0) return;
+    g->idle_since = now_ms();
+}
+
+/*
+ * client_attach_group() — (re)bind a client to the group matching its current encoding and
+ * pixel format. Called after SetPixelFormat / SetEncodings. Returns 0 on success, -1 if no
+ * group could be set up.
+ */
+static int client_attach_group(struct server* srv, struct client* cl) {
+    struct enc_group* g = NULL;
+    if (!rect_is_zero_copy(cl)) {
+        g = group_get(srv, cl->encoding, &cl->conv, cl->quality, cl->scale);
+        if (!g) return -1;
+    }
+    group_put(cl->group);
+    cl->group = g;
+    return 0;
+}
+
+/* Is the cache entry of tile t current, i.e. encoded since the tile last changed? */
+static int tile_current(const struct tile_cache* tc, const struct tilemap* tm, int t) {
+    return tc->valid && tc->version == tm->version[t];
+}
+
+/* group_fresh() — how many of an update's whole tiles can be sent without encoding */
+static int group_fresh(const struct enc_group* g, const struct tilemap* tm, const int* tiles, int n) {
+    int fresh = 0;
+    for (int i = 0; i < n; i++) fresh += tiles[i] >= 0 && tile_current(&g->tiles[tiles[i]], tm, tiles[i]);
+    return fresh;
+}
+
+/*
+ * group_tile() — cached payload of whole tile t, (re-)encoded from the shadow if stale
+ *
+ * es is the calling thread's encoder scratch: the --threads workers call this too, each
+ * for different tiles. Returns NULL on allocation/encoder failure.
+ */
+static const struct buf* group_tile(struct enc_group* g, const struct tilemap* tm, int t,
+                                    struct enc_scratch* es) {
+    struct tile_cache* tc = &g->tiles[t];
+    if (tile_current(tc, tm, t)) return &tc->data;
+
+    const struct pixconv* pc = &g->conv;
+    struct rect r = tile_rect(tm, t % tm->cols, t / tm->cols);
+    size_t size = (size_t)r.w * (size_t)r.h * (size_t)pc->bytes;
+    int stride = tm->width * 4;
+    int pitch = r.w * pc->bytes;
+    int rc;
+
+    tc->valid = 0;
+    tc->data.len = 0;
+    if (g->encoding == ENC_RAW) {
+        uint8_t* p = buf_append(&tc->data, size);
+        if (!p) return NULL;
+        convert_rect(pc, p, tm->shadow, stride, &r);
+        rc = 0;
+    } else {
+        es->pixels.len = 0;
+        uint8_t* px = buf_append(&es->pixels, size);
+        if (!px) return NULL;
+        convert_rect(pc, px, tm->shadow, stride, &r);
+
+        switch (g->encoding) {
+        case ENC_HEXTILE:
+            rc = hextile_encode_rect(px, pitch, pc->bytes, r.w, r.h, &es->pal, &tc->data);
+            break;
+#ifdef HAVE_ZLIB
+        case ENC_ZRLE:
+            rc = zrle_encode_tiles(pc, px, pitch, r.w, r.h, &es->pal, &tc->data);
+            break;
+        case ENC_TIGHT:
+            rc = tight_encode_tile(pc, g->quality, px, pitch,
+                                   tm->shadow + (size_t)r.y * (size_t)stride + (size_t)r.x * 4, stride,
+                                   r.w, r.h, es, &tc->data);
+            break;
+#endif
+        default:
+            rc = -1;
+        }
+    }
+    if (rc) return NULL;
+
+    tc->valid = 1;
+    tc->version = tm->version[t];
+    return &tc->data;
+}
+
+/*
+ * Encoder pool (--threads)
+ * ------------------------
+ * A full-screen change in a compressed encoding means thousands of tiles to encode, and
+ * on one core that caps the frame rate of big framebuffers. With --threads N the event
+ * loop gets N-1 helper threads for that part. Before an update is assembled, every stale
+ * whole tile it takes from the shared cache is (re-)encoded into its cache entry by
+ * whichever thread claims it first, the event loop included. The update is then
+ * assembled in rectangle order from the cache as before, so what goes on the wire does
+ * not change: the ZRLE deflate step, which has to see the tiles in order, stays on the
+ * event loop.
+ * - tiles are handed out through an atomic index, so nobody idles while work is left;
+ * - a cache entry is only written by the thread that claimed its tile, and the event
+ *   loop reads it after the whole batch is done (the mutex orders the two);
+ * - every thread has its own encoder scratch.
+ * Helpers sleep on a condition variable between batches. The event loop encodes small
+ * batches alone, because waking the helpers would cost more than it saves.
+ */
+#define MAX_THREADS 8
+#define POOL_MIN_JOBS 4             /* fewer stale tiles than this: not worth a wake-up */
+
+struct pool_worker {
+    struct pool* pool;
+    pthread_t thread;
+    struct enc_scratch es;
+};
+
+struct pool {
+    int nworkers;               /* helper threads: --threads minus the event loop */
+    struct pool_worker* workers;
+    int* jobs;                  /* ntiles: tile indices of the current batch */
+    pthread_mutex_t lock;       /* guards batch and busy */
+    pthread_cond_t start;       /* a batch was posted */
+    pthread_cond_t done;        /* the last helper left the batch */
+    unsigned batch;             /* incremented for every batch posted */
+    int busy;                   /* helpers not done with the batch yet */
+    /* The current batch, fixed until busy drops to 0 */
+    struct enc_group* g;
+    const struct tilemap* tm;
+    int njobs;
+    _Atomic int next;           /* next job to claim */
+};
+
+/* pool_work() — encode tiles of the current batch until none is left */
+static void pool_work(struct pool* p, struct enc_scratch* es) {
+    for (;;) {
+        int j = atomic_fetch_add(&p->next, 1);
+        if (j >= p->njobs) return;
+        /* A tile that fails stays stale: send_update() retries it and reports the error */
+        group_tile(p->g, p->tm, p->jobs[j], es);
+    }
+}
+
+static void* pool_main(void* arg) {
+    struct pool_worker* w = (struct pool_worker*)arg;
+    struct pool* p = w->pool;
+    unsigned seen = 0;
+
+    pthread_mutex_lock(&p->lock);
+    for (;;) {
+        while (p->batch == seen) pthread_cond_wait(&p->start, &p->lock);
+        seen = p->batch;
+        pthread_mutex_unlock(&p->lock);
+
+        pool_work(p, &w->es);
+
+        pthread_mutex_lock(&p->lock);
+        if (--p->busy == 0) pthread_cond_signal(&p->done);
+    }
+    return NULL;
+}
+
+/*
+ * pool_start() — set up the pool and start nthreads-1 helpers
+ *
+ * Their scratch comes from a (sized for it by server_reserve()). Returns 0 on success,
+ * -1 on failure.
+ */
+static int pool_start(struct pool** pp, struct arena* a, int ntiles, int nthreads) {
+    struct pool* p = (struct pool*)calloc(1, sizeof(*p));
+    if (!p) return -1;
+    p->workers = (struct pool_worker*)calloc((size_t)nthreads - 1, sizeof(struct pool_worker));
+    p->jobs = (int*)arena_alloc(a, (size_t)ntiles * sizeof(int));
+    if (!p->workers || !p->jobs) return -1;
+    pthread_mutex_init(&p->lock, NULL);
+    pthread_cond_init(&p->start, NULL);
+    pthread_cond_init(&p->done, NULL);
+
+    for (int i = 0; i < nthreads - 1; i++) {
+        struct pool_worker* w = &p->workers[i];
+        w->pool = p;
+        buf_attach(&w->es.pixels, a, TILE_SIZE * TILE_SIZE * 4);
+        if (pthread_create(&w->thread, NULL, pool_main, w)) return -1;
+        p->nworkers++;
+    }
+    *pp = p;
+    return 0;
+}
+
+/*
+ * pool_encode() — bring the cache entries of an update's whole tiles up to date, in
+ * parallel
+ *
+ * tiles[] is as for send_update(); es is the event loop's encoder scratch.
+ */
+static void pool_encode(struct pool* p, struct enc_group* g, const struct tilemap* tm,
+                        const int* tiles, int n, struct enc_scratch* es) {
+    int njobs = 0;
+    for (int i = 0; i < n; i++) {
+        int t = tiles[i];
+        if (t < 0) continue;
+        if (!tile_current(&g->tiles[t], tm, t)) p->jobs[njobs++] = t;
+    }
+    if (njobs < POOL_MIN_JOBS) return;
+
+    pthread_mutex_lock(&p->lock);
+    p->g = g;
+    p->tm = tm;
+    p->njobs = njobs;
+    atomic_store(&p->next, 0);
+    p->busy = p->nworkers;
+    p->batch++;
+    pthread_cond_broadcast(&p->start);
+    pthread_mutex_unlock(&p->lock);
+
+    pool_work(p, es);
+
+    pthread_mutex_lock(&p->lock);
+    while (p->busy > 0) pthread_cond_wait(&p->done, &p->lock);
+    pthread_mutex_unlock(&p->lock);
+}
+
+/*
+ * update_max() — worst-case bytes of one FramebufferUpdate of the whole screen
+ *
+ * Every tile is a rect with its header and pixels take 4 bytes, plus the encoders' worst
+ * overhead: a Hextile subtile byte per 16x16 pixels, a ZRLE tile byte, and deflate's
+ * stored-block headers, sync flushes and output reserve (see zrle_deflate()).
+ */
+static size_t update_max(const struct tilemap* tm) {
+    size_t px = (size_t)tm->width * (size_t)tm->height;
+    return 4 + (size_t)(tm->ntiles + 1) * 32 + px * 4 + px / 16 + 8192;
+}
+
+/* A viewer pool: out, scratch, wq (two updates' worth of backlog), in, then zlib's state */
+#define CLIENT_IN_MAX (16 * 1024)
+#ifdef HAVE_ZLIB
+#define ZLIB_MEM_MAX (320 * 1024 + 3 * TIGHT_ZLIB_MEM) /* the ZRLE stream and three Tight ones */
+#else
+#define ZLIB_MEM_MAX 0
+#endif
+
+static size_t viewer_mem_size(const struct tilemap* tm) {
+    size_t um = arena_need(update_max(tm));
+    return 4 * um + arena_need(CLIENT_IN_MAX) + ZLIB_MEM_MAX;
+}
+
+/* client_attach_mem() — give a new viewer a free pool and carve its buffers from it */
+static void client_attach_mem(struct server* srv, struct client* cl) {
+    struct arena* a = pool_take(srv->viewer_mem, srv->max_clients);
+    if (!a) return; /* a dropped client not reaped yet still holds it: use the heap */
+    size_t um = update_max(&srv->tm);
+    cl->mem = a;
+    buf_attach(&cl->out, a, um);
+    buf_attach(&cl->scratch, a, um);
+    buf_attach(&cl->wq, a, 2 * um);
+    buf_attach(&cl->in, a, CLIENT_IN_MAX);
+}
+
+/*
+ * server_reserve() — reserve the frame loop's memory, sized from the geometry
+ *
+ * The arena holds a pool per viewer slot and per cache group (one more than viewers, for
+ * a client switching), then the update scratch and the encoder scratch of the event loop
+ * and of the --threads workers (carved by pool_start()). Logs the reservation. Returns 0
+ * on success, -1 on failure.
+ */
+static int server_reserve(struct server* srv, int threads) {
+    const struct tilemap* tm = &srv->tm;
+    size_t n = (size_t)tm->ntiles + 1;
+    size_t frame = (size_t)tm->width * (size_t)tm->height * 4;
+    size_t viewer = page_round(viewer_mem_size(tm));
+    size_t group = page_round(arena_need(sizeof(struct enc_group)) +
+                              arena_need((size_t)tm->ntiles * sizeof(struct tile_cache)) +
+                              (size_t)tm->ntiles * arena_need(TILE_CACHE_MAX));
+    size_t scratch = arena_need(n * sizeof(struct rect)) + arena_need(n * sizeof(int)) +
+                     arena_need(n * sizeof(struct txrect)) + arena_need(frame) +
+                     arena_need((size_t)tm->ntiles * sizeof(int)) +
+                     (size_t)(threads - 1) * arena_need(TILE_SIZE * TILE_SIZE * 4);
+    int ngroups = srv->max_clients + 1;
+    size_t total = (size_t)srv->max_clients * viewer + (size_t)ngroups * group + page_round(scratch);
+
+    if (arena_map(&srv->arena, total)) return -1;
+    for (int i = 0; i < srv->max_clients; i++) arena_sub(&srv->arena, &srv->viewer_mem[i], viewer);
+    for (int i = 0; i < ngroups; i++) arena_sub(&srv->arena, &srv->group_mem[i], group);
+    srv->rects = (struct rect*)arena_alloc(&srv->arena, n * sizeof(struct rect));
+    srv->tiles = (int*)arena_alloc(&srv->arena, n * sizeof(int));
+    srv->tx = (struct txrect*)arena_alloc(&srv->arena, n * sizeof(struct txrect));
+    buf_attach(&srv->enc.pixels, &srv->arena, frame);
+
+    fprintf(stderr, "fb0rfb: memory reserved %zu KB: %zu KB per viewer, %zu KB per cache group, "
+            "%zu KB scratch (resident as used)\n",
+            total / 1024, viewer / 1024, group / 1024, page_round(scratch) / 1024);
+    return 0;
+}
+
+/*
+ * Recording (--record)
+ * --------------------
+ * For failure forensics the UI can be recorded for a whole print with no viewer around:
+ * the recording is a viewer of its own whose "socket" is a file. It is served from the
+ * same dirty tiles, move detection and encode cache as the network viewers, so an idle
+ * screen writes nothing, a progress bar tick a few hundred bytes, and hours of printing a
+ * few MB. The file is append-only, big-endian like RFB:
+ *
+ *   "FB0RREC1", u32 keyframe period (ms), then ServerInit (width, height, PixelFormat,
+ *   name) as a viewer gets it; then one record per update:
+ *     u32 length, u8 flags (RECORD_KEYFRAME), 3 padding, u64 wall-clock time (us since
+ *     the epoch), then length bytes of FramebufferUpdate
+ *
+ * Updates are ZRLE (Hextile in builds without zlib) plus CopyRect, so records play back
+ * through any RFB decoder in order. The first update after each --record-keyframe
+ * seconds carries the whole screen, without CopyRect, and (ZRLE) its zlib data starts with a full flush, so
+ * playback can start there: with a fresh decoder whose inflate stream is raw (no zlib
+ * header; the first keyframe is where the stream, header included, begins). FILE.idx
+ * lists the keyframes for seeking: u64 time, u64 file offset of the record, each.
+ *
+ * Writes go out from the event loop: a file takes them whole, and a short or failed one
+ * (disk full) ends the recording. It takes a --max-clients slot of its own.
+ */
+#define RECORD_MAGIC    "FB0RREC1"
+#define RECORD_KEYFRAME 1
+
+/* record_start() — create the recording and its index and attach the recording viewer */
+static int record_start(struct server* srv, const char* path, int key_every_ms) {
+    char idx[4096];
+    if ((size_t)snprintf(idx, sizeof(idx), "%s.idx", path) >= sizeof(idx)) return -1;
+    int fd = open(path, O_WRONLY | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    if (fd < 0) return -1;
+    srv->rec_idx = open(idx, O_WRONLY | O_CREAT | O_TRUNC | O_APPEND | O_CLOEXEC, 0644);
+    struct client* cl = srv->rec_idx < 0 ? NULL : (struct client*)calloc(1, sizeof(*cl));
+    if (!cl || !(cl->dirty = (uint8_t*)malloc((size_t)srv->tm.ntiles))) {
+        free(cl);
+        if (srv->rec_idx >= 0) close(srv->rec_idx);
+        close(fd);
+        return -1;
+    }
+    memset(cl->dirty, 1, (size_t)srv->tm.ntiles);
+    cl->fd = fd;
+    cl->record = 1;
+    cl->state = CL_NORMAL;
+    cl->events = EPOLLIN; /* what server_sync() expects; a file is never in the epoll set */
+    cl->interval = srv->period;
+    cl->scale = 1;
+    cl->encodings[cl->nencodings++] = ENC_ZRLE;
+    cl->encodings[cl->nencodings++] = ENC_HEXTILE;
+    cl->encodings[cl->nencodings++] = ENC_COPYRECT;
+    client_pick_encoding(cl, 0);
+    pixconv_init(&cl->conv, &srv->pf, &srv->pf);
+    cl->req.continuous = 1; /* a standing request for the whole screen */
+    cl->req.cont = (struct rect){ 0, 0, srv->tm.width, srv->tm.height };
+    srv->nviewers++;
+    client_attach_mem(srv, cl);
+    srv->clients[srv->nclients++] = cl;
+    srv->recorder = cl;
+    srv->rec_key_every = key_every_ms;
+    srv->rec_key_next = now_ms(); /* the first record is a keyframe */
+    if (client_attach_group(srv, cl)) return -1;
+
+    uint8_t h[12 + sizeof(srv->server_init[0])];
+    memcpy(h, RECORD_MAGIC, 8);
+    put32(h + 8, (uint32_t)key_every_ms);
+    memcpy(h + 12, srv->server_init[0], sizeof(srv->server_init[0])); /* full size */
+    return client_send(cl, h, sizeof(h)) || client_queued(cl) ? -1 : 0;
+}
+
+/*
+ * record_prepare() — before the recording's next update: make it a keyframe if one is due
+ * and there is something to record at all (an idle screen writes no keyframes either)
+ */
+static void record_prepare(struct server* srv, struct client* cl, int64_t now) {
+    if (now < srv->rec_key_next) return;
+    int changed = cl->ncopies > 0;
+    for (int t = 0; t < srv->tm.ntiles && !changed; t++) changed = cl->dirty[t];
+    if (!changed) return;
+    memset(cl->dirty, 1, (size_t)srv->tm.ntiles);
+    cl->ncopies = 0; /* their destinations are resent anyway */
+#ifdef HAVE_ZLIB
+    cl->zs_restart = 1;
+#endif
+    srv->rec_keyframe = 1;
+    srv->rec_key_next = now + srv->rec_key_every;
+}
+
+/*
+ * record_header() — write the record header of an update of len bytes (and, for a
+ * keyframe, its index entry). Returns 0 on success, -1 if the recording failed.
+ */
+static int record_header(struct server* srv, struct client* cl, size_t len) {
+    struct timespec ts;
+    clock_gettime(CLOCK_REALTIME, &ts);
+    uint64_t us = (uint64_t)ts.tv_sec * 1000000 + (uint64_t)ts.tv_nsec / 1000;
+    uint8_t h[16] = { 0 };
+    put32(h, (uint32_t)len);
+    h[4] = srv->rec_keyframe ? RECORD_KEYFRAME : 0;
+    put32(h + 8, (uint32_t)(us >> 32));
+    put32(h + 12, (uint32_t)us);
+
+    if (srv->rec_keyframe) {
+        uint8_t e[16]; /* nothing is ever queued here, so tx_bytes is the file offset */
+        memcpy(e, h + 8, 8);
+        put32(e + 8, (uint32_t)(cl->tx_bytes >> 32));
+        put32(e + 12, (uint32_t)cl->tx_bytes);
+        stats.sys[SYS_WRITE]++;
+        if (write(srv->rec_idx, e, sizeof(e)) != (ssize_t)sizeof(e)) return -1;
+        srv->rec_keyframe = 0;
+    }
+    stats.record_bytes += sizeof(h) + len;
+    return client_send(cl, h, sizeof(h));
+}
+
+/*
+ * client_first_frame() — time to first frame: from accept until the viewer's first update
+ * has left our output queue (handed to the kernel; it is on the wire a link's worth later)
+ */
+static void client_first_frame(struct client* cl) {
+    if (!cl->connected_us || !cl->first_sent || client_queued(cl)) return;
+    int64_t us = now_us() - cl->connected_us;
+    hist_add(&stats.first_frame, us);
+    fprintf(stderr, "fb0rfb: first frame %lld.%lld ms after connecting (%llu KB)\n",
+            (long long)(us / 1000), (long long)(us / 100 % 10), (unsigned long long)(cl->tx_bytes / 1024));
+    cl->connected_us = 0;
+}
+
+/*
+ * Scatter-gather batch size. Linux caps one writev() at IOV_MAX (1024) entries; a
+ * full-screen rectangle with padded lines needs height+1 entries, so it still goes out in
+ * one call, and many small tile rectangles share a call.
+ */
+#define TX_IOV_MAX 1024
+
+/*
+ * Pointer
+ * -------
+ * The UI draws no pointer of its own (it is a touchscreen), and nothing is injected into
+ * it: PointerEvents only move a pointer that the viewers share. Viewers that list Cursor
+ * draw it locally from a shape we send once (again after SetPixelFormat), so a pointer
+ * moving over the screen never damages a tile or costs a re-encode. Viewers that list
+ * PointerPos are also told where it went when another viewer moved it, as a 0x0
+ * rectangle at the new position; the one that moved it already knows.
+ */
+#define CURSOR_SIZE 9 /* a touch point: white dot in a black ring, hotspot in the middle */
+
+/* Pointer rectangles owed to a client at the head of its next update */
+static int client_pointer_rects(const struct server* srv, const struct client* cl) {
+    return cl->cursor_due + (cl->pointer_pos && cl->pointer_seen != srv->pointer.seq);
+}
+
+/* put_pointer() — append the owed Cursor and PointerPos rectangles to cl->out */
+static int put_pointer(const struct server* srv, struct client* cl) {
+    struct buf* out = &cl->out;
+    uint8_t* p;
+
+    if (cl->cursor_due) {
+        const int c = CURSOR_SIZE / 2;
+        const size_t mask_row = (CURSOR_SIZE + 7) / 8;
+        const uint32_t white = ((uint32_t)srv->pf.rmax << srv->pf.rshift) |
+                               ((uint32_t)srv->pf.gmax << srv->pf.gshift) |
+                               ((uint32_t)srv->pf.bmax << srv->pf.bshift);
+        uint32_t px[CURSOR_SIZE * CURSOR_SIZE];
+        struct rect r = { c, c, CURSOR_SIZE, CURSOR_SIZE }; /* x, y: the hotspot */
+        size_t bytes = (size_t)CURSOR_SIZE * CURSOR_SIZE * (size_t)cl->conv.bytes;
+
+        if (!(p = buf_append(out, 12 + bytes + mask_row * CURSOR_SIZE))) return -1;
+        put_rect_header(p, &r, ENC_CURSOR);
+        uint8_t* mask = p + 12 + bytes;
+        memset(mask, 0, mask_row * CURSOR_SIZE);
+        for (int y = 0; y < CURSOR_SIZE; y++) {
+            for (int x = 0; x < CURSOR_SIZE; x++) {
+                int d2 = (x - c) * (x - c) + (y - c) * (y - c);
+                px[y * CURSOR_SIZE + x] = d2 <= 8 ? white : 0;
+                if (d2 <= 17) mask[(size_t)y * mask_row + (size_t)x / 8] |= (uint8_t)(0x80 >> (x % 8));
+            }
+        }
+        cl->conv.fn(p + 12, (const uint8_t*)px, CURSOR_SIZE * CURSOR_SIZE, &cl->conv);
+        cl->cursor_due = 0;
+    }
+
+    if (cl->pointer_pos && cl->pointer_seen != srv->pointer.seq) {
+        struct rect r = { srv->pointer.x / cl->scale, srv->pointer.y / cl->scale, 0, 0 };
+        if (!(p = buf_append(out, 12))) return -1;
+        put_rect_header(p, &r, ENC_POINTER_POS);
+        cl->pointer_seen = srv->pointer.seq;
+    }
+    return 0;
+}
+
+/*
+ * send_update() — encode and send one FramebufferUpdate in the client's encoding
+ *
+ * Server-to-client FramebufferUpdate message:
+ *   message-type(1)=0
+ *   padding(1)=0
+ *   number-of-rectangles(2)
+ *
+ * Then for each rectangle:
+ *   x(2), y(2), w(2), h(2), encoding-type(4)
+ *   followed by the encoded pixel data (for RAW: w*h*bytespp)
+ *
+ * rects are in the client's view of the screen (see server_view()). tiles[i] (or tiles ==
+ * NULL for none) is the tile index of rects[i] when it is a whole tile that may come from
+ * the client's encode cache group, -1 otherwise.
+ *
+ * All headers and per-client payloads (uncached rects, deflated ZRLE) are built in cl->out
+ * first (so the buffer may move while it grows), then the update is sent with writev():
+ * - RAW pixel data in the server format is never copied: the iovec points straight at
+ *   the shadow snapshot (width*4 per line), so full-width rectangles are one entry.
+ * - Cached RAW/Hextile tiles are sent straight from the shared cache entry.
+ * - Header bytes precede their payload in the iovec, so the update header and first rect
+ *   header travel in the first entry.
+ * Whatever the socket doesn't take right away is copied to the client's output queue
+ * (see client_sendv()).
+ *
+ * Returns 0 on success, -1 if the client went away (or on encoder failure).
+ */
+static int send_update(struct server* srv, struct client* cl, const struct rect* rects,
+                       const int* tiles, int nrects) {
+    const struct tilemap* tm = server_view(srv, cl->scale);
+    const int stride = tm->width * 4;
+    struct txrect* tx = srv->tx;
+    struct buf* out = &cl->out;
+    int64_t t0 = now_us();
+    out->len = 0;
+
+    /* With --threads, stale cached tiles are encoded in parallel first (see pool_encode()) */
+    if (cl->group && tiles) {
+        stats.tiles_cached += (uint64_t)group_fresh(cl->group, tm, tiles, nrects);
+        if (srv->pool) pool_encode(srv->pool, cl->group, tm, tiles, nrects, &srv->enc);
+    }
+
+    uint8_t* p = buf_append(out, 4);
+    if (!p) return -1;
+    p[0] = 0; /* FramebufferUpdate */
+    p[1] = 0; /* padding */
+    put16(p + 2, (uint16_t)(cl->layout_due + client_pointer_rects(srv, cl) + cl->ncopies + nrects));
+
+    /* The screen layout leads: it may announce a new size, which everything below uses */
+    if (cl->layout_due) {
+        struct rect size = { cl->layout_reason, cl->layout_status, tm->width, tm->height };
+        if (!(p = buf_append(out, 32))) return -1;
+        put_rect_header(p, &size, ENC_EXT_DESKTOP_SIZE);
+        memset(p + 12, 0, 20);
+        p[12] = 1;                          /* number-of-screens, 3 padding */
+        put16(p + 24, (uint16_t)tm->width); /* screen: id(4)=0, x(2)=0, y(2)=0, w, h, flags(4)=0 */
+        put16(p + 26, (uint16_t)tm->height);
+        cl->layout_due = 0;
+    }
+    if (put_pointer(srv, cl)) return -1;
+
+    /* Queued moves first, in the order found: the rects below draw over their results */
+    for (int i = 0; i < cl->ncopies; i++) {
+        const struct move* m = &cl->copies[i];
+        if (!(p = buf_append(out, 16))) return -1;
+        put_rect_header(p, &m->dst, ENC_COPYRECT);
+        put16(p + 12, (uint16_t)(m->dst.x - m->dx));
+        put16(p + 14, (uint16_t)(m->dst.y - m->dy));
+    }
+    stats.copyrects += (uint64_t)cl->ncopies;
+    cl->ncopies = 0;
+
+    /* Pass 1: headers + per-client payloads into cl->out, external payloads into tx[] */
+    for (int i = 0; i < nrects; i++) {
+        const struct rect* r = &rects[i];
+        if (!(p = buf_append(out, 12))) return -1;
+        put_rect_header(p, r, cl->encoding);
+
+        tx[i].src = NULL;
+        if (rect_is_zero_copy(cl)) {
+            tx[i].src     = tm->shadow + (size_t)r->y * (size_t)stride + (size_t)r->x * 4;
+            tx[i].linelen = (size_t)r->w * 4;
+            tx[i].pitch   = (size_t)stride;
+            tx[i].lines   = r->h;
+        } else if (cl->group && tiles && tiles[i] >= 0) {
+            const struct buf* b = group_tile(cl->group, tm, tiles[i], &srv->enc);
+            if (!b) return -1;
+#ifdef HAVE_ZLIB
+            if (cl->encoding == ENC_ZRLE || cl->encoding == ENC_TIGHT) {
+                if (cl->encoding == ENC_ZRLE ? zrle_deflate(cl, b->data, b->len, out)
+                                             : tight_finish(cl, b->data, b->len, out)) return -1;
+                tx[i].hdr_end = out->len;
+                continue;
+            }
+#endif
+            tx[i].src     = b->data;
+            tx[i].linelen = b->len;
+            tx[i].pitch   = b->len;
+            tx[i].lines   = 1;
+        } else if (encode_rect(cl, &srv->enc, tm->shadow, stride, r, out)) {
+            return -1;
+        }
+        tx[i].hdr_end = out->len;
+    }
+
+    /* Update size, for the client's frame rate adaptation */
+    cl->last_size = out->len;
+    for (int i = 0; i < nrects; i++) {
+        if (tx[i].src) cl->last_size += tx[i].linelen * (size_t)tx[i].lines;
+    }
+    cl->last_frame = now_ms();
+
+    int slot = stats_slot(cl->encoding);
+    int64_t t1 = now_us();
+    stats.updates++;
+    stats.rects[slot] += (uint64_t)nrects;
+    stats.bytes[slot] += cl->last_size;
+    hist_add(&stats.encode, t1 - t0);
+    if (cl->record && record_header(srv, cl, cl->last_size)) return -1;
+
+    /* Pass 2: send buffered bytes interleaved with the external payloads */
+    struct iovec iov[TX_IOV_MAX];
+    int n = 0;
+    size_t done = 0;
+    for (int i = 0; i < nrects; i++) {
+        const struct txrect* t = &tx[i];
+        int contiguous = t->pitch == t->linelen;
+        int need = 1 + (!t->src ? 0 : contiguous ? 1 : t->lines);
+
+        if (n + need > TX_IOV_MAX && n > 0) {
+            if (client_sendv(cl, iov, n, 1)) return -1;
+            n = 0;
+        }
+
+        iov[n].iov_base = out->data + done;
+        iov[n].iov_len  = t->hdr_end - done;
+        n++;
+        done = t->hdr_end;
+        if (!t->src) continue;
+
+        if (contiguous) {
+            iov[n].iov_base = (void*)t->src;
+            iov[n].iov_len  = t->linelen * (size_t)t->lines;
+            n++;
+            continue;
+        }
+
+        for (int y = 0; y < t->lines; y++) {
+            if (n == TX_IOV_MAX) {
+                if (client_sendv(cl, iov, n, 1)) return -1;
+                n = 0;
+            }
+            iov[n].iov_base = (void*)(t->src + (size_t)y * t->pitch);
+            iov[n].iov_len  = t->linelen;
+            n++;
+        }
+    }
+
+    if (done < out->len) {
+        iov[n].iov_base = out->data + done;
+        iov[n].iov_len  = out->len - done;
+        n++;
+    }
+    int rc = n ? client_sendv(cl, iov, n, 0) : 0;
+    hist_add(&stats.send, now_us() - t1);
+    if (cl->record && client_queued(cl)) rc = -1; /* a short write to a file: the disk is full */
+    if (!rc) {
+        cl->first_sent = 1;
+        client_first_frame(cl);
+    }
+    return rc;
+}
+
+/*
+ * Displayed page
+ * --------------
+ * A double-buffering UI draws into one page of the virtual framebuffer while the other is
+ * on screen, and flips by panning (yoffset). Scanning offset 0 regardless would send the
+ * half-drawn back buffer half of the time, so the whole virtual area is mapped and every
+ * scan first asks the driver which page is displayed.
+ *
+ * Once the page has been seen to flip, the displayed page stops changing between flips —
+ * the UI draws into the other one — so ticks without a flip skip the scan. A full scan
+ * still runs every PAGE_SAFETY_MS, and if one of those finds changes without a flip the
+ * UI draws into the displayed page too, and flip gating is switched off for good.
+ *
+ * Where the driver supports FBIO_WAITFORVSYNC the scan starts right after a vertical
+ * blank, which is when a flip takes effect and when vsync-paced UIs are done drawing.
+ */
+#define PAGE_FLIPS_TO_GATE 2
+#define PAGE_SAFETY_MS     1000
+#define VSYNC_MAX_WAIT_MS  50
+
+/* fb_locate_page() — refresh the pan position; returns 1 if the displayed page moved */
+static int fb_locate_page(struct server* srv, struct stats* st) {
+    struct fb_var_screeninfo v;
+    if (srv->fbfd < 0) return 0; /* --geometry: a plain file, no driver to ask */
+    st->sys[SYS_IOCTL]++;
+    if (ioctl(srv->fbfd, FBIOGET_VSCREENINFO, &v)) return 0;
+
+    /* A pan position that would put the page outside the mapping is not trusted */
+    int64_t bytespp = srv->tm.conv.bytespp;
+    if ((int64_t)v.yoffset + srv->tm.height > srv->vlines || (int64_t)v.xoffset * bytespp +
+        (int64_t)srv->tm.width * bytespp > srv->stride) {
+        v.xoffset = 0;
+        v.yoffset = 0;
+    }
+    if (v.xoffset == srv->xoffset && v.yoffset == srv->yoffset) return 0;
+
+    srv->xoffset = v.xoffset;
+    srv->yoffset = v.yoffset;
+    srv->fbmem = srv->fbbase + (size_t)v.yoffset * (size_t)srv->stride + (size_t)v.xoffset * (size_t)bytespp;
+    return 1;
+}
+
+/*
+ * fb_probe_vsync() — decide whether to wait for vertical blank before scanning
+ *
+ * Drivers without vsync support fail with ENOTTY; some accept the call but time out
+ * instead of waiting for a real interrupt, which would stall the event loop every tick.
+ */
+static int fb_probe_vsync(int fd) {
+    uint32_t crtc = 0;
+    int64_t t0 = now_ms();
+    for (int i = 0; i < 2; i++) {
+        if (ioctl(fd, FBIO_WAITFORVSYNC, &crtc)) return 0;
+    }
+    return now_ms() - t0 <= 2 * VSYNC_MAX_WAIT_MS;
+}
+
+/*
+ * fb_capture() — one capture pass: locate the displayed page and scan it into tm
+ *
+ * Returns 1 if tiles changed, 0 if none did or the tick was skipped on a page-flipping UI
+ * (see above). Counters go to *st. The page state in srv belongs to whoever captures:
+ * the event loop, or the capture thread with its own tilemap.
+ */
+static int fb_capture(struct server* srv, struct tilemap* tm, struct stats* st) {
+    int64_t now = now_ms();
+
+    if (srv->vsync) {
+        uint32_t crtc = 0;
+        st->sys[SYS_IOCTL]++;
+        ioctl(srv->fbfd, FBIO_WAITFORVSYNC, &crtc);
+    }
+    int flipped = fb_locate_page(srv, st);
+    if (flipped && srv->flips >= 0 && srv->flips++ == PAGE_FLIPS_TO_GATE - 1) {
+        fprintf(stderr, "fb0rfb: display is page flipping, scanning on flips\n");
+    }
+
+    int gated = srv->flips >= PAGE_FLIPS_TO_GATE;
+    if (gated && !flipped && now - srv->last_full < PAGE_SAFETY_MS) {
+        st->ticks_gated++;
+        return 0;
+    }
+    if (!gated || !flipped) srv->last_full = now;
+
+    int64_t t0 = now_us();
+    int changed = tilemap_scan(tm, srv->fbmem, srv->stride);
+    st->scans++;
+    hist_add(&st->capture, now_us() - t0);
+    if (!changed) return 0;
+    st->scans_changed++;
+    if (gated && !flipped) {
+        fprintf(stderr, "fb0rfb: displayed page drawn into, scanning every tick\n");
+        srv->flips = -1;
+    }
+    return 1;
+}
+
+/*
+ * Capture thread (--capture-thread)
+ * ---------------------------------
+ * Capture can also run on its own thread at SCHED_IDLE, so it never competes with the
+ * printer's firmware for CPU, keeps its own frame timing, and isn't delayed by the work
+ * of encoding and sending. It scans into its own tilemap and publishes complete frames
+ * through a lock-free ring of SNAP_SLOTS snapshots (triple buffering):
+ * - at any time one slot is held by the event loop, one is the newest published frame,
+ *   and the thread fills the third;
+ * - publishing swaps the filled slot with the newest one, marked SNAP_FRESH; taking a
+ *   snapshot swaps the held slot with the newest one if it is fresh. Neither side blocks,
+ *   and a slot is never written while the event loop reads it;
+ * - each slot keeps the version of every tile it holds (see tilemap.version), so filling
+ *   a slot copies only what changed since it was last filled, and the event loop derives
+ *   the changed tiles from them, however many frames it skipped;
+ * - an eventfd wakes the event loop for each new frame.
+ * The thread only runs while some client waits for a frame (the mutex and condition
+ * variable carry that, and the thread's counters); the ring itself takes no lock.
+ * While it sleeps the newest frame gets old, so after a wake-up nothing is answered
+ * until a pass that started after it is done; that pass signals the event loop even if
+ * nothing changed. Wake-ups are numbered (gen) to tell that pass from one in flight.
+ */
+#define SNAP_SLOTS 3
+#define SNAP_FRESH 0x80u
+
+struct snapshot {
+    uint8_t* pixels;            /* a full frame, packed like tilemap.shadow */
+    uint32_t* version;          /* ntiles: version of each tile it holds */
+};
+
+struct capture {
+    struct tilemap ref;         /* the thread's shadow, hashes and change tracking */
+    struct snapshot slot[SNAP_SLOTS];
+    _Atomic unsigned latest;    /* newest published slot, | SNAP_FRESH until taken */
+    _Atomic unsigned done_gen;  /* gen at the start of the last completed pass */
+    unsigned writing;           /* slot the thread fills next (thread only) */
+    unsigned held;              /* slot the event loop reads from (event loop only) */
+    int evfd;                   /* eventfd: a frame was published */
+    pthread_t thread;
+    pthread_mutex_t lock;       /* guards active, gen and counts */
+    pthread_cond_t wake;
+    int active;                 /* some client waits for a frame */
+    unsigned gen;               /* incremented on every wake-up */
+    struct stats counts;        /* the thread's counters, not yet folded into stats */
+    struct stats pending;       /* counted by the thread since its last fold (thread only) */
+};
+
+/* Copy tile t between two frames packed like tilemap.shadow */
+static void tile_copy(const struct tilemap* tm, int t, uint8_t* dst, const uint8_t* src) {
+    struct rect r = tile_rect(tm, t % tm->cols, t / tm->cols);
+    size_t stride = (size_t)tm->width * 4;
+    size_t off = (size_t)r.y * stride + (size_t)r.x * 4;
+    for (int y = 0; y < r.h; y++, off += stride) memcpy(dst + off, src + off, (size_t)r.w * 4);
+}
+
+/* capture_publish() — bring the free slot up to date and make it the newest frame */
+static void capture_publish(struct capture* cap) {
+    const struct tilemap* ref = &cap->ref;
+    struct snapshot* s = &cap->slot[cap->writing];
+    for (int t = 0; t < ref->ntiles; t++) {
+        if (s->version[t] == ref->version[t]) continue;
+        tile_copy(ref, t, s->pixels, ref->shadow);
+        s->version[t] = ref->version[t];
+    }
+
+    cap->writing = atomic_exchange(&cap->latest, cap->writing | SNAP_FRESH) & ~SNAP_FRESH;
+}
+
+/* Fold the thread's capture counters into c (caller holds the lock) */
+static void capture_fold(struct stats* c, struct stats* from) {
+    c->scans += from->scans;
+    c->scans_changed += from->scans_changed;
+    c->ticks_gated += from->ticks_gated;
+    for (int i = 0; i < SYS_KINDS; i++) c->sys[i] += from->sys[i];
+    c->capture.count += from->capture.count;
+    c->capture.sum_us += from->capture.sum_us;
+    for (int b = 0; b < HIST_BUCKETS; b++) c->capture.bucket[b] += from->capture.bucket[b];
+    memset(from, 0, sizeof(*from));
+}
+
+static void* capture_main(void* arg) {
+    struct server* srv = (struct server*)arg;
+    struct capture* cap = srv->cap;
+    struct stats* counts = &cap->pending;
+    struct scan_pace pace = srv->pace; /* the thread's own, like the frame clock's */
+
+    /* Lowest priority there is; nice 19 where SCHED_IDLE isn't allowed */
+    struct sched_param sp = { 0 };
+    if (pthread_setschedparam(pthread_self(), SCHED_IDLE, &sp)) {
+        setpriority(PRIO_PROCESS, (id_t)syscall(SYS_gettid), 19);
+    }
+
+    int64_t next = now_ms();
+    for (;;) {
+        pthread_mutex_lock(&cap->lock);
+        capture_fold(&cap->counts, counts);
+        while (!cap->active) {
+            pthread_cond_wait(&cap->wake, &cap->lock);
+            next = now_ms();
+        }
+        unsigned gen = cap->gen;
+        pthread_mutex_unlock(&cap->lock);
+
+        struct timespec ts = { (time_t)(next / 1000), (long)(next % 1000) * 1000000L };
+        while (clock_nanosleep(CLOCK_MONOTONIC, TIMER_ABSTIME, &ts, NULL) == EINTR) { }
+        /* Publish, then mark the pass done, then signal: the event loop checks in that order */
+        int changed = fb_capture(srv, &cap->ref, counts);
+        next += scan_pace_next(&pace, changed, now_ms());
+        if (next < now_ms()) next = now_ms() + pace.interval; /* fell behind: don't catch up */
+        if (changed) capture_publish(cap);
+        int first = atomic_load(&cap->done_gen) != gen;
+        atomic_store(&cap->done_gen, gen);
+        if (changed || first) {
+            uint64_t one = 1;
+            if (write(cap->evfd, &one, sizeof(one)) < 0) { /* counter saturated: already signalled */ }
+        }
+    }
+    return NULL;
+}
+
+/* Is the newest frame recent: is the thread running, with a pass done since it woke? */
+static int capture_current(const struct capture* cap) {
+    return cap->active && atomic_load(&cap->done_gen) == cap->gen;
+}
+
+/*
+ * capture_take() — switch the event loop to the newest frame, if there is a new one
+ *
+ * Fills tm->changed and returns the number of changed tiles.
+ */
+static int capture_take(struct server* srv) {
+    struct capture* cap = srv->cap;
+    struct tilemap* tm = &srv->tm;
+    if (!(atomic_load(&cap->latest) & SNAP_FRESH)) return 0;
+    cap->held = atomic_exchange(&cap->latest, cap->held) & ~SNAP_FRESH;
+
+    const struct snapshot* s = &cap->slot[cap->held];
+    int changed = 0;
+    tm->shadow = s->pixels;
+    for (int t = 0; t < tm->ntiles; t++) {
+        tm->changed[t] = s->version[t] != tm->version[t];
+        tm->version[t] = s->version[t];
+        changed += tm->changed[t];
+    }
+    return changed;
+}
+
+/* capture_set_active() — run the thread while some client waits */
+static void capture_set_active(struct capture* cap, int active) {
+    if (cap->active == active) return;
+    pthread_mutex_lock(&cap->lock);
+    if (active) cap->gen++;
+    cap->active = active;
+    pthread_cond_signal(&cap->wake);
+    pthread_mutex_unlock(&cap->lock);
+}
+
+/* Bring the capture thread's counters into stats, before they are reported */
+static void capture_counts(struct server* srv) {
+    if (!srv->cap) return;
+    pthread_mutex_lock(&srv->cap->lock);
+    capture_fold(&stats, &srv->cap->counts);
+    pthread_mutex_unlock(&srv->cap->lock);
+}
+
+/*
+ * capture_start() — set up the ring and start the thread
+ *
+ * The thread takes over the page state and the scan method from the event loop's
+ * tilemap, which from then on only tracks what the event loop has taken.
+ */
+static int capture_start(struct server* srv) {
+    struct capture* cap = (struct capture*)calloc(1, sizeof(*cap));
+    struct tilemap* tm = &srv->tm;
+    if (!cap || tilemap_init(&cap->ref, tm->width, tm->height, tm->use_hash)) return -1;
+    cap->ref.bulk = tm->bulk;
+    cap->ref.conv = tm->conv;
+
+    /* The reference starts where the event loop's tilemap is (tilemap_pick_scan may have run) */
+    memcpy(cap->ref.shadow, tm->shadow, (size_t)tm->width * (size_t)tm->height * 4);
+    memcpy(cap->ref.version, tm->version, (size_t)tm->ntiles * sizeof(uint32_t));
+    cap->ref.seq = tm->seq;
+    if (tm->use_hash) memcpy(cap->ref.hashes, tm->hashes, (size_t)tm->height * (size_t)tm->cols * sizeof(uint64_t));
+
+    for (int i = 0; i < SNAP_SLOTS; i++) {
+        cap->slot[i].pixels = (uint8_t*)malloc((size_t)tm->width * (size_t)tm->height * 4);
+        cap->slot[i].version = (uint32_t*)malloc((size_t)tm->ntiles * sizeof(uint32_t));
+        if (!cap->slot[i].pixels || !cap->slot[i].version) return -1;
+        memcpy(cap->slot[i].pixels, tm->shadow, (size_t)tm->width * (size_t)tm->height * 4);
+        memcpy(cap->slot[i].version, tm->version, (size_t)tm->ntiles * sizeof(uint32_t));
+    }
+    cap->held = 0;
+    atomic_init(&cap->latest, 1u);
+    cap->writing = 2;
+    free(tm->shadow);
+    tm->shadow = cap->slot[0].pixels;
+
+    cap->evfd = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (cap->evfd < 0) return -1;
+    pthread_mutex_init(&cap->lock, NULL);
+    pthread_cond_init(&cap->wake, NULL);
+    srv->cap = cap;
+    if (pthread_create(&cap->thread, NULL, capture_main, srv)) {
+        srv->cap = NULL;
+        return -1;
+    }
+    return 0;
+}
+
+/*
+ * Move detection (CopyRect)
+ * -------------------------
+ * Scrolling a list or sliding a panel changes every tile it covers, yet the new pixels
+ * are old ones that moved. Viewers that support CopyRect (encoding 1) are sent such
+ * tiles as "copy this rectangle from there", 16 bytes whatever the size. After a scan
+ * that changed tiles, they are compared with the previous frame (movefind.prev):
+ * - vertical offsets: in each tile column, the column's slice of every line is hashed
+ *   in both frames (see seg_hash()), and changed lines vote for the offset of the old
+ *   line with the same hash, if that hash is unique in the column;
+ * - horizontal offsets: in each tile row, a few probe lines look up a distinctive run
+ *   of new pixels in the old line;
+ * - the offsets with the most votes are tried on every changed tile, comparing its
+ *   pixels with the old frame at that offset. Hashes only suggest offsets, and only
+ *   exact matches count. Matching tiles with the same offset merge into rectangles.
+ * The viewer performs the moves one after the other, so they are ordered so that none
+ * overwrites the source of a later one. Where moves form a cycle, one of them is
+ * dropped and its tiles are encoded as usual.
+ * The capture thread publishes frames that the event loop may skip, so there is no
+ * previous frame to compare with, and --capture-thread goes without move detection.
+ */
+#define MAX_MOVES      32
+#define MOVE_OFFSETS   4    /* offsets tried on each tile */
+#define MOVE_MIN_VOTES 8    /* lines that must agree on a vertical offset */
+#define MOVE_PROBES    3    /* probe lines per tile row for horizontal offsets */
+#define MOVE_WINDOW    8    /* pixels in a probe window */
+
+struct move_offset {
+    int dx, dy;
+    int votes;
+};
+
+struct movefind {
+    uint8_t* prev;              /* the frame before the last scan, packed like the shadow */
+    uint64_t* old_h;            /* height: line hashes of one tile column, old frame */
+    uint64_t* new_h;            /* ... and new frame */
+    uint64_t* tab_key;          /* tab_size: unique old line hashes (open addressing) */
+    int* tab_line;              /* ... their line; -1 empty, -2 not unique */
+    int tab_size;               /* power of two, at least twice the height */
+    int* votes;                 /* 2*height: votes per vertical offset */
+    int8_t* tile_off;           /* ntiles: offset that matched the tile, -1 none */
+    struct move moves[MAX_MOVES];
+    int nmoves;
+};
+
+/*
+ * movefind_init() — set up move detection for tm, starting from its current shadow
+ *
+ * Returns 0 on success, -1 on allocation failure.
+ */
+static int movefind_init(struct movefind** mfp, const struct tilemap* tm) {
+    struct movefind* mf = (struct movefind*)calloc(1, sizeof(*mf));
+    if (!mf) return -1;
+    size_t size = (size_t)tm->width * (size_t)tm->height * 4;
+    mf->tab_size = 1;
+    while (mf->tab_size < 2 * tm->height) mf->tab_size *= 2;
+    mf->prev = (uint8_t*)malloc(size);
+    mf->old_h = (uint64_t*)calloc((size_t)tm->height, sizeof(uint64_t));
+    mf->new_h = (uint64_t*)calloc((size_t)tm->height, sizeof(uint64_t));
+    mf->tab_key = (uint64_t*)calloc((size_t)mf->tab_size, sizeof(uint64_t));
+    mf->tab_line = (int*)calloc((size_t)mf->tab_size, sizeof(int));
+    mf->votes = (int*)calloc(2 * (size_t)tm->height, sizeof(int));
+    mf->tile_off = (int8_t*)calloc((size_t)tm->ntiles, 1);
+    if (!mf->prev || !mf->old_h || !mf->new_h || !mf->tab_key || !mf->tab_line || !mf->votes ||
+        !mf->tile_off) return -1;
+    memcpy(mf->prev, tm->shadow, size);
+    *mfp = mf;
+    return 0;
+}
+
+/* Count a vote for an offset, keeping the list at MOVE_OFFSETS * 4 entries at most */
+static void move_offset_add(struct move_offset* off, int* noff, int dx, int dy, int votes) {
+    for (int i = 0; i < *noff; i++) {
+        if (off[i].dx == dx && off[i].dy == dy) {
+            off[i].votes += votes;
+            return;
+        }
+    }
+    if (*noff == MOVE_OFFSETS * 4) return;
+    off[*noff].dx = dx;
+    off[*noff].dy = dy;
+    off[(*noff)++].votes = votes;
+}
+
+/* Slot of line hash key in the open-addressing table */
+static int movefind_slot(const struct movefind* mf, uint64_t key) {
+    int i = (int)((key * 0x9e3779b97f4a7c15ull) >> 40) & (mf->tab_size - 1);
+    while (mf->tab_line[i] != -1 && mf->tab_key[i] != key) i = (i + 1) & (mf->tab_size - 1);
+    return i;
+}
+
+/* moves_vertical() — vote for the vertical offset of the changed lines in tile column tx */
+static void moves_vertical(struct movefind* mf, const struct tilemap* tm, int tx,
+                           struct move_offset* off, int* noff) {
+    int ty0 = -1, ty1 = 0, nchanged = 0;
+    for (int ty = 0; ty < tm->rows; ty++) {
+        if (!tm->changed[ty * tm->cols + tx]) continue;
+        if (ty0 < 0) ty0 = ty;
+        ty1 = ty + 1;
+        nchanged++;
+    }
+    if (nchanged < 2) return;
+
+    const int h = tm->height;
+    const size_t stride = (size_t)tm->width * 4;
+    const size_t off_x = (size_t)tx * TILE_SIZE * 4;
+    const size_t n = (size_t)(tx == tm->cols - 1 ? tm->width - tx * TILE_SIZE : TILE_SIZE) * 4;
+    int ya = ty0 * TILE_SIZE, yb = ty1 * TILE_SIZE < h ? ty1 * TILE_SIZE : h;
+
+    /* Old lines: all of the column, indexed by hash where the hash is unique */
+    for (int i = 0; i < mf->tab_size; i++) mf->tab_line[i] = -1;
+    for (int y = 0; y < h; y++) {
+        uint64_t v = seg_hash(mf->prev + (size_t)y * stride + off_x, n);
+        mf->old_h[y] = v;
+        int i = movefind_slot(mf, v);
+        if (mf->tab_line[i] == -1) {
+            mf->tab_key[i] = v;
+            mf->tab_line[i] = y;
+        } else {
+            mf->tab_line[i] = -2;
+        }
+    }
+
+    /* New lines: the hash scan has them already */
+    int best = 0, best_votes = 0;
+    for (int y = ya; y < yb; y++) {
+        uint64_t v = tm->use_hash ? tm->hashes[(size_t)y * (size_t)tm->cols + (size_t)tx]
+                                  : seg_hash(tm->shadow + (size_t)y * stride + off_x, n);
+        mf->new_h[y] = v;
+        if (v == mf->old_h[y]) continue;
+        int i = movefind_slot(mf, v);
+        if (mf->tab_line[i] < 0) continue;
+        int dy = y - mf->tab_line[i];
+        int votes = ++mf->votes[dy + h];
+        if (votes > best_votes) {
+            best = dy;
+            best_votes = votes;
+        }
+    }
+    for (int y = ya; y < yb; y++) {
+        if (mf->new_h[y] == mf->old_h[y]) continue;
+        int i = movefind_slot(mf, mf->new_h[y]);
+        if (mf->tab_line[i] >= 0) mf->votes[y - mf->tab_line[i] + h] = 0;
+    }
+    if (best_votes >= MOVE_MIN_VOTES) move_offset_add(off, noff, 0, best, best_votes);
+}
+
+/* moves_horizontal() — look up probe lines of the changed span of tile row ty in the old frame */
+static void moves_horizontal(struct movefind* mf, const struct tilemap* tm, int ty,
+                             struct move_offset* off, int* noff) {
+    const uint8_t* chg = tm->changed + ty * tm->cols;
+    int tx0 = -1, tx1 = 0, nchanged = 0;
+    for (int tx = 0; tx < tm->cols; tx++) {
+        if (!chg[tx]) continue;
+        if (tx0 < 0) tx0 = tx;
+        tx1 = tx + 1;
+        nchanged++;
+    }
+    if (nchanged < 2) return;
+
+    const int w = tm->width;
+    int xa = tx0 * TILE_SIZE, xb = tx1 * TILE_SIZE < w ? tx1 * TILE_SIZE : w;
+    struct rect band = tile_rect(tm, 0, ty);
+    int found[MOVE_PROBES], nfound = 0;
+
+    for (int k = 1; k <= MOVE_PROBES; k++) {
+        int y = band.y + band.h * k / (MOVE_PROBES + 1);
+        const uint32_t* nl = (const uint32_t*)(tm->shadow + (size_t)y * (size_t)w * 4);
+        const uint32_t* ol = (const uint32_t*)(mf->prev + (size_t)y * (size_t)w * 4);
+
+        /* A window that isn't a single colour, so that it can only match in few places */
+        int p = xa;
+        while (p + MOVE_WINDOW <= xb && nl[p] == nl[p + MOVE_WINDOW - 1]) p++;
+        if (p + MOVE_WINDOW > xb) continue;
+
+        int dx = 0, matches = 0;
+        for (int q = 0; q + MOVE_WINDOW <= w && matches <= 1; q++) {
+            if (ol[q] != nl[p] || memcmp(ol + q, nl + p, MOVE_WINDOW * 4)) continue;
+            dx = p - q;
+            matches++;
+        }
+        if (matches == 1 && dx) found[nfound++] = dx;
+    }
+
+    /* Probes voting for the same offset */
+    for (int i = 0; i < nfound; i++) {
+        int votes = 0;
+        for (int j = 0; j < nfound; j++) votes += found[j] == found[i];
+        if (votes >= 2) {
+            move_offset_add(off, noff, found[i], 0, votes * MOVE_MIN_VOTES);
+            return;
+        }
+    }
+}
+
+/* Does tile rect r of the new frame hold exactly what the old one had at r - (dx, dy)? */
+static int tile_moved(const struct movefind* mf, const struct tilemap* tm, const struct rect* r,
+                      int dx, int dy) {
+    int sx = r->x - dx, sy = r->y - dy;
+    if (sx < 0 || sy < 0 || sx + r->w > tm->width || sy + r->h > tm->height) return 0;
+    size_t stride = (size_t)tm->width * 4;
+    for (int y = 0; y < r->h; y++) {
+        if (diff_seg(tm->shadow + (size_t)(r->y + y) * stride + (size_t)r->x * 4,
+                     mf->prev + (size_t)(sy + y) * stride + (size_t)sx * 4, (size_t)r->w * 4)) return 0;
+    }
+    return 1;
+}
+
+static int rects_overlap(const struct rect* a, const struct rect* b) {
+    struct rect r = *a;
+    return rect_clip(&r, b);
+}
+
+static struct rect move_src(const struct move* m) {
+    struct rect r = m->dst;
+    r.x -= m->dx;
+    r.y -= m->dy;
+    return r;
+}
+
+/*
+ * moves_order() — put moves in an order where none overwrites the source of a later one
+ *
+ * Moves caught in a cycle are dropped one at a time until the rest can be ordered.
+ * Returns the number of moves kept.
+ */
+static int moves_order(struct move* m, int n) {
+    struct move out[MAX_MOVES];
+    uint8_t done[MAX_MOVES] = { 0 };
+    int nout = 0;
+    for (int left = n; left > 0; left--) {
+        int pick = -1, first = -1;
+        for (int i = 0; i < n && pick < 0; i++) {
+            if (done[i]) continue;
+            if (first < 0) first = i;
+            int ok = 1;
+            for (int j = 0; j < n && ok; j++) {
+                if (j == i || done[j]) continue;
+                struct rect src = move_src(&m[j]);
+                ok = !rects_overlap(&m[i].dst, &src);
+            }
+            if (ok) pick = i;
+        }
+        if (pick >= 0) out[nout++] = m[pick];
+        done[pick >= 0 ? pick : first] = 1;
+    }
+    memcpy(m, out, (size_t)nout * sizeof(*m));
+    return nout;
+}
+
+/*
+ * moves_find() — detect the moves between the previous frame and the shadow
+ *
+ * tm->changed describes the scan that produced the shadow. Fills mf->moves and returns
+ * their number.
+ */
+static int moves_find(struct movefind* mf, const struct tilemap* tm) {
+    struct move_offset off[MOVE_OFFSETS * 4];
+    int noff = 0;
+    mf->nmoves = 0;
+    for (int tx = 0; tx < tm->cols; tx++) moves_vertical(mf, tm, tx, off, &noff);
+    for (int ty = 0; ty < tm->rows; ty++) moves_horizontal(mf, tm, ty, off, &noff);
+    if (!noff) return 0;
+
+    /* Strongest offsets first */
+    for (int i = 1; i < noff; i++) {
+        struct move_offset o = off[i];
+        int j = i;
+        for (; j > 0 && off[j - 1].votes < o.votes; j--) off[j] = off[j - 1];
+        off[j] = o;
+    }
+    if (noff > MOVE_OFFSETS) noff = MOVE_OFFSETS;
+
+    for (int t = 0; t < tm->ntiles; t++) {
+        mf->tile_off[t] = -1;
+        if (!tm->changed[t]) continue;
+        struct rect r = tile_rect(tm, t % tm->cols, t / tm->cols);
+        for (int k = 0; k < noff; k++) {
+            if (tile_moved(mf, tm, &r, off[k].dx, off[k].dy)) {
+                mf->tile_off[t] = (int8_t)k;
+                break;
+            }
+        }
+    }
+
+    /* Merge like tiles_merge(): runs along a tile row, then runs of the same width below */
+    int n = 0;
+    for (int ty = 0; ty < tm->rows; ty++) {
+        int row_start = n;
+        const int8_t* to = mf->tile_off + ty * tm->cols;
+        for (int tx = 0; tx < tm->cols; ) {
+            int k = to[tx];
+            if (k < 0) { tx++; continue; }
+            int tx0 = tx;
+            while (tx < tm->cols && to[tx] == k) tx++;
+
+            struct rect run = tile_rect(tm, tx0, ty);
+            run.w = (tx * TILE_SIZE < tm->width ? tx * TILE_SIZE : tm->width) - run.x;
+            struct move* m = NULL;
+            for (int i = 0; i < row_start; i++) {
+                struct move* p = &mf->moves[i];
+                if (p->dx == off[k].dx && p->dy == off[k].dy && p->dst.x == run.x &&
+                    p->dst.w == run.w && p->dst.y + p->dst.h == run.y) { m = p; break; }
+            }
+            if (m) {
+                m->dst.h += run.h;
+            } else if (n < MAX_MOVES) {
+                mf->moves[n].dst = run;
+                mf->moves[n].dx = off[k].dx;
+                mf->moves[n++].dy = off[k].dy;
+            }
+        }
+    }
+    mf->nmoves = moves_order(mf->moves, n);
+    return mf->nmoves;
+}
+
+/* movefind_sync() — make the previous frame the shadow again, for the next scan */
+static void movefind_sync(struct movefind* mf, const struct tilemap* tm) {
+    for (int t = 0; t < tm->ntiles; t++) {
+        if (tm->changed[t]) tile_copy(tm, t, mf->prev, tm->shadow);
+    }
+}
+
+/* Is any tile intersecting area dirty? */
+static int tiles_any(const struct tilemap* tm, const uint8_t* dirty, const struct rect* area) {
+    int tx0, tx1, ty0, ty1;
+    tile_range(area, &tx0, &tx1, &ty0, &ty1);
+    for (int ty = ty0; ty < ty1; ty++) {
+        for (int tx = tx0; tx < tx1; tx++) {
+            if (dirty[ty * tm->cols + tx]) return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * client_drop_copies() — forget a client's queued moves: their tiles are sent as usual
+ */
+static void client_drop_copies(const struct tilemap* tm, struct client* cl) {
+    for (int i = 0; i < cl->ncopies; i++) tiles_mark(tm, cl->dirty, &cl->copies[i].dst);
+    cl->ncopies = 0;
+}
+
+/*
+ * client_take_moves() — queue this scan's moves that a client can perform
+ *
+ * Call before this scan's changes are folded into the client's dirty tiles: a clean tile
+ * is one the client has (or will have, once its queued moves are done) as of the previous
+ * frame, so a move only applies where its source is clean. A lagging client typically
+ * still has the text scrolled in last time to fetch, so moves are split by tile row and
+ * the rows with a clean source are kept. Moving down, the upper part would overwrite
+ * the source of the lower one, so the parts are taken bottom up. Queued moves go out in
+ * order at the head of the client's next update. Returns the number queued; their
+ * destinations are clean once the changes are folded in (see server_scan()).
+ */
+static int client_take_moves(const struct tilemap* tm, struct client* cl, const struct move* m, int n) {
+    int taken = 0;
+    for (int i = 0; i < n; i++) {
+        const int rows = (m[i].dst.h + TILE_SIZE - 1) / TILE_SIZE;
+        struct move part = m[i];
+        part.dst.h = 0;
+        for (int k = 0; k <= rows; k++) {
+            /* Row k in taking order; k == rows only flushes the last part */
+            struct move row = m[i];
+            if (k < rows) {
+                int r = m[i].dy > 0 ? rows - 1 - k : k;
+                row.dst.y = m[i].dst.y + r * TILE_SIZE;
+                row.dst.h = m[i].dst.y + m[i].dst.h - row.dst.y;
+                if (row.dst.h > TILE_SIZE) row.dst.h = TILE_SIZE;
+                struct rect src = move_src(&row);
+                if (!tiles_any(tm, cl->dirty, &src)) {
+                    if (!part.dst.h || row.dst.y < part.dst.y) part.dst.y = row.dst.y;
+                    part.dst.h += row.dst.h;
+                    continue;
+                }
+            }
+            if (!part.dst.h) continue;
+            if (cl->ncopies == MAX_COPIES) {
+                client_drop_copies(tm, cl);
+                return 0;
+            }
+            cl->copies[cl->ncopies++] = part;
+            taken++;
+            part.dst.h = 0;
+        }
+    }
+    return taken;
+}
+
+/*
+ * Scaled views (--scale)
+ * ----------------------
+ * A monitoring viewer on a slow link rarely needs every pixel. Viewers can be given a
+ * half or quarter size view of the screen instead (--scale for everybody, SetDesktopSize
+ * per viewer): a tilemap of its own whose shadow is box-filtered from the full-size one,
+ * so the encoders, the cache groups and the wire see a quarter or a sixteenth of the
+ * pixels. Change detection still reads the whole framebuffer: the filter needs every
+ * pixel anyway, and the view only has to be refreshed where full-size tiles changed.
+ * Views are refreshed by the scan only while some viewer uses them, and the first time
+ * one is used again it is rebuilt from the shadow (see view_open()).
+ */
+
+/*
+ * view_downsample() — box-filter area r of a scaled view from the full-size shadow
+ *
+ * dst is where pixel (r->x, r->y) goes, lines pitch bytes apart.
+ * Each pixel is the rounded mean of the scale x scale block it stands for. Channels are
+ * bytes (srv->can_scale), so the four bytes of a pixel are summed two at a time in 16-bit
+ * lanes: sixteen bytes of 255 still fit, and no channel carries into the next.
+ */
+static void view_downsample(uint8_t* dst, size_t pitch, const struct tilemap* tm, int scale,
+                            const struct rect* r) {
+    const size_t stride = (size_t)tm->width * 4;
+    const int shift = scale == 2 ? 2 : 4;
+    const uint32_t round = (uint32_t)(scale * scale / 2) * 0x00010001u;
+
+    for (int y = r->y; y < r->y + r->h; y++, dst += pitch) {
+        uint8_t* d = dst;
+        const uint8_t* src = tm->shadow + (size_t)y * (size_t)scale * stride + (size_t)r->x * (size_t)scale * 4;
+        for (int x = 0; x < r->w; x++, d += 4, src += scale * 4) {
+            uint32_t lo = round, hi = round; /* bytes 0 and 2, bytes 1 and 3 */
+            for (int j = 0; j < scale; j++) {
+                const uint8_t* line = src + (size_t)j * stride;
+                for (int i = 0; i < scale; i++) {
+                    uint32_t px;
+                    memcpy(&px, line + i * 4, 4);
+                    lo += px & 0x00ff00ffu;
+                    hi += (px >> 8) & 0x00ff00ffu;
+                }
+            }
+            uint32_t out = ((lo >> shift) & 0x00ff00ffu) | (((hi >> shift) & 0x00ff00ffu) << 8);
+            memcpy(d, &out, 4);
+        }
+    }
+}
+
+/* Did any full-size tile behind tile (tx, ty) of a view at this scale change? */
+static int view_tile_changed(const struct tilemap* tm, int scale, int tx, int ty) {
+    for (int y = ty * scale; y < (ty + 1) * scale && y < tm->rows; y++) {
+        for (int x = tx * scale; x < (tx + 1) * scale && x < tm->cols; x++) {
+            if (tm->changed[y * tm->cols + x]) return 1;
+        }
+    }
+    return 0;
+}
+
+/*
+ * view_refresh() — bring a scaled view up to date with the shadow after a scan
+ *
+ * Only tiles whose full-size tiles changed are filtered again, unless all is set, and
+ * only those that came out different count as changed: a view rebuilt after a while
+ * unused keeps the versions, and so the cached tiles, of everything that is the same.
+ * Fills the view's changed/version like a scan of its own.
+ */
+static void view_refresh(struct server* srv, int scale, int all) {
+    const struct tilemap* tm = &srv->tm;
+    struct tilemap* v = server_view(srv, scale);
+    const size_t pitch = (size_t)v->width * 4;
+    v->seq++;
+    for (int ty = 0; ty < v->rows; ty++) {
+        for (int tx = 0; tx < v->cols; tx++) {
+            int t = ty * v->cols + tx;
+            v->changed[t] = 0;
+            if (!all && !view_tile_changed(tm, scale, tx, ty)) continue;
+
+            /* Filtered into the band's place in stage, then compared with the view */
+            struct rect r = tile_rect(v, tx, ty);
+            uint8_t* fresh = v->stage + (size_t)r.x * 4;
+            uint8_t* dst = v->shadow + (size_t)r.y * pitch + (size_t)r.x * 4;
+            view_downsample(fresh, pitch, tm, scale, &r);
+            int y = 0;
+            while (y < r.h && !diff_seg(fresh + (size_t)y * pitch, dst + (size_t)y * pitch, (size_t)r.w * 4)) y++;
+            if (y == r.h) continue;
+            for (; y < r.h; y++) memcpy(dst + (size_t)y * pitch, fresh + (size_t)y * pitch, (size_t)r.w * 4);
+            v->changed[t] = 1;
+            v->version[t] = v->seq;
+        }
+    }
+}
+
+/*
+ * view_open() — the view at a scale, ready for a viewer to be served from
+ *
+ * A scaled view is allocated the first time it is used, and rebuilt if no scan kept it
+ * in step since it was last used. Returns NULL if it can't be allocated.
+ */
+static struct tilemap* view_open(struct server* srv, int scale) {
+    struct tilemap* v = server_view(srv, scale);
+    if (scale == 1) return v;
+    int k = scale == 2 ? 0 : 1;
+    if (!v->shadow && tilemap_init(v, srv->tm.width / scale, srv->tm.height / scale, 0)) {
+        free(v->shadow);
+        free(v->changed);
+        free(v->version);
+        free(v->stage);
+        memset(v, 0, sizeof(*v)); /* tried again next time */
+        return NULL;
+    }
+    if (!srv->scaled_live[k]) {
+        view_refresh(srv, scale, 1);
+        srv->scaled_live[k] = 1;
+    }
+    return v;
+}
+
+/*
+ * Shared-memory snapshots (--shm)
+ * -------------------------------
+ * A consumer on the same device (a recorder, a local streamer, a test harness) has no use
+ * for RFB: encoding, a socket write and a copy into its own buffer per frame. With --shm
+ * PATH (a file under /dev/shm, typically) the server publishes every changed frame into a
+ * ring the consumer maps read-only and reads in place:
+ *
+ *   struct shm_header                  SHM_HEADER_SIZE bytes, layout below
+ *   SHM_SLOTS slots, slot_size apart:
+ *     struct shm_slot                  seqlock, frame number, capture time
+ *     uint8_t  changed[ntiles]         tiles changed since the previously published frame
+ *     uint32_t tile_frame[ntiles]      frame number at which each tile last changed
+ *     pixels                           height lines of pitch bytes, header pixfmt
+ *
+ * Tiles are tile_size square, row-major, cols x rows of them. Each frame goes into the
+ * slot after `latest` before `latest` moves to it, so a consumer reading the newest frame
+ * has SHM_SLOTS - 1 frame periods before that slot is rewritten, and only the tiles that
+ * differ from what a slot already holds are copied into it. Each slot is a seqlock:
+ * its seq is odd while the server writes it. To read one, load latest, then the slot's
+ * seq (acquire); if it is odd, start over; read what you need; issue an acquire fence and
+ * load seq again; if it moved, the slot was rewritten under you: start over. A consumer
+ * keeping the frame number it last processed takes the tiles whose tile_frame is newer.
+ *
+ * Every scan that finds changes is published, but the framebuffer is only scanned for the
+ * ring's sake while a consumer is there: consumers store CLOCK_MONOTONIC milliseconds
+ * (truncated to 32 bits) into reader_ms at least once a second, and SHM_READER_MS after
+ * the last one the server goes back to scanning for viewers' requests only.
+ */
+#define SHM_MAGIC        "FB0RSHM1"
+#define SHM_SLOTS        3
+#define SHM_HEADER_SIZE  4096
+#define SHM_READER_MS    2000
+#define SHM_POLL_MS      500        /* how soon a new consumer is noticed while idle */
+
+struct shm_header {
+    char magic[8];               /* SHM_MAGIC, not NUL terminated */
+    uint32_t header_size;        /* offset of slot 0 */
+    uint32_t slots;
+    uint32_t slot_size;
+    uint32_t width, height;
+    uint32_t pitch;              /* bytes per pixel line */
+    uint32_t tile_size;
+    uint32_t cols, rows;
+    uint32_t changed_off;        /* offsets within a slot */
+    uint32_t tile_frame_off;
+    uint32_t pixels_off;         /* page aligned */
+    uint8_t pixfmt[16];          /* RFB PixelFormat, as in ServerInit */
+    _Atomic uint32_t latest;     /* slot with the newest frame */
+    _Atomic uint32_t reader_ms;  /* consumers' heartbeat (see above) */
+};
+_Static_assert(offsetof(struct shm_header, reader_ms) == 76, "shm header layout is published");
+
+struct shm_slot {
+    _Atomic uint32_t seq;        /* odd while being written */
+    uint32_t frame;              /* newest tile_frame in the slot */
+    uint64_t time_us;            /* when it was published (CLOCK_MONOTONIC) */
+};
+
+struct shmring {
+    struct shm_header* hdr;
+    size_t size;
+    uint32_t* copied[SHM_SLOTS]; /* per slot: tm->version of each tile it holds */
+    uint32_t frame;              /* frame number of the newest published frame */
+};
+
+/* shmring_slot() — slot k of the ring */
+static uint8_t* shmring_slot(const struct shmring* r, uint32_t k) {
+    return (uint8_t*)r->hdr + r->hdr->header_size + (size_t)k * r->hdr->slot_size;
+}
+
+/*
+ * shmring_create() — create (or replace) the ring file at path for tm's geometry
+ *
+ * Every slot starts out black, which is what an untouched shadow holds (tile version 0),
+ * and slot 0 is published as frame 0 until the first scan. Returns NULL on failure.
+ */
+static struct shmring* shmring_create(const char* path, const struct tilemap* tm, const struct pixfmt* pf) {
+    size_t ntiles = (size_t)tm->ntiles;
+    size_t changed_off = sizeof(struct shm_slot);
+    size_t tile_frame_off = (changed_off + ntiles + 63) & ~(size_t)63;
+    size_t pixels_off = page_round(tile_frame_off + ntiles * 4);
+    size_t slot_size = page_round(pixels_off + (size_t)tm->width * 4 * (size_t)tm->height);
+    size_t size = SHM_HEADER_SIZE + SHM_SLOTS * slot_size;
+    if (slot_size > UINT32_MAX) return NULL;
+
+    struct shmring* r = (struct shmring*)calloc(1, sizeof(*r));
+    if (!r) return NULL;
+    int fd = open(path, O_RDWR | O_CREAT | O_TRUNC | O_CLOEXEC, 0644);
+    void* p = MAP_FAILED;
+    if (fd >= 0 && !ftruncate(fd, (off_t)size)) p = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, fd, 0);
+    if (fd >= 0) close(fd);
+    for (int k = 0; k < SHM_SLOTS && p != MAP_FAILED; k++) {
+        if (!(r->copied[k] = (uint32_t*)calloc(ntiles, sizeof(uint32_t)))) {
+            munmap(p, size);
+            p = MAP_FAILED;
+        }
+    }
+    if (p == MAP_FAILED) {
+        for (int k = 0; k < SHM_SLOTS; k++) free(r->copied[k]);
+        free(r);
+        return NULL;
+    }
+
+    struct shm_header* h = (struct shm_header*)p;
+    h->header_size = SHM_HEADER_SIZE;
+    h->slots = SHM_SLOTS;
+    h->slot_size = (uint32_t)slot_size;
+    h->width = (uint32_t)tm->width;
+    h->height = (uint32_t)tm->height;
+    h->pitch = (uint32_t)tm->width * 4;
+    h->tile_size = TILE_SIZE;
+    h->cols = (uint32_t)tm->cols;
+    h->rows = (uint32_t)tm->rows;
+    h->changed_off = (uint32_t)changed_off;
+    h->tile_frame_off = (uint32_t)tile_frame_off;
+    h->pixels_off = (uint32_t)pixels_off;
+    pixfmt_write(h->pixfmt, pf);
+    memcpy(h->magic, SHM_MAGIC, 8); /* last: a consumer polling for the file sees it complete */
+    r->hdr = h;
+    r->size = size;
+    return r;
+}
+
+/* shmring_wanted() — has a consumer checked in lately? */
+static int shmring_wanted(const struct shmring* r, int64_t now) {
+    return r && (uint32_t)now - atomic_load_explicit(&r->hdr->reader_ms, memory_order_relaxed) < SHM_READER_MS;
+}
+
+/*
+ * shmring_publish() — make the snapshot in tm the ring's newest frame
+ *
+ * Only tiles the slot doesn't hold yet are copied (at most the changes of the last
+ * SHM_SLOTS frames), so an idle consumer costs nothing but its heartbeat check and a
+ * busy one one copy of what changed, whatever it reads.
+ */
+static void shmring_publish(struct shmring* r, const struct tilemap* tm) {
+    struct shm_header* h = r->hdr;
+    uint32_t latest = atomic_load_explicit(&h->latest, memory_order_relaxed);
+    uint32_t k = (latest + 1) % SHM_SLOTS;
+    uint8_t* base = shmring_slot(r, k);
+    struct shm_slot* sl = (struct shm_slot*)base;
+    uint8_t* changed = base + h->changed_off;
+    uint32_t* tile_frame = (uint32_t*)(base + h->tile_frame_off);
+    uint8_t* pixels = base + h->pixels_off;
+    uint32_t* copied = r->copied[k];
+    uint32_t seq = atomic_load_explicit(&sl->seq, memory_order_relaxed), frame = r->frame;
+
+    atomic_store_explicit(&sl->seq, seq + 1, memory_order_relaxed);
+    atomic_thread_fence(memory_order_release); /* odd seq before any of the writes below */
+    for (int t = 0; t < tm->ntiles; t++) {
+        uint32_t v = tm->version[t];
+        if (copied[t] != v) {
+            tile_copy(tm, t, pixels, tm->shadow);
+            copied[t] = v;
+        }
+        changed[t] = v > r->frame;
+        tile_frame[t] = v;
+        if (v > frame) frame = v;
+    }
+    sl->frame = frame;
+    sl->time_us = (uint64_t)now_us();
+    atomic_store_explicit(&sl->seq, seq + 2, memory_order_release);
+    atomic_store_explicit(&h->latest, k, memory_order_release);
+    r->frame = frame;
+    stats.shm_frames++;
+}
+
+/*
+ * server_scan() — refresh the snapshot once, for everybody, and fold the changes into
+ * every client's dirty tiles
+ *
+ * However many viewers are connected, the framebuffer is read once per tick; with the
+ * capture thread this only takes its newest frame. Moves are only looked for while some
+ * full-size viewer supports CopyRect; scaled views in use are refreshed from the result.
+ * The --shm ring gets the full-size frame as is. Returns 1 if anything changed, 0 if not.
+ */
+static int server_scan(struct server* srv) {
+    struct tilemap* tm = &srv->tm;
+    srv->last_scan = now_ms();
+    if (srv->cap ? !capture_take(srv) : !fb_capture(srv, tm, &stats)) return 0;
+    if (srv->shm) shmring_publish(srv->shm, tm);
+
+    int nmoves = 0;
+    if (srv->moves) {
+        for (int i = 0; i < srv->nclients && !nmoves; i++) {
+            const struct client* cl = srv->clients[i];
+            if (cl->copyrect && cl->scale == 1 && cl->state == CL_NORMAL) nmoves = moves_find(srv->moves, tm);
+        }
+        stats.moves += (uint64_t)nmoves;
+    }
+
+    for (int k = 0; k < 2; k++) {
+        int scale = 2 << k, used = 0;
+        for (int i = 0; i < srv->nclients && !used; i++) used = srv->clients[i]->scale == scale;
+        if (used) view_refresh(srv, scale, 0);
+        srv->scaled_live[k] = used;
+    }
+
+    for (int i = 0; i < srv->nclients; i++) {
+        struct client* cl = srv->clients[i];
+        const struct tilemap* v = server_view(srv, cl->scale);
+        uint8_t* dirty = cl->dirty;
+        int taken = nmoves && cl->copyrect && cl->scale == 1 ?
+                    client_take_moves(tm, cl, srv->moves->moves, nmoves) : 0;
+        for (int t = 0; t < v->ntiles; t++) dirty[t] |= v->changed[t];
+        for (int k = cl->ncopies - taken; k < cl->ncopies; k++) tiles_clear(tm, dirty, &cl->copies[k].dst);
+    }
+    if (srv->moves) movefind_sync(srv->moves, tm);
+    return 1;
+}
+
+/*
+ * Backpressure and adaptive frame rate
+ * ------------------------------------
+ * Sending into a socket that can't keep up only builds a backlog of stale frames, so an
+ * update is held back (and its dirty tiles keep accumulating) while the client's backlog
+ * is bigger than what its link drains in half a frame interval:
+ * - backlog = SIOCOUTQ (sent but not yet acknowledged) + our own output queue;
+ * - the drain rate is measured from the acknowledged byte count while the link is busy;
+ * - TCP_INFO supplies the RTT.
+ * Each client also has its own frame interval, between 1000 / --fps and 1 s: it grows to
+ * what the last update costs on the measured link (size / rate + RTT) and shrinks back
+ * by a quarter per frame whenever the previous frame has fully drained.
+ */
+#define BACKLOG_MIN     (16 * 1024)  /* always allowed in flight: a few tiles */
+#define INTERVAL_MAX_MS 1000         /* 1 fps floor */
+
+/* Unacknowledged + unsent bytes for this client (kernel send queue + our queue) */
+static size_t client_backlog(const struct client* cl) {
+    int outq = 0;
+    if (cl->record) return client_queued(cl); /* a file: written through */
+    stats.sys[SYS_IOCTL]++;
+    if (ioctl(cl->fd, SIOCOUTQ, &outq) < 0 || outq < 0) outq = 0;
+    return (size_t)outq + client_queued(cl);
+}
+
+/* client_measure() — update the drain rate and RTT estimates */
+static void client_measure(struct client* cl, int64_t now, size_t backlog) {
+    uint64_t acked = cl->tx_bytes - (backlog - client_queued(cl));
+    int busy = backlog > 0;
+    int64_t dt = now - cl->sample_at;
+
+    /* Only a link that stayed busy tells us its rate (an idle one just had less to send) */
+    if (busy && cl->busy_prev && dt >= 20 && acked >= cl->acked_prev) {
+        uint64_t sample = (acked - cl->acked_prev) * 1000 / (uint64_t)dt;
+        if (sample > UINT32_MAX) sample = UINT32_MAX;
+        cl->rate = cl->rate ? (uint32_t)(((uint64_t)cl->rate * 3 + sample) / 4) : (uint32_t)sample;
+    }
+    if (dt >= 20 || !cl->sample_at) {
+        cl->acked_prev = acked;
+        cl->sample_at = now;
+        cl->busy_prev = busy;
+    }
+
+    if (cl->local || cl->record) return; /* no RTT to speak of */
+    struct tcp_info ti;
+    socklen_t len = sizeof(ti);
+    stats.sys[SYS_SOCKOPT]++;
+    if (!getsockopt(cl->fd, IPPROTO_TCP, TCP_INFO, &ti, &len) && len >= sizeof(ti)) {
+        cl->rtt_ms = ti.tcpi_rtt / 1000;
+    }
+}
+
+/*
+ * client_due() — may this client be sent an update now?
+ *
+ * Returns 0 while its frame interval hasn't elapsed or its link is still busy with the
+ * previous updates (the request is held and its dirty tiles coalesce), 1 otherwise.
+ */
+static int client_due(const struct server* srv, struct client* cl, int64_t now) {
+    /* A quarter period of slack: ticks may fire a little early relative to the last send */
+    if (now - cl->last_frame + srv->period / 4 < cl->interval) return 0;
+
+    size_t backlog = client_backlog(cl);
+    client_measure(cl, now, backlog);
+
+    int interval = cl->interval;
+    if (!backlog) {
+        interval -= interval / 4; /* everything drained: speed back up */
+    } else if (cl->rate) {
+        int64_t cost = (int64_t)cl->last_size * 1000 / cl->rate + cl->rtt_ms;
+        if (cost > interval) interval = cost > INTERVAL_MAX_MS ? INTERVAL_MAX_MS : (int)cost;
+    }
+    if (interval < srv->period) interval = srv->period;
+    if (interval > INTERVAL_MAX_MS) interval = INTERVAL_MAX_MS;
+
+    if (1000 / interval != 1000 / cl->interval && now - cl->fps_logged >= 2000) {
+        fprintf(stderr, "fb0rfb: client fps %d (drain %u KB/s, rtt %u ms)\n",
+                1000 / interval, cl->rate / 1024, cl->rtt_ms);
+        cl->fps_logged = now;
+    }
+    cl->interval = interval;
+
+    size_t budget = (size_t)((uint64_t)cl->rate * (uint64_t)interval / 2000);
+    if (budget < BACKLOG_MIN) budget = BACKLOG_MIN;
+    if (backlog > budget) {
+        cl->skipped++;
+        stats.updates_held++;
+        return 0;
+    }
+    return 1;
+}
+
+/*
+ * client_answer() — answer a client's pending request from the current snapshot
+ *
+ * If none of its dirty tiles fall inside the requested area, and it has no moves queued
+ * and no screen layout or pointer owed, the request is held.
+ * Returns 0 on success (sent or held), -1 if the client must be dropped.
+ */
+static int client_answer(struct server* srv, struct client* cl) {
+    const struct tilemap* tm = server_view(srv, cl->scale);
+    struct rect area = request_area(&cl->req);
+    int nrects;
+
+    /* With the layout goes the whole view: the request may predate a new size */
+    if (cl->layout_due) area = (struct rect){ 0, 0, tm->width, tm->height };
+
+    if (rect_is_zero_copy(cl)) {
+        /* Zero-copy RAW: bigger rectangles mean fewer headers and iovec entries */
+        nrects = tiles_merge(tm, cl->dirty, &area, srv->rects);
+        if (!nrects && !cl->ncopies && !cl->layout_due && !client_pointer_rects(srv, cl)) return 0;
+        cl->req.pending = 0;
+        return send_update(srv, cl, srv->rects, NULL, nrects);
+    }
+
+    /* Everything else: per tile, so whole tiles come from the shared encode cache */
+    nrects = tiles_list(tm, cl->dirty, &area, srv->rects, srv->tiles);
+    if (!nrects && !cl->ncopies && !cl->layout_due && !client_pointer_rects(srv, cl)) return 0;
+    cl->req.pending = 0;
+    return send_update(srv, cl, srv->rects, srv->tiles, nrects);
+}
+
+/* A client can be sent an update: handshake done, request waiting, previous update gone */
+static int client_ready(const struct client* cl) {
+    return cl->fd >= 0 && cl->state == CL_NORMAL && request_waiting(&cl->req) && !client_queued(cl);
+}
+
+/*
+ * server_drop() — disconnect a client
+ *
+ * The socket is closed at once; the memory is only released by server_reap() after the
+ * current epoll batch, since later events in the batch may still point at it.
+ */
+static void server_drop(struct server* srv, struct client* cl) {
+    if (cl->fd < 0) return;
+    for (int i = 0; i < srv->nclients; i++) {
+        if (srv->clients[i] == cl) {
+            srv->clients[i] = srv->clients[--srv->nclients];
+            break;
+        }
+    }
+    close(cl->fd); /* also removes it from the epoll set */
+    cl->fd = -1;
+    group_put(cl->group);
+    cl->group = NULL;
+    cl->next_dead = srv->dead;
+    srv->dead = cl;
+
+    if (cl->record) {
+        fprintf(stderr, "fb0rfb: recording stopped: %s\n", strerror(errno ? errno : ENOSPC));
+        close(srv->rec_idx);
+        srv->recorder = NULL;
+        srv->nviewers--;
+    } else if (!cl->refused) {
+        srv->nviewers--;
+        if (cl->state == CL_NORMAL) {
+            fprintf(stderr, "fb0rfb: client disconnected (%d/%d)\n", srv->nviewers, srv->max_clients);
+        }
+    }
+}
+
+/* Free the clients dropped during the last event batch */
+static void server_reap(struct server* srv) {
+    while (srv->dead) {
+        struct client* cl = srv->dead;
+        srv->dead = cl->next_dead;
+        client_free(cl);
+        free(cl);
+    }
+}
+
+/*
+ * Frame clock
+ * -----------
+ * A periodic timerfd at the frame rate (slower on an idle screen, see "Idle backoff"),
+ * armed only while some client has a request waiting: with nobody waiting the process
+ * sleeps in epoll_wait() with no timeout at all.
+ */
+static void frame_clock_arm(struct server* srv, int64_t first_ms) {
+    struct itimerspec its;
+    if (first_ms < 1) first_ms = 1; /* a zero it_value would disarm the timer */
+    its.it_interval.tv_sec  = srv->pace.interval / 1000;
+    its.it_interval.tv_nsec = (long)(srv->pace.interval % 1000) * 1000000L;
+    its.it_value.tv_sec     = (time_t)(first_ms / 1000);
+    its.it_value.tv_nsec    = (long)(first_ms % 1000) * 1000000L;
+    stats.sys[SYS_TIMER]++;
+    timerfd_settime(srv->tfd, 0, &its, NULL);
+    srv->clock_armed = 1;
+}
+
+static void frame_clock_stop(struct server* srv) {
+    struct itimerspec its;
+    memset(&its, 0, sizeof(its));
+    stats.sys[SYS_TIMER]++;
+    timerfd_settime(srv->tfd, 0, &its, NULL);
+    srv->clock_armed = 0;
+}
+
+/*
+ * server_frame() — scan the framebuffer and answer every client that can take an update
+ *
+ * Clients whose previous update is still queued, or that are held back by client_due(),
+ * are skipped; if nobody can be answered (and no --shm consumer is there) the scan itself
+ * is skipped too. Clients with queued output are answered when their queue drains (see
+ * client_on_event()).
+ */
+static void server_frame(struct server* srv) {
+    int64_t now = now_ms();
+    int any = shmring_wanted(srv->shm, now);
+    if (srv->cap && !capture_current(srv->cap)) return; /* answered after its first pass */
+    for (int i = 0; i < srv->nclients; i++) {
+        struct client* cl = srv->clients[i];
+        cl->due = client_ready(cl) && client_due(srv, cl, now);
+        any |= cl->due;
+    }
+    if (!any) {
+        stats.ticks_idle++;
+        return;
+    }
+
+    int every = scan_pace_next(&srv->pace, server_scan(srv), now);
+    if (srv->clock_armed) frame_clock_arm(srv, every); /* keep one scan per interval */
+
+    for (int i = 0; i < srv->nclients; ) {
+        struct client* cl = srv->clients[i];
+        if (cl->due && cl->record) record_prepare(srv, cl, now);
+        if (cl->due && client_answer(srv, cl)) {
+            server_drop(srv, cl); /* moves the last client into slot i */
+            continue;
+        }
+        i++;
+    }
+}
+
+/*
+ * server_serve() — answer a client as soon as it can be answered
+ *
+ * Called when a request arrives or a client's output queue drains. If the snapshot is
+ * older than a frame period it is refreshed first (a frame for everybody); otherwise the
+ * client gets what is already known to be dirty, or waits for the next tick. With the
+ * capture thread the newest frame is always taken, unless the thread is only waking up.
+ */
+static void server_serve(struct server* srv, struct client* cl) {
+    if (!client_ready(cl) || !client_due(srv, cl, now_ms())) return;
+    if (srv->cap && !capture_current(srv->cap)) return; /* see server_frame() */
+    if (srv->cap || now_ms() - srv->last_scan >= srv->period) { /* taking a frame is cheap */
+        server_frame(srv);
+        return;
+    }
+    if (client_answer(srv, cl)) server_drop(srv, cl);
+}
+
+/*
+ * server_sync() — bring epoll interest and the frame clock in line with client state
+ *
+ * EPOLLOUT is only wanted while a client has queued output; the frame clock only runs
+ * while some client has a request waiting, or a --shm consumer is there.
+ */
+static void server_sync(struct server* srv) {
+    int waiting = shmring_wanted(srv->shm, now_ms());
+    for (int i = 0; i < srv->nclients; i++) {
+        struct client* cl = srv->clients[i];
+        uint32_t events = EPOLLIN | (client_queued(cl) ? EPOLLOUT : 0);
+        if (events != cl->events) {
+            struct epoll_event ev = { .events = events, .data.ptr = cl };
+            stats.sys[SYS_EPOLL]++;
+            epoll_ctl(srv->epfd, EPOLL_CTL_MOD, cl->fd, &ev);
+            cl->events = events;
+        }
+        if (cl->state == CL_NORMAL && request_waiting(&cl->req)) waiting = 1;
+    }
+
+    if (waiting && !srv->clock_armed) {
+        frame_clock_arm(srv, srv->last_scan + srv->pace.interval - now_ms());
+    } else if (!waiting && srv->clock_armed) {
+        frame_clock_stop(srv);
+    }
+    if (srv->cap) capture_set_active(srv->cap, waiting);
+}
+
+/* Handshake time limit: a connection that never completes it must not hold a slot */
+#define HANDSHAKE_TIMEOUT_MS 5000
+
+/*
+ * server_accept() — accept pending connections on a listening socket (TCP or --unix)
+ *
+ * The RFB handshake then runs from the event loop like any other client traffic (see
+ * client_handle()). Connections beyond --max-clients are answered with a reason and closed.
+ */
+static void server_accept(struct server* srv, int lfd) {
+    int local = lfd == srv->ufd;
+    struct transport tp = srv->tp;
+    if (local) tp.nodelay = 0;
+    for (;;) {
+        stats.sys[SYS_ACCEPT]++;
+        int c = accept4(lfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            return; /* EAGAIN: all accepted; ECONNABORTED etc.: the peer already gave up */
+        }
+        if (srv->nclients == MAX_CONNS) {
+            close(c);
+            continue;
+        }
+        transport_tune(c, &tp);
+
+        /*
+         * We only send frames the client asked for (FramebufferUpdateRequest, msgtype 3).
+         * A fresh client has none of the screen, so every tile starts out dirty for it.
+         */
+        struct client* cl = (struct client*)calloc(1, sizeof(*cl));
+        if (!cl || !(cl->dirty = (uint8_t*)malloc((size_t)srv->tm.ntiles))) {
+            free(cl);
+            close(c);
+            continue;
+        }
+        memset(cl->dirty, 1, (size_t)srv->tm.ntiles);
+        cl->fd = c;
+        cl->local = local;
+        cl->state = CL_VERSION;
+        cl->deadline = now_ms() + HANDSHAKE_TIMEOUT_MS;
+        cl->connected_us = now_us();
+        cl->encoding = ENC_RAW;
+        cl->interval = srv->period;
+        cl->scale = view_open(srv, srv->scale) ? srv->scale : 1;
+        pixconv_init(&cl->conv, &srv->pf, &srv->pf);
+
+        cl->events = EPOLLIN;
+        struct epoll_event ev = { .events = cl->events, .data.ptr = cl };
+        if (epoll_ctl(srv->epfd, EPOLL_CTL_ADD, c, &ev)) {
+            client_free(cl);
+            free(cl);
+            close(c);
+            continue;
+        }
+        srv->clients[srv->nclients++] = cl;
+
+        if (srv->nviewers >= srv->max_clients) {
+            cl->refused = 1;
+            fprintf(stderr, "fb0rfb: refusing client (limit %d reached)\n", srv->max_clients);
+        } else {
+            srv->nviewers++;
+            client_attach_mem(srv, cl);
+        }
+
+        /* 1) Send protocol version (handshake steps 2-7: client_handle()) */
+        if (client_send(cl, "RFB 003.008\n", 12)) server_drop(srv, cl);
+    }
+}
+
+/* Drop clients whose handshake (or refusal) didn't finish in time */
+static void server_expire(struct server* srv) {
+    int64_t now = now_ms();
+    for (int i = 0; i < srv->nclients; ) {
+        struct client* cl = srv->clients[i];
+        if (cl->deadline && now >= cl->deadline) {
+            server_drop(srv, cl);
+            continue;
+        }
+        i++;
+    }
+}
+
+/*
+ * epoll_wait() timeout: until the next handshake deadline, or forever (-1). With --shm and
+ * the clock stopped, at most SHM_POLL_MS: a consumer turning up says so in memory only.
+ */
+static int server_timeout(const struct server* srv) {
+    int64_t next = srv->stats_every ? srv->stats_next : 0;
+    if (srv->shm && !srv->clock_armed) {
+        int64_t poll_at = now_ms() + SHM_POLL_MS;
+        if (!next || poll_at < next) next = poll_at;
+    }
+    for (int i = 0; i < srv->nclients; i++) {
+        int64_t d = srv->clients[i]->deadline;
+        if (d && (!next || d < next)) next = d;
+    }
+    if (!next) return -1;
+    int64_t wait = next - now_ms();
+    return wait < 0 ? 0 : (int)wait;
+}
+
+/* Process CPU time (user + system) in microseconds */
+static int64_t cpu_us(void) {
+    struct rusage ru;
+    getrusage(RUSAGE_SELF, &ru);
+    return (int64_t)(ru.ru_utime.tv_sec + ru.ru_stime.tv_sec) * 1000000 +
+           ru.ru_utime.tv_usec + ru.ru_stime.tv_usec;
+}
+
+static uint64_t sys_total(const struct stats* st) {
+    uint64_t n = 0;
+    for (int i = 0; i < SYS_KINDS; i++) n += st->sys[i];
+    return n;
+}
+
+/*
+ * stats_log() — one-line stderr summary of the last --stats-log period
+ *
+ * Times are reported as the p50/p99 log2 bucket bounds, syscalls per update sent.
+ */
+static void stats_log(struct server* srv, int64_t now) {
+    const struct stats* c = &stats;
+    capture_counts(srv);
+    stats.heap_allocs = atomic_load(&heap_allocs);
+    const struct stats* p = &srv->stats_prev;
+    int64_t cpu = cpu_us();
+    int64_t span = now - srv->stats_since;
+    uint64_t updates = c->updates - p->updates;
+    uint64_t bytes[ST_ENCODINGS];
+    for (int i = 0; i < ST_ENCODINGS; i++) bytes[i] = c->bytes[i] - p->bytes[i];
+
+    fprintf(stderr,
+            "fb0rfb: stats %llds: cpu %.1f%%, scans %llu (%llu changed, %llu idle, %llu gated, every %d ms), "
+            "updates %llu (%llu held), KB RAW %llu Hextile %llu ZRLE %llu Tight %llu, cached tiles %llu, "
+            "shm frames %llu, recorded %llu KB, "
+            "moves %llu (%llu CopyRects), "
+            "capture p50 %llu p99 %llu us, encode p50 %llu p99 %llu us, send p50 %llu p99 %llu us, "
+            "syscalls %.1f/update, heap allocs %llu\n",
+            (long long)(span / 1000), span > 0 ? (double)(cpu - srv->cpu_prev) * 100.0 / ((double)span * 1000.0) : 0.0,
+            (unsigned long long)(c->scans - p->scans),
+            (unsigned long long)(c->scans_changed - p->scans_changed),
+            (unsigned long long)(c->ticks_idle - p->ticks_idle),
+            (unsigned long long)(c->ticks_gated - p->ticks_gated), srv->pace.interval,
+            (unsigned long long)updates,
+            (unsigned long long)(c->updates_held - p->updates_held),
+            (unsigned long long)(bytes[ST_RAW] / 1024),
+            (unsigned long long)(bytes[ST_HEXTILE] / 1024),
+            (unsigned long long)(bytes[ST_ZRLE] / 1024),
+            (unsigned long long)(bytes[ST_TIGHT] / 1024),
+            (unsigned long long)(c->tiles_cached - p->tiles_cached),
+            (unsigned long long)(c->shm_frames - p->shm_frames),
+            (unsigned long long)((c->record_bytes - p->record_bytes) / 1024),
+            (unsigned long long)(c->moves - p->moves),
+            (unsigned long long)(c->copyrects - p->copyrects),
+            (unsigned long long)hist_quantile(&c->capture, &p->capture, 0.5),
+            (unsigned long long)hist_quantile(&c->capture, &p->capture, 0.99),
+            (unsigned long long)hist_quantile(&c->encode, &p->encode, 0.5),
+            (unsigned long long)hist_quantile(&c->encode, &p->encode, 0.99),
+            (unsigned long long)hist_quantile(&c->send, &p->send, 0.5),
+            (unsigned long long)hist_quantile(&c->send, &p->send, 0.99),
+            updates ? (double)(sys_total(c) - sys_total(p)) / (double)updates : 0.0,
+            (unsigned long long)(c->heap_allocs - p->heap_allocs));
+
+    srv->stats_prev = stats;
+    srv->stats_since = now;
+    srv->cpu_prev = cpu;
+    srv->stats_next = now + srv->stats_every;
+}
+
+/* Append one histogram in Prometheus text form: cumulative buckets, _sum and _count */
+static int stats_put_hist(char* out, size_t cap, const char* name, const struct hist* h) {
+    int n = 0;
+    uint64_t cum = 0;
+    for (int b = 0; b < HIST_BUCKETS - 1; b++) {
+        cum += h->bucket[b];
+        n += snprintf(out + n, cap - (size_t)n, "fb0rfb_%s_us_bucket{le=\"%llu\"} %llu\n",
+                      name, (unsigned long long)1 << b, (unsigned long long)cum);
+        if ((size_t)n >= cap) return (int)cap;
+    }
+    n += snprintf(out + n, cap - (size_t)n,
+                  "fb0rfb_%s_us_bucket{le=\"+Inf\"} %llu\nfb0rfb_%s_us_sum %llu\nfb0rfb_%s_us_count %llu\n",
+                  name, (unsigned long long)h->count, name, (unsigned long long)h->sum_us,
+                  name, (unsigned long long)h->count);
+    return (size_t)n >= cap ? (int)cap : n;
+}
+
+/*
+ * stats_format() — every counter, in the Prometheus text exposition format
+ *
+ * Counters are cumulative since startup; a scraper computes rates from two reads.
+ */
+static size_t stats_format(struct server* srv, char* out, size_t cap) {
+    static const char* const enc_names[ST_ENCODINGS] = { "RAW", "Hextile", "ZRLE", "Tight" };
+    const struct stats* c = &stats;
+    capture_counts(srv);
+    stats.heap_allocs = atomic_load(&heap_allocs);
+    int n = snprintf(out, cap,
+                     "fb0rfb_cpu_us_total %lld\n"
+                     "fb0rfb_clients %d\n"
+                     "fb0rfb_scans_total %llu\n"
+                     "fb0rfb_scans_changed_total %llu\n"
+                     "fb0rfb_scan_interval_ms %d\n"
+                     "fb0rfb_ticks_idle_total %llu\n"
+                     "fb0rfb_ticks_gated_total %llu\n"
+                     "fb0rfb_updates_total %llu\n"
+                     "fb0rfb_updates_held_total %llu\n"
+                     "fb0rfb_heap_allocs_total %llu\n"
+                     "fb0rfb_moves_total %llu\n"
+                     "fb0rfb_copyrect_total %llu\n"
+                     "fb0rfb_tiles_cached_total %llu\n"
+                     "fb0rfb_shm_frames_total %llu\n"
+                     "fb0rfb_record_bytes_total %llu\n",
+                     (long long)cpu_us(), srv->nviewers,
+                     (unsigned long long)c->scans, (unsigned long long)c->scans_changed, srv->pace.interval,
+                     (unsigned long long)c->ticks_idle, (unsigned long long)c->ticks_gated,
+                     (unsigned long long)c->updates, (unsigned long long)c->updates_held,
+                     (unsigned long long)c->heap_allocs,
+                     (unsigned long long)c->moves, (unsigned long long)c->copyrects,
+                     (unsigned long long)c->tiles_cached, (unsigned long long)c->shm_frames,
+                     (unsigned long long)c->record_bytes);
+    for (int i = 0; i < ST_ENCODINGS && (size_t)n < cap; i++) {
+        n += snprintf(out + n, cap - (size_t)n,
+                      "fb0rfb_rects_total{encoding=\"%s\"} %llu\nfb0rfb_bytes_total{encoding=\"%s\"} %llu\n",
+                      enc_names[i], (unsigned long long)c->rects[i],
+                      enc_names[i], (unsigned long long)c->bytes[i]);
+    }
+    for (int i = 0; i < SYS_KINDS && (size_t)n < cap; i++) {
+        n += snprintf(out + n, cap - (size_t)n, "fb0rfb_syscalls_total{call=\"%s\"} %llu\n",
+                      sys_names[i], (unsigned long long)c->sys[i]);
+    }
+    if ((size_t)n < cap) n += stats_put_hist(out + n, cap - (size_t)n, "capture", &c->capture);
+    if ((size_t)n < cap) n += stats_put_hist(out + n, cap - (size_t)n, "encode", &c->encode);
+    if ((size_t)n < cap) n += stats_put_hist(out + n, cap - (size_t)n, "send", &c->send);
+    if ((size_t)n < cap) n += stats_put_hist(out + n, cap - (size_t)n, "first_frame", &c->first_frame);
+    return (size_t)n < cap ? (size_t)n : cap - 1;
+}
+
+/*
+ * stats_accept() — answer --stats connections: the counters, then close
+ *
+ * The dump is a few KB, well below any socket buffer, so one non-blocking write is all a
+ * scraper gets (e.g. nc host port, or a textfile collector). Nothing is read back.
+ */
+static void stats_accept(struct server* srv) {
+    static char text[16384];
+    for (;;) {
+        int c = accept4(srv->sfd, NULL, NULL, SOCK_NONBLOCK | SOCK_CLOEXEC);
+        if (c < 0) {
+            if (errno == EINTR) continue;
+            return;
+        }
+        size_t len = stats_format(srv, text, sizeof(text));
+        if (write(c, text, len) < 0) { /* the scraper went away: nothing to do */ }
+        close(c);
+    }
+}
+
+/* unix_bind() — a non-blocking Unix stream socket bound to path (replacing a stale one) */
+static int unix_bind(const char* path) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    if (strlen(path) >= sizeof(sun.sun_path)) return -1;
+    strcpy(sun.sun_path, path);
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    unlink(path); /* a stale socket from a previous run */
+    if (bind(fd, (struct sockaddr*)&sun, sizeof(sun)) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * stats_listen() — open the --stats endpoint: a TCP port number, or a Unix socket path
+ */
+static int stats_listen(const char* where) {
+    int fd;
+    if (where[0] == '/') {
+        if ((fd = unix_bind(where)) < 0) return -1;
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((uint16_t)atoi(where));
+        fd = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (fd < 0) return -1;
+        int one = 1;
+        setsockopt(fd, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        if (bind(fd, (struct sockaddr*)&addr, sizeof(addr)) < 0) {
+            close(fd);
+            return -1;
+        }
+    }
+    if (listen(fd, 4) < 0) {
+        close(fd);
+        return -1;
+    }
+    return fd;
+}
+
+/*
+ * server_init_build() — build the ServerInit message of every view once, at startup
+ *
+ * Nothing in it changes while the server runs, so a connection is sent a finished message:
+ * - width (u16)
+ * - height (u16)
+ * - PixelFormat (16 bytes)
+ * - name length (u32)
+ * - name string
+ * PixelFormat is exactly 16 bytes per RFB spec (see pixfmt_write()). We advertise the
+ * framebuffer's own layout (srv->pf), typically:
+ * - 32 bits per pixel (4 bytes)
+ * - 24-bit "depth" (meaning only 24 meaningful color bits)
+ * - little-endian (big_endian_flag=0)
+ * - true color (true_color_flag=1)
+ * - 8-bit per channel (max=255)
+ * - shifts: R=16, G=8, B=0 (common XRGB/ARGB little-endian)
+ */
+static void server_init_build(struct server* srv) {
+    for (int k = 0; k < 3; k++) {
+        uint8_t* msg = srv->server_init[k];
+        int scale = 1 << k; /* the size view_open() gives that view */
+        put16(msg + 0, (uint16_t)(srv->tm.width / scale));
+        put16(msg + 2, (uint16_t)(srv->tm.height / scale));
+        pixfmt_write(msg + 4, &srv->pf);
+        put32(msg + 20, (uint32_t)(sizeof(SERVER_NAME) - 1));
+        memcpy(msg + 24, SERVER_NAME, sizeof(SERVER_NAME) - 1);
+    }
+}
+
+/* client_send_server_init() — send the prebuilt ServerInit of the client's view, as one write */
+static int client_send_server_init(struct server* srv, struct client* cl) {
+    int k = cl->scale == 4 ? 2 : cl->scale == 2 ? 1 : 0; /* --scale */
+    return client_send(cl, srv->server_init[k], sizeof(srv->server_init[k]));
+}
+
+/*
+ * Fence and continuous updates
+ * ----------------------------
+ * Two extensions from TigerVNC for links where a round trip per frame is too slow:
+ * - ContinuousUpdates (-313): the viewer enables a standing request for a region, and
+ *   updates flow as the screen changes. The pace is set by backpressure (client_due()),
+ *   so a slow link gets fewer, fresher frames rather than a backlog. Disabling it is
+ *   confirmed with EndOfContinuousUpdates (150), which also announces support.
+ * - Fence (-312): a marker in the stream. A fence with the Request flag is sent back with
+ *   its payload once everything before it is done. Messages are handled in order and
+ *   output leaves in order, so BlockBefore and BlockAfter hold by construction; for
+ *   SyncNext the reply waits until the next message has been handled. A fence of our
+ *   own, with no flags, announces support.
+ * Neither may be used before the server has sent its announcement.
+ */
+
+/* client_fence() — send a Fence message */
+static int client_fence(struct client* cl, uint32_t flags, const uint8_t* payload, size_t len) {
+    uint8_t msg[9 + FENCE_PAYLOAD_MAX];
+    msg[0] = 248;
+    msg[1] = msg[2] = msg[3] = 0;
+    put32(msg + 4, flags);
+    msg[8] = (uint8_t)len;
+    if (len) memcpy(msg + 9, payload, len);
+    return client_send(cl, msg, 9 + len);
+}
+
+static int client_lists(const struct client* cl, int32_t enc) {
+    for (int i = 0; i < cl->nencodings; i++) {
+        if (cl->encodings[i] == enc) return 1;
+    }
+    return 0;
+}
+
+static int client_end_continuous(struct client* cl) {
+    static const uint8_t msg = 150; /* EndOfContinuousUpdates */
+    return client_send(cl, &msg, 1);
+}
+
+/*
+ * client_announce() — tell the client which of the extensions in its SetEncodings we have
+ *
+ * ExtendedDesktopSize is announced by the screen layout leading the next update, Cursor
+ * by the cursor shape. Cursor and PointerPos follow the list each time it is sent.
+ */
+static int client_announce(struct client* cl) {
+    if (!cl->fence && client_lists(cl, ENC_FENCE)) {
+        cl->fence = 1;
+        if (client_fence(cl, FENCE_REQUEST, NULL, 0)) return -1;
+    }
+    if (!cl->continuous && client_lists(cl, ENC_CONTINUOUS)) {
+        cl->continuous = 1;
+        if (client_end_continuous(cl)) return -1;
+    }
+    if (!cl->ext_desktop && client_lists(cl, ENC_EXT_DESKTOP_SIZE)) {
+        cl->ext_desktop = 1;
+        cl->layout_due = 1; /* reason 0 (server), status 0: the layout as it is */
+        cl->layout_reason = 0;
+        cl->layout_status = 0;
+    }
+    int cursor = client_lists(cl, ENC_CURSOR);
+    if (cursor != cl->cursor) cl->cursor_due = cursor;
+    cl->cursor = cursor;
+    cl->pointer_pos = client_lists(cl, ENC_POINTER_POS);
+    return 0;
+}
+
+/* client_sync_fence() — send the reply held for a SyncNext fence, if any */
+static int client_sync_fence(struct client* cl) {
+    if (!cl->sync_len) return 0;
+    size_t len = cl->sync_len;
+    cl->sync_len = 0;
+    return client_send(cl, cl->sync_fence, len);
+}
+
+/*
+ * Desktop size
+ * ------------
+ * A viewer that lists ExtendedDesktopSize (-308) is sent the screen layout, one screen
+ * the size of its view, and may then pick a view of its own with SetDesktopSize: it gets
+ * the largest of full, half and quarter size (see "Scaled views") that fits the size it
+ * asked for; the screens it describes are ignored. The answer, a layout with reason 1
+ * and a status, leads its next update, followed by the whole screen at the new size.
+ * Other viewers keep their views.
+ */
+#define LAYOUT_OK             0
+#define LAYOUT_NO_RESOURCES   2
+#define LAYOUT_INVALID        3
+
+/*
+ * client_set_scale() — switch a client to the view at a scale
+ *
+ * Its queued moves, dirty tiles and requested regions are in the old view's coordinates,
+ * so they are replaced by the whole new view. Returns 0 on success, -1 if the view or its
+ * cache group can't be set up (the client keeps its old view).
+ */
+static int client_set_scale(struct server* srv, struct client* cl, int scale) {
+    const struct tilemap* v = view_open(srv, scale);
+    if (!v) return -1;
+    if (scale == cl->scale) return 0;
+
+    int prev = cl->scale;
+    cl->scale = scale;
+    if (client_attach_group(srv, cl)) {
+        cl->scale = prev;
+        return -1;
+    }
+    struct rect screen = { 0, 0, v->width, v->height };
+    cl->ncopies = 0;
+    memset(cl->dirty, 1, (size_t)v->ntiles);
+    cl->req.area = screen;
+    cl->req.cont = screen;
+    fprintf(stderr, "fb0rfb: client view %dx%d (1/%d)\n", v->width, v->height, scale);
+    return 0;
+}
+
+/*
+ * client_msg_len() — size of the complete message starting at p
+ *
+ * Returns 0 if more bytes are needed to tell, (size_t)-1 for an unknown message type.
+ */
+static size_t client_msg_len(const struct client* cl, const uint8_t* p, size_t avail) {
+    switch (cl->state) {
+    case CL_VERSION:  return 12;
+    case CL_SECURITY: return 1;
+    case CL_INIT:     return 1;
+    case CL_NORMAL:   break;
+    }
+
+    if (avail < 1) return 0;
+    switch (p[0]) {
+    case 0: return 20;                  /* SetPixelFormat */
+    case 2:                             /* SetEncodings: size depends on the count */
+        if (avail < 4) return 0;
+        return 4 + 4 * (size_t)((p[2] << 8) | p[3]);
+    case 3: return 10;                  /* FramebufferUpdateRequest */
+    case 4: return 8;                   /* KeyEvent */
+    case 5: return 6;                   /* PointerEvent */
+    case 6: return 8;                   /* ClientCutText header; the text is skipped */
+    case 150: return 10;                /* EnableContinuousUpdates */
+    case 251:                           /* SetDesktopSize: size depends on the screen count */
+        if (avail < 8) return 0;
+        return 8 + 16 * (size_t)p[6];
+    case 248:                           /* Fence: size depends on the payload length */
+        if (avail < 9) return 0;
+        return p[8] > FENCE_PAYLOAD_MAX ? (size_t)-1 : 9 + (size_t)p[8];
+    default: return (size_t)-1;
+    }
+}
+
+/*
+ * client_handle() — act on one complete message from a client
+ *
+ * Handshake (RFB 3.8, simplified), one message per state:
+ * 1) Server -> Client: "RFB 003.008\n"  (sent on accept)
+ * 2) Client -> Server: same format version
+ * 3) Server -> Client: Security types (we offer "None" only)
+ * 4) Client -> Server: chosen security type
+ * 5) Server -> Client: SecurityResult (0 = OK)
+ * 6) Client -> Server: ClientInit (shared flag)
+ * 7) Server -> Client: ServerInit (w,h,pixfmt,name)
+ *
+ * Client-to-server message types after that (subset):
+ * 0: SetPixelFormat (applied to everything we send from then on)
+ * 2: SetEncodings   (stored; picks the encoding we send)
+ * 3: FramebufferUpdateRequest (queued; answered when there is something to send)
+ * 4: KeyEvent       (ignored)
+ * 5: PointerEvent   (not injected; shown to other viewers, see "Pointer")
+ * 6: ClientCutText  (ignored)
+ * 150: EnableContinuousUpdates (answered without requests until disabled)
+ * 251: SetDesktopSize (picks the client's view, see client_set_scale())
+ * 248: Fence        (echoed back, see client_fence())
+ *
+ * Returns 0 on success, -1 if the client must be disconnected.
+ */
+static int client_handle(struct server* srv, struct client* cl, const uint8_t* p) {
+    switch (cl->state) {
+    case CL_VERSION: {
+        /* 2) Client protocol version (not validated beyond length) */
+        if (cl->refused) {
+            /*
+             * RFB 3.8 lets the server answer with zero security types followed by a
+             * reason string (u32 length + text), which viewers show to the user.
+             */
+            static const char reason[] = "Too many viewers connected";
+            uint8_t msg[5 + sizeof(reason) - 1];
+            msg[0] = 0; /* number-of-security-types */
+            put32(msg + 1, (uint32_t)(sizeof(reason) - 1));
+            memcpy(msg + 5, reason, sizeof(reason) - 1);
+            cl->closing = 1;
+            return client_send(cl, msg, sizeof(msg));
+        }
+
+        /*
+         * 3) Security handshake: "None" only
+         *
+         * For RFB 3.8, server sends:
+         *   [number-of-types:1][type1:1]...[typen:1]
+         * type 1 == "None"
+         */
+        static const uint8_t sec_types[2] = { 1, 1 }; /* 1 type: None */
+        cl->state = CL_SECURITY;
+        return client_send(cl, sec_types, 2);
+    }
+
+    case CL_SECURITY: {
+        /* 4) Client chooses the security type */
+        if (p[0] != 1) return -1; /* client didn't accept "None" */
+
+        /* 5) SecurityResult: 4-byte status, 0 = OK */
+        static const uint8_t ok[4] = { 0, 0, 0, 0 };
+        cl->state = CL_INIT;
+        return client_send(cl, ok, 4);
+    }
+
+    case CL_INIT:
+        /*
+         * 6) ClientInit: shared-flag. Ignored: the session is always shared, a viewer
+         * asking for exclusive access does not get to kick the others off a view-only
+         * screen.
+         */
+        cl->state = CL_NORMAL;
+        cl->deadline = 0;
+        fprintf(stderr, "fb0rfb: client connected (%d/%d)\n", srv->nviewers, srv->max_clients);
+
+        /* 7) ServerInit, built at startup (see server_init_build()) */
+        if (client_send_server_init(srv, cl)) return -1;
+
+        /*
+         * The first FramebufferUpdateRequest is a round trip away, usually in one segment
+         * with SetPixelFormat and SetEncodings. A stale snapshot is refreshed now, while
+         * the viewer's answer is on its way, so the request is answered right from the
+         * snapshot, on a reconnect mostly from cached tiles (see group_put()). The capture
+         * thread's newest frame is taken when the request comes in anyway.
+         */
+        if (!srv->cap && now_ms() - srv->last_scan >= srv->period) {
+            scan_pace_next(&srv->pace, server_scan(srv), now_ms());
+        }
+        return 0;
+
+    case CL_NORMAL:
+        break;
+    }
+
+    if (p[0] == 0) {
+        /*
+         * SetPixelFormat: 3 padding + 16-byte PixelFormat
+         *
+         * Color-map formats would need SetColourMapEntries; viewers only ask
+         * for them on request, so refuse instead of sending garbage.
+         */
+        struct pixfmt cpf;
+        pixfmt_parse(&cpf, p + 4);
+        if (pixconv_init(&cl->conv, &srv->pf, &cpf)) {
+            fprintf(stderr, "fb0rfb: unsupported client pixel format (%dbpp, true-color=%d)\n",
+                    cpf.bpp, cpf.true_color);
+            return -1;
+        }
+        fprintf(stderr, "fb0rfb: client pixel format %dbpp (%s)\n", cpf.bpp, cl->conv.name);
+        cl->cursor_due = cl->cursor; /* the shape is in client pixels */
+        return client_attach_group(srv, cl);
+    }
+
+    if (p[0] == 2) {
+        /*
+         * SetEncodings:
+         *   padding(1) + number-of-encodings(2) + encodings(4*count)
+         *
+         * The list (in the client's preference order) is kept per client; entries
+         * beyond MAX_ENCODINGS are dropped.
+         */
+        int count = (p[2] << 8) | p[3];
+        cl->nencodings = 0;
+        for (int i = 0; i < count && i < MAX_ENCODINGS; i++) {
+            const uint8_t* e = p + 4 + 4 * i;
+            cl->encodings[cl->nencodings++] =
+                (int32_t)(((uint32_t)e[0] << 24) | ((uint32_t)e[1] << 16) | ((uint32_t)e[2] << 8) | e[3]);
+        }
+
+        int32_t prev = cl->encoding;
+        client_pick_encoding(cl, srv->jpeg_quality);
+        if (!cl->copyrect) client_drop_copies(&srv->tm, cl);
+        if (cl->encoding != prev) {
+            fprintf(stderr, "fb0rfb: client encoding %s\n", encoding_name(cl->encoding));
+        }
+        if (client_announce(cl)) return -1;
+        return client_attach_group(srv, cl);
+    }
+
+    if (p[0] == 3) {
+        /*
+         * FramebufferUpdateRequest:
+         *   incremental(1) + x(2) + y(2) + w(2) + h(2)
+         *
+         * The region is clipped to the screen and folded into the pending request.
+         */
+        int inc = p[1];
+        struct rect area = { (p[2] << 8) | p[3], (p[4] << 8) | p[5],
+                             (p[6] << 8) | p[7], (p[8] << 8) | p[9] };
+        const struct tilemap* v = server_view(srv, cl->scale);
+        struct rect screen = { 0, 0, v->width, v->height };
+        if (rect_clip(&area, &screen)) {
+            if (!cl->req.pending) {
+                cl->req.pending = 1;
+                memset(&cl->req.area, 0, sizeof(cl->req.area));
+            }
+            rect_union(&cl->req.area, &area);
+            if (!inc) {
+                client_drop_copies(&srv->tm, cl);
+                tiles_mark(v, cl->dirty, &area);
+            }
+        }
+        return 0;
+    }
+
+    if (p[0] == 6) {
+        /*
+         * ClientCutText:
+         *   pad(3) + length(4) + text(length)
+         *
+         * The text is discarded as it arrives (cl->skip), never buffered.
+         */
+        cl->skip = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+        return 0;
+    }
+
+    if (p[0] == 150) {
+        /*
+         * EnableContinuousUpdates:
+         *   enable(1) + x(2) + y(2) + w(2) + h(2)
+         *
+         * Enabling starts a standing request for the region (see update_request);
+         * disabling is confirmed with EndOfContinuousUpdates, after which only requests
+         * are answered again.
+         */
+        if (!cl->continuous) return -1; /* never announced */
+        const struct tilemap* v = server_view(srv, cl->scale);
+        struct rect area = { (p[2] << 8) | p[3], (p[4] << 8) | p[5],
+                             (p[6] << 8) | p[7], (p[8] << 8) | p[9] };
+        struct rect screen = { 0, 0, v->width, v->height };
+        if (p[1] && rect_clip(&area, &screen)) {
+            cl->req.continuous = 1;
+            cl->req.cont = area;
+            return 0;
+        }
+        cl->req.continuous = 0;
+        return client_end_continuous(cl);
+    }
+
+    if (p[0] == 251) {
+        /*
+         * SetDesktopSize:
+         *   pad(1) + width(2) + height(2) + number-of-screens(1) + pad(1) + screens(16 each)
+         */
+        if (!cl->ext_desktop) return -1; /* never announced */
+        int w = (p[2] << 8) | p[3], h = (p[4] << 8) | p[5];
+        int status = LAYOUT_INVALID; /* smaller than every view */
+        for (int scale = 1; scale <= (srv->can_scale ? 4 : 1); scale *= 2) {
+            if (srv->tm.width / scale <= w && srv->tm.height / scale <= h) {
+                status = client_set_scale(srv, cl, scale) ? LAYOUT_NO_RESOURCES : LAYOUT_OK;
+                break;
+            }
+        }
+        cl->layout_due = 1;
+        cl->layout_reason = 1;
+        cl->layout_status = (uint8_t)status;
+        return 0;
+    }
+
+    if (p[0] == 248) {
+        /*
+         * Fence:
+         *   pad(3) + flags(4) + length(1) + payload(length)
+         *
+         * Requests are sent back with the flags we understand; replies to our own
+         * announcement need nothing. A held SyncNext reply goes first, whatever this is.
+         */
+        uint32_t flags = ((uint32_t)p[4] << 24) | ((uint32_t)p[5] << 16) | ((uint32_t)p[6] << 8) | p[7];
+        if (!cl->fence) return -1; /* never announced */
+        if (client_sync_fence(cl)) return -1;
+        if (!(flags & FENCE_REQUEST)) return 0;
+        if (flags & FENCE_SYNC_NEXT) {
+            cl->sync_len = 9 + (size_t)p[8];
+            memcpy(cl->sync_fence, p, cl->sync_len);
+            put32(cl->sync_fence + 4, flags & FENCE_FLAGS);
+            return 0;
+        }
+        return client_fence(cl, flags & FENCE_FLAGS, p + 9, p[8]);
+    }
+
+    if (p[0] == 5) {
+        /*
+         * PointerEvent:
+         *   button-mask(1) + x(2) + y(2)
+         *
+         * Nothing is injected (view-only); the position is kept for the other viewers
+         * (see "Pointer"). Positions are in the client's view.
+         */
+        const struct tilemap* v = server_view(srv, cl->scale);
+        int x = (p[2] << 8) | p[3], y = (p[4] << 8) | p[5];
+        x = (x < v->width ? x : v->width - 1) * cl->scale;
+        y = (y < v->height ? y : v->height - 1) * cl->scale;
+        if (x == srv->pointer.x && y == srv->pointer.y && srv->pointer.seq) return 0;
+        srv->pointer.x = x;
+        srv->pointer.y = y;
+        if (!++srv->pointer.seq) srv->pointer.seq = 1; /* 0 stays "never moved" */
+        srv->pointer.moved = 1;
+        cl->pointer_seen = srv->pointer.seq;
+        return 0;
+    }
+
+    /* 4: KeyEvent — view-only, ignored */
+    return 0;
+}
+
+/*
+ * client_on_input() — read what the socket has and handle every complete message in it
+ *
+ * Partial messages stay in cl->in until the rest arrives. Returns -1 if the client must
+ * be disconnected (EOF, error, unknown message).
+ */
+static int client_on_input(struct server* srv, struct client* cl) {
+    if (buf_reserve(&cl->in, 4096)) return -1;
+    stats.sys[SYS_READ]++;
+    ssize_t n = read(cl->fd, cl->in.data + cl->in.len, cl->in.cap - cl->in.len);
+    if (n == 0) return -1; /* peer closed connection */
+    if (n < 0) return (errno == EAGAIN || errno == EWOULDBLOCK || errno == EINTR) ? 0 : -1;
+    cl->in.len += (size_t)n;
+
+    /*
+     * Until its first frame is out, a viewer's messages are ACKed right away: a viewer
+     * with Nagle on holds each small handshake message until the previous one is ACKed,
+     * which a delayed ACK would put off by up to 40 ms. The kernel leaves quick-ACK mode
+     * on its own, so it is asked again on every read.
+     */
+    if (cl->connected_us && !cl->local) {
+        int one = 1;
+        stats.sys[SYS_SOCKOPT]++;
+        setsockopt(cl->fd, IPPROTO_TCP, TCP_QUICKACK, &one, sizeof(one));
+    }
+
+    size_t off = 0;
+    while (off < cl->in.len && cl->fd >= 0 && !cl->closing) {
+        const uint8_t* p = cl->in.data + off;
+        size_t avail = cl->in.len - off;
+
+        if (cl->skip) {
+            size_t k = avail < cl->skip ? avail : cl->skip;
+            cl->skip -= (uint32_t)k;
+            off += k;
+            continue;
+        }
+
+        size_t need = client_msg_len(cl, p, avail);
+        if (need == (size_t)-1) return -1; /* unknown message type: can't resync */
+        if (!need || need > avail) break;
+        /* A held SyncNext reply follows this message (a fence sends it itself) */
+        int sync = cl->sync_len != 0 && p[0] != 248;
+        if (client_handle(srv, cl, p)) return -1;
+        if (sync && client_sync_fence(cl)) return -1;
+        off += need;
+    }
+
+    memmove(cl->in.data, cl->in.data + off, cl->in.len - off);
+    cl->in.len -= off;
+    return 0;
+}
+
+/* client_on_event() — dispatch one epoll event for a client */
+static void client_on_event(struct server* srv, struct client* cl, uint32_t events) {
+    if (cl->fd < 0) return; /* dropped earlier in this batch */
+
+    if (events & (EPOLLIN | EPOLLHUP | EPOLLERR)) {
+        if (client_on_input(srv, cl)) {
+            server_drop(srv, cl);
+            return;
+        }
+    }
+    if (client_flush(cl)) {
+        server_drop(srv, cl);
+        return;
+    }
+    client_first_frame(cl);
+    if (cl->closing) {
+        if (!client_queued(cl)) server_drop(srv, cl);
+        return;
+    }
+
+    /* A new request, or the previous update finally left: answer right away if possible */
+    server_serve(srv, cl);
+
+    /* The pointer moved: viewers following it with PointerPos needn't wait for a tick */
+    if (srv->pointer.moved) {
+        srv->pointer.moved = 0;
+        for (int i = 0; i < srv->nclients; i++) {
+            struct client* o = srv->clients[i];
+            if (o != cl && o->pointer_pos && o->pointer_seen != srv->pointer.seq) server_serve(srv, o);
+        }
+    }
+}
+
+/*
+ * Scan micro-benchmark (--bench-diff)
+ * -----------------------------------
+ * Runs the change detection kernels over two identical frames at the Centauri geometry,
+ * one tile slice at a time like a real scan. Identical frames are the worst case (no
+ * early exit: every byte is read) and also the common one (an idle UI). Reports
+ * framebuffer bytes processed per second for memcmp(), each diff and hash kernel in this
+ * build, and a complete idle tilemap_scan() in both scan modes. Needs no framebuffer, so
+ * it runs anywhere the binary does.
  */
+static int memcmp_seg(const uint8_t* a, const uint8_t* b, size_t n) {
+    return memcmp(a, b, n) != 0;
+}
 
-#define _GNU_SOURCE
+/* Hash kernels only read the frame; the stored hash they'd be compared with is a constant */
+static int hash_seg_scalar(const uint8_t* a, const uint8_t* b, size_t n) {
+    (void)b;
+    return seg_hash_scalar(a, n) == 0;
+}
 
-/* Networking / sockets */
-#include <arpa/inet.h>
-#include <netinet/in.h>
-#include <sys/socket.h>
+#ifdef HAVE_ARM_CRC32
+static int hash_seg_crc(const uint8_t* a, const uint8_t* b, size_t n) {
+    (void)b;
+    return seg_hash_crc(a, n) == 0;
+}
+#endif
 
-/* Linux framebuffer ioctls */
-#include <linux/fb.h>
-#include <sys/ioctl.h>
+static double bench_kernel(int (*fn)(const uint8_t*, const uint8_t*, size_t),
+                           const uint8_t* a, const uint8_t* b, int width, int height) {
+    size_t pitch = (size_t)width * 4;
+    size_t bytes = 0;
+    int64_t t0 = now_ms(), t1;
+    volatile int sink = 0;
 
-/* Memory mapping & I/O primitives */
-#include <errno.h>
-#include <fcntl.h>
-#include <stdint.h>
-#include <stdio.h>
-#include <stdlib.h>
-#include <string.h>
-#include <sys/mman.h>
-#include <sys/select.h>
-#include <sys/time.h>
-#include <sys/types.h>
-#include <unistd.h>
+    do {
+        for (int y = 0; y < height; y++) {
+            for (int x = 0; x < width; x += TILE_SIZE) {
+                size_t n = (size_t)(width - x < TILE_SIZE ? width - x : TILE_SIZE) * 4;
+                size_t off = (size_t)y * pitch + (size_t)x * 4;
+                sink |= fn(a + off, b + off, n);
+            }
+        }
+        bytes += pitch * (size_t)height;
+        t1 = now_ms();
+    } while (t1 - t0 < 500);
 
-/* Print perror() and exit. Used for fatal setup errors. */
-static void die(const char* msg) {
-    perror(msg);
-    exit(1);
+    (void)sink;
+    return (double)bytes / ((double)(t1 - t0) / 1000.0) / 1e9;
+}
+
+static void bench_scan(const char* name, int use_hash, int bulk, const uint8_t* frame, int width,
+                       int height) {
+    struct tilemap tm;
+    size_t size = (size_t)width * (size_t)height * 4;
+    if (tilemap_init(&tm, width, height, use_hash)) die("bench-diff");
+    tm.bulk = bulk;
+    tilemap_scan(&tm, frame, width * 4); /* the first scan sees everything change */
+
+    size_t bytes = 0;
+    int64_t t0 = now_ms(), t1;
+    do {
+        tilemap_scan(&tm, frame, width * 4);
+        bytes += size;
+        t1 = now_ms();
+    } while (t1 - t0 < 500);
+
+    double secs = (double)(t1 - t0) / 1000.0;
+    printf("  %-12s  %6.2f GB/s (%.0f idle scans/s)\n", name,
+           (double)bytes / secs / 1e9, (double)(bytes / size) / secs);
+
+    free(tm.shadow);
+    free(tm.changed);
+    free(tm.version);
+    free(tm.hashes);
+    free(tm.stage);
+}
+
+static int bench_diff(void) {
+    const int width = 480, height = 544;
+    size_t size = (size_t)width * (size_t)height * 4;
+    uint8_t* a = (uint8_t*)malloc(size);
+    uint8_t* b = (uint8_t*)malloc(size);
+    if (!a || !b) die("bench-diff");
+
+    for (size_t i = 0; i < size; i++) a[i] = (uint8_t)(i * 2654435761u >> 24);
+    memcpy(b, a, size);
+
+    printf("scan benchmark, %dx%d@32bpp, identical frames:\n", width, height);
+    printf("  memcmp        %6.2f GB/s\n", bench_kernel(memcmp_seg, a, b, width, height));
+    printf("  diff scalar   %6.2f GB/s\n", bench_kernel(diff_seg_scalar, a, b, width, height));
+#ifdef HAVE_NEON
+    printf("  diff neon     %6.2f GB/s\n", bench_kernel(diff_seg_neon, a, b, width, height));
+#endif
+    printf("  hash scalar   %6.2f GB/s\n", bench_kernel(hash_seg_scalar, a, b, width, height));
+#ifdef HAVE_ARM_CRC32
+    printf("  hash crc32    %6.2f GB/s\n", bench_kernel(hash_seg_crc, a, b, width, height));
+#endif
+    bench_scan("scan diff", 0, 0, b, width, height);
+    bench_scan("scan hash", 1, 0, b, width, height);
+    bench_scan("diff+bulk", 0, 1, b, width, height);
+    bench_scan("hash+bulk", 1, 1, b, width, height);
+
+    free(a);
+    free(b);
+    return 0;
 }
 
 /*
- * write_all() — reliably write exactly len bytes to fd
- *
- * - Loops until all bytes are written.
- * - Handles EINTR (signal interruption) by retrying.
- * - Returns 0 on success, -1 on failure (broken pipe, etc).
- *
- * This matters because TCP writes can write fewer bytes than requested.
+ * End-to-end benchmark (--bench)
+ * ------------------------------
+ * Runs the real server on a synthetic framebuffer and measures it from a headless viewer
+ * on loopback, so a change to the hot path can be judged without a printer:
+ * - the framebuffer is a memfd; the parent draws into it, and the server, this binary
+ *   exec'd with the normal options, reads it as -f /proc/self/fd/N --geometry WxH;
+ * - one server runs per encoding and transport; it reports its CPU time over --stats;
+ * - for each UI pattern the viewer makes a change, waits for the update that carries it
+ *   and requests the next one, recording latency, bytes and frames.
  */
-static int write_all(int fd, const void* buf, size_t len) {
-    const uint8_t* p = (const uint8_t*)buf;
-    while (len) {
-        ssize_t n = write(fd, p, len);
-        if (n < 0) {
-            if (errno == EINTR) continue;
+#define BENCH_SECS       5
+#define BENCH_TIMEOUT_MS 3000
+#define BENCH_MAX_FRAMES 4096
+
+/* A headless viewer connection: blocking reads with a timeout, through a small buffer */
+struct bench_conn {
+    int fd;
+    uint64_t bytes;
+    size_t off, len;
+    uint8_t buf[65536];
+};
+
+/* bench_recv() — read exactly n bytes (into dst, or discard them if dst is NULL) */
+static int bench_recv(struct bench_conn* c, void* dst, size_t n) {
+    uint8_t* d = (uint8_t*)dst;
+    while (n) {
+        if (c->off == c->len) {
+            struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+            if (poll(&pfd, 1, BENCH_TIMEOUT_MS) <= 0) return -1;
+            ssize_t r = read(c->fd, c->buf, sizeof(c->buf));
+            if (r <= 0) return -1;
+            c->off = 0;
+            c->len = (size_t)r;
+            c->bytes += (uint64_t)r;
+        }
+        size_t k = c->len - c->off < n ? c->len - c->off : n;
+        if (d) {
+            memcpy(d, c->buf + c->off, k);
+            d += k;
+        }
+        c->off += k;
+        n -= k;
+    }
+    return 0;
+}
+
+static int bench_send(int fd, const void* data, size_t len) {
+    return write(fd, data, len) == (ssize_t)len ? 0 : -1;
+}
+
+/* Skip one Hextile rectangle (32bpp): walk its 16x16 tiles' subencoding headers */
+static int bench_skip_hextile(struct bench_conn* c, int w, int h) {
+    for (int ty = 0; ty < h; ty += 16) {
+        for (int tx = 0; tx < w; tx += 16) {
+            int tw = w - tx < 16 ? w - tx : 16, th = h - ty < 16 ? h - ty : 16;
+            uint8_t se, n = 0;
+            if (bench_recv(c, &se, 1)) return -1;
+            if (se & HEXTILE_RAW) {
+                if (bench_recv(c, NULL, (size_t)tw * (size_t)th * 4)) return -1;
+                continue;
+            }
+            size_t skip = ((se & HEXTILE_BG) ? 4 : 0) + ((se & HEXTILE_FG) ? 4 : 0);
+            if (bench_recv(c, NULL, skip)) return -1;
+            if (!(se & HEXTILE_SUBRECTS)) continue;
+            if (bench_recv(c, &n, 1)) return -1;
+            if (bench_recv(c, NULL, (size_t)n * ((se & HEXTILE_COLOURED) ? 6 : 2))) return -1;
+        }
+    }
+    return 0;
+}
+
+#ifdef HAVE_ZLIB
+/* Read a Tight compact length: 1 to 3 bytes, 7 bits each, low bits first */
+static int bench_tight_length(struct bench_conn* c, size_t* n) {
+    *n = 0;
+    for (int i = 0; i < 3; i++) {
+        uint8_t b;
+        if (bench_recv(c, &b, 1)) return -1;
+        *n |= (size_t)(i < 2 ? b & 0x7f : b) << (7 * i);
+        if (i == 2 || !(b & 0x80)) break;
+    }
+    return 0;
+}
+
+/* Skip one Tight rectangle (32bpp, so 3-byte TPIXELs): fill, JPEG or basic compression */
+static int bench_skip_tight(struct bench_conn* c, int w, int h) {
+    uint8_t ctl, filter = 0, n = 0;
+    size_t len;
+    if (bench_recv(c, &ctl, 1)) return -1;
+    if ((ctl & 0xf0) == TIGHT_FILL) return bench_recv(c, NULL, 3);
+    if ((ctl & 0xf0) == TIGHT_JPEG) return bench_tight_length(c, &len) || bench_recv(c, NULL, len);
+    if (ctl & 0x80) return -1;
+
+    if ((ctl & TIGHT_FILTER) && bench_recv(c, &filter, 1)) return -1;
+    if (filter == TIGHT_PALETTE) {
+        if (bench_recv(c, &n, 1) || bench_recv(c, NULL, ((size_t)n + 1) * 3)) return -1;
+        len = n == 1 ? (size_t)(w + 7) / 8 * (size_t)h : (size_t)w * (size_t)h;
+    } else {
+        len = (size_t)w * (size_t)h * 3;
+    }
+    if (len >= TIGHT_MIN_ZLIB && bench_tight_length(c, &len)) return -1;
+    return bench_recv(c, NULL, len);
+}
+#endif
+
+/* bench_update() — read one FramebufferUpdate, skipping its payloads. Returns 0 or -1. */
+static int bench_update(struct bench_conn* c) {
+    uint8_t h[12];
+    for (;;) {
+        if (bench_recv(c, h, 1)) return -1;
+        if (h[0] == 0) break;
+        if (h[0] == 2) continue; /* Bell */
+        if (h[0] != 3 || bench_recv(c, h, 7)) return -1; /* ServerCutText */
+        if (bench_recv(c, NULL, ((uint32_t)h[3] << 24) | ((uint32_t)h[4] << 16) | ((uint32_t)h[5] << 8) | h[6])) {
             return -1;
         }
-        if (n == 0) return -1;
-        p += (size_t)n;
-        len -= (size_t)n;
+    }
+    if (bench_recv(c, h, 3)) return -1;
+    int nrects = (h[1] << 8) | h[2];
+
+    for (int i = 0; i < nrects; i++) {
+        if (bench_recv(c, h, 12)) return -1;
+        int w = (h[4] << 8) | h[5], hh = (h[6] << 8) | h[7];
+        int32_t enc = (int32_t)(((uint32_t)h[8] << 24) | ((uint32_t)h[9] << 16) | ((uint32_t)h[10] << 8) | h[11]);
+        int rc;
+        if (enc == ENC_RAW) {
+            rc = bench_recv(c, NULL, (size_t)w * (size_t)hh * 4);
+        } else if (enc == ENC_HEXTILE) {
+            rc = bench_skip_hextile(c, w, hh);
+        } else if (enc == ENC_ZRLE) {
+            uint8_t l[4];
+            rc = bench_recv(c, l, 4) ||
+                 bench_recv(c, NULL, ((uint32_t)l[0] << 24) | ((uint32_t)l[1] << 16) | ((uint32_t)l[2] << 8) | l[3]);
+#ifdef HAVE_ZLIB
+        } else if (enc == ENC_TIGHT) {
+            rc = bench_skip_tight(c, w, hh);
+#endif
+        } else {
+            rc = -1;
+        }
+        if (rc) return -1;
     }
     return 0;
 }
 
+static int bench_request(struct bench_conn* c, int incremental, int w, int h) {
+    uint8_t m[10] = { 3, (uint8_t)incremental };
+    put16(m + 6, (uint16_t)w);
+    put16(m + 8, (uint16_t)h);
+    return bench_send(c->fd, m, sizeof(m));
+}
+
 /*
- * read_all() — reliably read exactly len bytes from fd
- *
- * - Loops until all bytes are read.
- * - Handles EINTR by retrying.
- * - Returns 0 on success, -1 on EOF / error.
+ * bench_connect() — connect to the port (or the --unix path, if set), RFB 3.8 handshake
+ * (security None), then SetEncodings { enc }, with a JPEG quality level after Tight so its
+ * many-colour tiles take the JPEG path as they would for TigerVNC
+ */
+static int bench_connect(struct bench_conn* c, int port, const char* path, int32_t enc) {
+    c->bytes = 0;
+    c->off = c->len = 0;
+    if (path) {
+        struct sockaddr_un sun;
+        memset(&sun, 0, sizeof(sun));
+        sun.sun_family = AF_UNIX;
+        snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", path);
+        c->fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr*)&sun, sizeof(sun))) return -1;
+    } else {
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+        addr.sin_port = htons((uint16_t)port);
+        c->fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+        if (c->fd < 0 || connect(c->fd, (struct sockaddr*)&addr, sizeof(addr))) return -1;
+        int one = 1; /* like real viewers: a request must not wait for the previous ACK */
+        setsockopt(c->fd, IPPROTO_TCP, TCP_NODELAY, &one, sizeof(one));
+    }
+
+    uint8_t b[24], n;
+    if (bench_recv(c, b, 12) || bench_send(c->fd, "RFB 003.008\n", 12)) return -1;
+    if (bench_recv(c, &n, 1) || !n || bench_recv(c, NULL, n)) return -1;
+    if (bench_send(c->fd, "\x01", 1) || bench_recv(c, b, 4) || b[3]) return -1;
+    if (bench_send(c->fd, "\x01", 1) || bench_recv(c, b, 24)) return -1;
+    if (bench_recv(c, NULL, ((uint32_t)b[20] << 24) | ((uint32_t)b[21] << 16) | ((uint32_t)b[22] << 8) | b[23])) {
+        return -1;
+    }
+
+    uint8_t se[12] = { 2, 0, 0, 1 };
+    put32(se + 4, (uint32_t)enc);
+    if (enc == ENC_TIGHT) {
+        se[3] = 2;
+        put32(se + 8, (uint32_t)(ENC_QUALITY_0 + 6));
+    }
+    return bench_send(c->fd, se, 4 + (size_t)se[3] * 4);
+}
+
+/* bench_cpu_us() — the server's CPU time so far, from its --stats socket */
+static int64_t bench_cpu_us(const char* sock) {
+    struct sockaddr_un sun;
+    memset(&sun, 0, sizeof(sun));
+    sun.sun_family = AF_UNIX;
+    snprintf(sun.sun_path, sizeof(sun.sun_path), "%s", sock);
+
+    int fd = socket(AF_UNIX, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0) return -1;
+    if (connect(fd, (struct sockaddr*)&sun, sizeof(sun))) {
+        close(fd);
+        return -1;
+    }
+    char text[256];
+    ssize_t n = read(fd, text, sizeof(text) - 1); /* the CPU counter is the first line */
+    close(fd);
+    if (n <= 0) return -1;
+    text[n] = 0;
+    long long us;
+    return sscanf(text, "fb0rfb_cpu_us_total %lld", &us) == 1 ? (int64_t)us : -1;
+}
+
+/*
+ * Synthetic UI activity
+ * - idle: nothing changes (the cost of an idle printer screen);
+ * - progress: a progress bar grows by 4 px per frame (a print in progress);
+ * - transition: the whole screen alternates between two layouts (menu navigation).
+ */
+enum { PAT_IDLE, PAT_PROGRESS, PAT_TRANSITION, PAT_COUNT };
+static const char* const bench_pattern_names[PAT_COUNT] = { "idle", "progress", "transition" };
+
+static void bench_fill(uint32_t* fb, int w, int x, int y, int rw, int rh, uint32_t color) {
+    for (int j = 0; j < rh; j++) {
+        for (int i = 0; i < rw; i++) fb[(size_t)(y + j) * (size_t)w + (size_t)(x + i)] = color;
+    }
+}
+
+/* Two screen layouts: flat panels and buttons, and a status screen over a gradient */
+static void bench_screen(uint32_t* fb, int w, int h, int which) {
+    if (!which) {
+        bench_fill(fb, w, 0, 0, w, h, 0x202428);
+        bench_fill(fb, w, 0, 0, w, h / 10, 0x3a6ea5);
+        for (int i = 0; i < 6; i++) {
+            bench_fill(fb, w, w / 16 + (i % 2) * (w / 2), h / 6 + (i / 2) * (h / 4), w * 3 / 8, h / 6,
+                       0x404850 + (uint32_t)i * 0x080808);
+        }
+        return;
+    }
+    for (int y = 0; y < h; y++) {
+        for (int x = 0; x < w; x++) {
+            fb[(size_t)y * (size_t)w + (size_t)x] = (uint32_t)((x * 255 / w) << 16 | (y * 255 / h) << 8 | 0x40);
+        }
+    }
+    bench_fill(fb, w, w / 8, h / 3, w * 3 / 4, h / 3, 0xf0f0f0);
+}
+
+/* bench_step() — apply one frame's worth of change for the pattern */
+static void bench_step(uint32_t* fb, int w, int h, int pattern, int step) {
+    if (pattern == PAT_PROGRESS) {
+        int x0 = w / 8, len = w * 3 / 4, y = h * 3 / 4, pos = (step * 4) % len;
+        if (!pos) bench_fill(fb, w, x0, y, len, 16, 0x303030);
+        bench_fill(fb, w, x0 + pos, y, len - pos < 4 ? len - pos : 4, 16, 0x40c040);
+    } else if (pattern == PAT_TRANSITION) {
+        bench_screen(fb, w, h, (step & 1) ^ 1);
+    }
+}
+
+static int cmp_i64(const void* a, const void* b) {
+    int64_t x = *(const int64_t*)a, y = *(const int64_t*)b;
+    return x < y ? -1 : x > y;
+}
+
+/*
+ * bench_case() — run one pattern against a connected viewer and print its row
  *
- * This matters because TCP reads can return fewer bytes than requested.
+ * The viewer always has a request outstanding while the pattern draws, like a real one.
  */
-static int read_all(int fd, void* buf, size_t len) {
-    uint8_t* p = (uint8_t*)buf;
-    while (len) {
-        ssize_t n = read(fd, p, len);
-        if (n < 0) {
-            if (errno == EINTR) continue;
-            return -1;
+static int bench_case(struct bench_conn* c, const char* sock, const char* label, int pattern,
+                      uint32_t* fb, int w, int h) {
+    static int64_t lat[BENCH_MAX_FRAMES];
+    int frames = 0;
+    uint64_t bytes0 = c->bytes;
+    int64_t cpu0 = bench_cpu_us(sock);
+    int64_t start = now_us(), end = start + (int64_t)BENCH_SECS * 1000000;
+
+    if (pattern == PAT_IDLE) {
+        /* Nothing changes: any update that shows up anyway is counted */
+        for (int64_t now = start; now < end; now = now_us()) {
+            struct pollfd pfd = { .fd = c->fd, .events = POLLIN };
+            if (poll(&pfd, 1, (int)((end - now) / 1000) + 1) <= 0) continue;
+            if (bench_update(c) || bench_request(c, 1, w, h)) return -1;
+            frames++;
+        }
+    } else {
+        while (frames < BENCH_MAX_FRAMES && now_us() < end) {
+            int64_t t0 = now_us();
+            bench_step(fb, w, h, pattern, frames);
+            if (bench_update(c)) return -1;
+            lat[frames++] = now_us() - t0;
+            if (bench_request(c, 1, w, h)) return -1;
         }
-        if (n == 0) return -1; /* peer closed connection */
-        p += (size_t)n;
-        len -= (size_t)n;
     }
+
+    int64_t elapsed = now_us() - start;
+    int64_t cpu = bench_cpu_us(sock) - cpu0;
+    double kb = (double)(c->bytes - bytes0) / 1024.0;
+    qsort(lat, (size_t)(pattern == PAT_IDLE ? 0 : frames), sizeof(lat[0]), cmp_i64);
+
+    printf("  %-16s %-10s %6.1f", label, bench_pattern_names[pattern], frames * 1e6 / (double)elapsed);
+    if (pattern == PAT_IDLE || !frames) {
+        printf("       -       -");
+    } else {
+        printf(" %7.1f %7.1f", lat[frames / 2] / 1000.0, lat[frames - 1] / 1000.0);
+    }
+    printf(" %9.1f %9.2f %6.2f\n", frames ? kb / frames : 0.0,
+           frames ? cpu / 1000.0 / frames : 0.0, cpu * 100.0 / (double)elapsed);
     return 0;
 }
 
+/* An unused loopback port for the server (bound and released again) */
+static int bench_free_port(void) {
+    struct sockaddr_in addr;
+    socklen_t len = sizeof(addr);
+    memset(&addr, 0, sizeof(addr));
+    addr.sin_family = AF_INET;
+    addr.sin_addr.s_addr = htonl(INADDR_LOOPBACK);
+    int fd = socket(AF_INET, SOCK_STREAM | SOCK_CLOEXEC, 0);
+    if (fd < 0 || bind(fd, (struct sockaddr*)&addr, sizeof(addr)) ||
+        getsockname(fd, (struct sockaddr*)&addr, &len)) die("bench port");
+    close(fd);
+    return ntohs(addr.sin_port);
+}
+
+/* bench_spawn() — start a server child on the memfd, also on the --unix path; returns its pid once it is up */
+static pid_t bench_spawn(int memfd, int w, int h, int fps, int threads, int port, const char* usock,
+                         const char* sock) {
+    char path[32], geo[32], ports[16], fpss[16], threadss[16];
+    snprintf(path, sizeof(path), "/proc/self/fd/%d", memfd);
+    snprintf(geo, sizeof(geo), "%dx%d", w, h);
+    snprintf(ports, sizeof(ports), "%d", port);
+    snprintf(fpss, sizeof(fpss), "%d", fps);
+    snprintf(threadss, sizeof(threadss), "%d", threads);
+
+    pid_t pid = fork();
+    if (pid < 0) die("fork");
+    if (!pid) {
+        int null = open("/dev/null", O_WRONLY);
+        if (null >= 0) dup2(null, 2);
+        execl("/proc/self/exe", "fb0rfb", "-f", path, "--geometry", geo, "-p", ports, "--fps", fpss,
+              "--threads", threadss, "--max-clients", "1", "--unix", usock, "--stats", sock, (char*)NULL);
+        _exit(127);
+    }
+
+    for (int i = 0; i < 300 && bench_cpu_us(sock) < 0; i++) {
+        struct timespec ts = { 0, 10 * 1000000L };
+        nanosleep(&ts, NULL);
+    }
+    return pid;
+}
+
 /*
- * msleep() — simple millisecond sleep using select()
- *
- * select() with no fds is a common portable trick for sub-second sleeps.
+ * bench_run() — every encoding x transport x pattern, one table row each
  */
-static void msleep(int ms) {
-    struct timeval tv;
-    tv.tv_sec  = ms / 1000;
-    tv.tv_usec = (ms % 1000) * 1000;
-    select(0, NULL, NULL, NULL, &tv);
+static int bench_run(int w, int h, int fps, int threads) {
+    static const int32_t encodings[] = { ENC_RAW, ENC_HEXTILE,
+#ifdef HAVE_ZLIB
+                                         ENC_ZRLE, ENC_TIGHT,
+#endif
+    };
+    size_t size = (size_t)w * (size_t)h * 4;
+    int memfd = memfd_create("fb0rfb-bench", 0);
+    if (memfd < 0 || ftruncate(memfd, (off_t)size)) die("memfd");
+    uint32_t* fb = (uint32_t*)mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_SHARED, memfd, 0);
+    if (fb == MAP_FAILED) die("mmap memfd");
+
+    char sock[64], usock[64];
+    snprintf(sock, sizeof(sock), "/tmp/fb0rfb-bench-%d.sock", (int)getpid());
+    snprintf(usock, sizeof(usock), "/tmp/fb0rfb-bench-%d.rfb", (int)getpid());
+    signal(SIGPIPE, SIG_IGN);
+
+    printf("end-to-end benchmark, %dx%d@32bpp, --fps %d, --threads %d, %d s per pattern\n", w, h, fps,
+           threads, BENCH_SECS);
+    printf("  %-16s %-10s %6s %7s %7s %9s %9s %6s\n", "encoding/link", "pattern", "fps",
+           "lat p50", "lat max", "KB/frame", "cpu/frame", "cpu");
+    printf("  %-16s %-10s %6s %7s %7s %9s %9s %6s\n", "", "", "", "ms", "ms", "", "ms", "%");
+
+    int rc = 0;
+    for (size_t run = 0; run < 2 * sizeof(encodings) / sizeof(encodings[0]) && !rc; run++) {
+        size_t e = run / 2;
+        int local = run & 1; /* each encoding over TCP, then over the Unix socket */
+        bench_screen(fb, w, h, 0);
+        int port = bench_free_port();
+        pid_t pid = bench_spawn(memfd, w, h, fps, threads, port, usock, sock);
+
+        char label[32];
+        snprintf(label, sizeof(label), "%s/%s", encoding_name(encodings[e]), local ? "unix" : "tcp");
+        struct bench_conn* c = (struct bench_conn*)malloc(sizeof(*c));
+        int64_t t0 = now_us();
+        if (!c || bench_connect(c, port, local ? usock : NULL, encodings[e]) || bench_request(c, 0, w, h) ||
+            bench_update(c) || bench_request(c, 1, w, h)) {
+            fprintf(stderr, "bench: %s: no first frame\n", label);
+            rc = 1;
+        } else {
+            printf("  %-16s %-10s first frame %.1f ms, %.1f KB\n", label, "connect",
+                   (now_us() - t0) / 1000.0, c->bytes / 1024.0);
+        }
+        for (int pat = 0; pat < PAT_COUNT && !rc; pat++) {
+            if (bench_case(c, sock, label, pat, fb, w, h)) {
+                fprintf(stderr, "bench: %s %s: server stopped answering\n", label, bench_pattern_names[pat]);
+                rc = 1;
+            }
+        }
+
+        if (c && c->fd >= 0) close(c->fd);
+        free(c);
+        kill(pid, SIGTERM);
+        waitpid(pid, NULL, 0);
+        unlink(sock);
+        unlink(usock);
+    }
+    munmap(fb, size);
+    close(memfd);
+    return rc;
 }
 
 int main(int argc, char** argv) {
@@ -132,19 +6258,98 @@ int main(int argc, char** argv) {
     const char* fbpath = "/dev/fb0";
     int port = 5900;
     int fps = 3;
+    int max_clients = 4;
+    int scan_mode = -1; /* -1 auto, 0 diff, 1 hash */
+    int read_mode = -1; /* -1 auto, 0 direct, 1 bulk */
+    int use_vsync = 1;
+    const char* stats_at = NULL;
+    const char* unix_at = NULL;
+    const char* shm_at = NULL;
+    const char* record_at = NULL;
+    int record_key_s = 60;
+    int idle_backoff_s = 5;
+    int stats_log_s = 0;
+    int geo_w = 0, geo_h = 0, geo_bpp = 32;
+    int bench = 0;
+    int capture_thread = 0;
+    int copyrect = 1;
+    int jpeg_quality = 0;
+    int scale = 1;
+    int sndbuf_kb = -1; /* -1: one frame */
+    int threads = 1;
 
     /*
      * Parse basic CLI options:
-     *   -f /dev/fb0   framebuffer device path
-     *   -p 5900       TCP port
-     *   --fps 3       frames per second cap
+     *   -f /dev/fb0        framebuffer device path
+     *   -p 5900            TCP port (0 = none: --unix and --shm consumers only)
+     *   --unix PATH        also accept viewers on a Unix socket (local consumers)
+     *   --shm PATH         publish frames into a shared-memory ring file
+     *                      (see "Shared-memory snapshots")
+     *   --record FILE      record changes to FILE, keyframes indexed in FILE.idx (see "Recording")
+     *   --record-keyframe 60
+     *                      seconds between full-screen records
+     *   --fps 3            frames per second cap
+     *   --idle-backoff 5   seconds without change before scans slow down (0 = never)
+     *   --max-clients 4    concurrent viewers (further connections are refused)
+     *   --scan auto        change detection: "hash", "diff", or "auto" (time both)
+     *   --fb-read auto     reading fbmem: "direct", "bulk" (one pass per band), or "auto";
+     *                      not 32bpp: always bulk, through the capture kernel
+     *   --no-vsync         don't wait for vertical blank before scanning
+     *   --capture-thread   capture on a SCHED_IDLE thread into a snapshot ring
+     *   --threads 1        threads encoding tiles (1 = the event loop alone)
+     *   --no-copyrect      don't look for moved content (saves a frame of memory)
+     *   --jpeg-quality 0   Tight JPEG quality for viewers that don't ask for one (0 = lossless)
+     *   --scale 1          serve viewers a 1/2 or 1/4 size screen (they may pick with SetDesktopSize)
+     *   --sndbuf KB        socket send buffer per viewer (default: one frame, 0 = kernel autotuning)
+     *   --stats 5901       stats endpoint: TCP port, or Unix socket path if it starts with '/'
+     *   --stats-log 60     print a stats summary to stderr every N seconds
+     *   --geometry 480x544 -f is a plain file of XRGB pixels of that size (no fb ioctls);
+     *                      480x544@16 / @24 for RGB565 / RGB888 pixels
+     *   --bench            run the end-to-end benchmark on a synthetic framebuffer and exit
+     *   --bench-diff       run the scan kernel micro-benchmark and exit
      */
     for (int i = 1; i < argc; i++) {
         if (!strcmp(argv[i], "-f") && i + 1 < argc) fbpath = argv[++i];
         else if (!strcmp(argv[i], "-p") && i + 1 < argc) port = atoi(argv[++i]);
         else if (!strcmp(argv[i], "--fps") && i + 1 < argc) fps = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--idle-backoff") && i + 1 < argc) idle_backoff_s = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--max-clients") && i + 1 < argc) max_clients = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scan") && i + 1 < argc) {
+            i++;
+            scan_mode = !strcmp(argv[i], "hash") ? 1 : !strcmp(argv[i], "diff") ? 0 : -1;
+        }
+        else if (!strcmp(argv[i], "--fb-read") && i + 1 < argc) {
+            i++;
+            read_mode = !strcmp(argv[i], "bulk") ? 1 : !strcmp(argv[i], "direct") ? 0 : -1;
+        }
+        else if (!strcmp(argv[i], "--no-vsync")) use_vsync = 0;
+        else if (!strcmp(argv[i], "--capture-thread")) capture_thread = 1;
+        else if (!strcmp(argv[i], "--threads") && i + 1 < argc) threads = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--no-copyrect")) copyrect = 0;
+        else if (!strcmp(argv[i], "--jpeg-quality") && i + 1 < argc) jpeg_quality = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--scale") && i + 1 < argc) scale = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--sndbuf") && i + 1 < argc) sndbuf_kb = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--unix") && i + 1 < argc) unix_at = argv[++i];
+        else if (!strcmp(argv[i], "--shm") && i + 1 < argc) shm_at = argv[++i];
+        else if (!strcmp(argv[i], "--record") && i + 1 < argc) record_at = argv[++i];
+        else if (!strcmp(argv[i], "--record-keyframe") && i + 1 < argc) record_key_s = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--stats") && i + 1 < argc) stats_at = argv[++i];
+        else if (!strcmp(argv[i], "--stats-log") && i + 1 < argc) stats_log_s = atoi(argv[++i]);
+        else if (!strcmp(argv[i], "--geometry") && i + 1 < argc &&
+                 sscanf(argv[i + 1], "%dx%d@%d", &geo_w, &geo_h, &geo_bpp) >= 2 && geo_w > 0 && geo_h > 0 &&
+                 (geo_bpp == 16 || geo_bpp == 24 || geo_bpp == 32)) i++;
+        else if (!strcmp(argv[i], "--bench")) bench = 1;
+        else if (!strcmp(argv[i], "--bench-diff")) return bench_diff();
         else {
-            fprintf(stderr, "Usage: %s [-f /dev/fb0] [-p 5900] [--fps 3]\n", argv[0]);
+            fprintf(stderr, "Usage: %s [-f /dev/fb0] [-p 5900] [--fps 3] [--idle-backoff SEC] [--max-clients 4]\n"
+                    "              [--scan auto|hash|diff] [--fb-read auto|direct|bulk] [--no-vsync]\n"
+                    "              [--unix PATH] [--shm PATH] [--stats PORT|PATH] [--stats-log SEC]\n"
+                    "              [--geometry WxH[@BPP]] [--capture-thread] [--threads N] [--no-copyrect]\n"
+                    "              [--jpeg-quality 1-100] [--scale 1|2|4] [--sndbuf KB]\n"
+                    "              [--record FILE] [--record-keyframe SEC]\n"
+                    "       %s --bench [--geometry WxH] [--fps N] [--threads N]\n"
+                    "       %s --bench-diff\n",
+                    argv[0], argv[0], argv[0]);
             return 2;
         }
     }
@@ -152,6 +6357,22 @@ int main(int argc, char** argv) {
     /* Enforce sane bounds to keep it "resource-safe" on an embedded printer */
     if (fps < 1) fps = 1;
     if (fps > 15) fps = 15; /* hard cap to stay resource-safe */
+    if (max_clients < 1) max_clients = 1;
+    if (max_clients > MAX_CLIENTS) max_clients = MAX_CLIENTS;
+    if (threads < 1) threads = 1;
+    if (threads > MAX_THREADS) threads = MAX_THREADS;
+    if (jpeg_quality < 0) jpeg_quality = 0;
+    if (jpeg_quality > 100) jpeg_quality = 100;
+    if (scale != 2 && scale != 4) scale = 1;
+    if (sndbuf_kb > 64 * 1024) sndbuf_kb = 64 * 1024;
+    if (record_key_s < 1) record_key_s = 1;
+    if (idle_backoff_s < 0) idle_backoff_s = 0;
+    if (record_at && max_clients < MAX_CLIENTS) max_clients++; /* the recording's own slot */
+    if (port <= 0 && !unix_at && !shm_at && !record_at) {
+        fprintf(stderr, "fb0rfb: -p 0 needs --unix, --shm or --record: nothing to serve\n");
+        return 2;
+    }
+    if (bench) return bench_run(geo_w ? geo_w : 480, geo_h ? geo_h : 544, fps, threads);
 
     /*
      * Open framebuffer read-only
@@ -169,8 +6390,24 @@ int main(int argc, char** argv) {
      */
     struct fb_var_screeninfo vinfo;
     struct fb_fix_screeninfo finfo;
-    if (ioctl(fb, FBIOGET_VSCREENINFO, &vinfo)) die("FBIOGET_VSCREENINFO");
-    if (ioctl(fb, FBIOGET_FSCREENINFO, &finfo)) die("FBIOGET_FSCREENINFO");
+    if (geo_w) {
+        /* --geometry: a plain file (or memfd) of pixels, described by the command line */
+        struct stat st;
+        memset(&vinfo, 0, sizeof(vinfo));
+        memset(&finfo, 0, sizeof(finfo));
+        vinfo.xres = vinfo.xres_virtual = (uint32_t)geo_w;
+        vinfo.yres = vinfo.yres_virtual = (uint32_t)geo_h;
+        vinfo.bits_per_pixel = (uint32_t)geo_bpp;
+        finfo.line_length = (uint32_t)geo_w * (uint32_t)geo_bpp / 8;
+        finfo.smem_len = finfo.line_length * (uint32_t)geo_h;
+        if (fstat(fb, &st) || st.st_size < (off_t)finfo.smem_len) {
+            fprintf(stderr, "%s: smaller than %dx%d@%dbpp\n", fbpath, geo_w, geo_h, geo_bpp);
+            return 3;
+        }
+    } else {
+        if (ioctl(fb, FBIOGET_VSCREENINFO, &vinfo)) die("FBIOGET_VSCREENINFO");
+        if (ioctl(fb, FBIOGET_FSCREENINFO, &finfo)) die("FBIOGET_FSCREENINFO");
+    }
 
     /* Visible resolution */
     int width  = (int)vinfo.xres;
@@ -181,369 +6418,245 @@ int main(int argc, char** argv) {
     int stride = (int)finfo.line_length;
 
     /*
-     * This implementation assumes 32bpp.
-     *
-     * Why: we send 4 bytes per pixel (RFB 32bpp) and use memcpy() line copies
-     * without conversion. Supporting other bpp values would require conversion.
+     * We serve 32bpp pixels. 32bpp framebuffers are read as they are; 16bpp and 24bpp ones
+     * are widened while they are read, by a kernel picked for their layout (see "Capture
+     * kernels").
      */
-    if (bpp != 32) {
-        fprintf(stderr, "Unsupported bpp=%d (expected 32)\n", bpp);
+    struct fbconv conv;
+    if (fbconv_pick(&conv, &vinfo) || stride < width * conv.bytespp) {
+        fprintf(stderr, "Unsupported pixel layout: %dbpp, R %u@%u G %u@%u B %u@%u, stride %d\n", bpp,
+                vinfo.red.length, vinfo.red.offset, vinfo.green.length, vinfo.green.offset,
+                vinfo.blue.length, vinfo.blue.offset, stride);
         return 3;
     }
 
+    /*
+     * Server pixel format: taken from the driver's channel bitfields, so BGRA panels are
+     * advertised as what they are instead of showing swapped colors. Drivers that leave
+     * the bitfields empty, and the widened 16bpp and 24bpp layouts, are XRGB.
+     */
+    struct pixfmt server_pf;
+    memset(&server_pf, 0, sizeof(server_pf));
+    server_pf.bpp        = 32;
+    server_pf.depth      = 24;
+    server_pf.big_endian = 0;
+    server_pf.true_color = 1;
+    if (conv.same && vinfo.red.length && vinfo.green.length && vinfo.blue.length &&
+        vinfo.red.length <= 8 && vinfo.green.length <= 8 && vinfo.blue.length <= 8) {
+        server_pf.rmax   = (1 << vinfo.red.length) - 1;
+        server_pf.gmax   = (1 << vinfo.green.length) - 1;
+        server_pf.bmax   = (1 << vinfo.blue.length) - 1;
+        server_pf.rshift = (int)vinfo.red.offset;
+        server_pf.gshift = (int)vinfo.green.offset;
+        server_pf.bshift = (int)vinfo.blue.offset;
+        server_pf.depth  = (int)(vinfo.red.length + vinfo.green.length + vinfo.blue.length);
+    } else {
+        server_pf.rmax = server_pf.gmax = server_pf.bmax = 255;
+        server_pf.rshift = 16;
+        server_pf.gshift = 8;
+        server_pf.bshift = 0;
+    }
+
     /*
      * Map framebuffer into memory.
      *
-     * fbsize is based on stride*height, not width*height*4, because:
+     * fbsize is based on stride*lines, not width*height*4, because:
      * - Some framebuffers have padding per line (stride may be > width*bytespp).
+     * - A double-buffering UI flips between pages of the virtual area (yres_virtual
+     *   lines), so all of them are mapped; the displayed one is located per scan.
+     * Drivers that report less memory than that get just the visible page.
      */
-    size_t fbsize = (size_t)stride * (size_t)height;
+    int vlines = (int)vinfo.yres_virtual;
+    if (vlines < height || (finfo.smem_len && (size_t)stride * (size_t)vlines > finfo.smem_len)) {
+        vlines = height;
+    }
+    size_t fbsize = (size_t)stride * (size_t)vlines;
     uint8_t* fbmem = mmap(NULL, fbsize, PROT_READ, MAP_SHARED, fb, 0);
+    if (fbmem == MAP_FAILED && vlines > height) {
+        vlines = height;
+        fbsize = (size_t)stride * (size_t)vlines;
+        fbmem = mmap(NULL, fbsize, PROT_READ, MAP_SHARED, fb, 0);
+    }
     if (fbmem == MAP_FAILED) die("mmap fb");
 
     /*
-     * Create listening socket
-     *
-     * AF_INET + SOCK_STREAM = IPv4 TCP.
-     * We bind to 0.0.0.0 so it listens on all interfaces (LAN Wi-Fi/Ethernet).
+     * Shadow framebuffer + tile grid for dirty-rectangle tracking, shared by all clients.
+     * Allocated once: its size only depends on the framebuffer geometry.
      */
-    int s = socket(AF_INET, SOCK_STREAM, 0);
-    if (s < 0) die("socket");
-
-    /* Allow quick restart if the port is in TIME_WAIT */
-    int one = 1;
-    setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
-
-    /* Bind to INADDR_ANY:port */
-    struct sockaddr_in addr;
-    memset(&addr, 0, sizeof(addr));
-    addr.sin_family = AF_INET;
-    addr.sin_addr.s_addr = htonl(INADDR_ANY);
-    addr.sin_port = htons((uint16_t)port);
+    struct server srv;
+    memset(&srv, 0, sizeof(srv));
+    srv.fbmem = fbmem;
+    srv.stride = stride;
+    srv.fbfd = geo_w ? -1 : fb;
+    srv.fbbase = fbmem;
+    srv.vlines = vlines;
+    srv.vsync = use_vsync && srv.fbfd >= 0 && fb_probe_vsync(fb);
+    if (tilemap_init(&srv.tm, width, height, scan_mode != 0)) die("tilemap_init");
+    srv.tm.conv = conv;
+    fb_locate_page(&srv, &stats);
+    srv.pf = server_pf;
+    server_init_build(&srv);
+    srv.fps = fps;
+    srv.jpeg_quality = jpeg_quality;
+    srv.can_scale = pixfmt_is_bytewise32(&server_pf) && width >= 4 && height >= 4;
+    srv.scale = srv.can_scale ? scale : 1;
+    if (srv.scale != scale) fprintf(stderr, "fb0rfb: --scale needs 8-bit channels, serving full size\n");
+    srv.period = 1000 / fps;
+    srv.pace.period = srv.pace.interval = srv.period;
+    srv.pace.idle_after = idle_backoff_s * 1000;
+    srv.pace.last_change = now_ms();
+    srv.max_clients = max_clients;
+    srv.last_scan = now_ms() - srv.period;
+    if (!conv.same) read_mode = 1; /* converted: framebuffer is always read in bands */
+    srv.tm.bulk = read_mode == 1;
+    if (scan_mode < 0 || read_mode < 0) tilemap_pick_scan(&srv.tm, srv.fbmem, stride, scan_mode < 0, read_mode < 0);
+    if (server_reserve(&srv, threads)) die("memory reservation");
+    if (threads > 1 && pool_start(&srv.pool, &srv.arena, srv.tm.ntiles, threads)) die("encoder threads");
+    if (copyrect && !capture_thread && movefind_init(&srv.moves, &srv.tm)) die("move detection");
 
-    if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) die("bind");
-    if (listen(s, 1) < 0) die("listen");
+    /* A viewer vanishing mid-write must cost us that viewer, not the process */
+    signal(SIGPIPE, SIG_IGN);
 
-    fprintf(stderr,
-            "fb0rfb: listening on 0.0.0.0:%d, fb=%s (%dx%d@32bpp, stride=%d), fps=%d\n",
-            port, fbpath, width, height, stride, fps);
+    /* Viewer sockets: see "Transport tuning" */
+    srv.tp.nodelay = 1;
+    srv.tp.sndbuf = sndbuf_kb < 0 ? width * height * 4 : sndbuf_kb * 1024;
 
     /*
-     * Main accept loop
+     * Create listening socket
      *
-     * Single-client design:
-     * - accept() blocks until a client connects
-     * - handle the client until disconnect
-     * - then return to accept()
+     * AF_INET + SOCK_STREAM = IPv4 TCP, non-blocking: accept() runs from the event loop.
+     * We bind to 0.0.0.0 so it listens on all interfaces (LAN Wi-Fi/Ethernet).
      */
-    for (;;) {
-        int c = accept(s, NULL, NULL);
-        if (c < 0) {
-            if (errno == EINTR) continue;
-            die("accept");
-        }
-
-        /*
-         * RFB Protocol handshake (VNC)
-         *
-         * Reference flow (simplified):
-         * 1) Server -> Client: "RFB 003.008\n"
-         * 2) Client -> Server: same format version
-         * 3) Server -> Client: Security types (we offer "None" only)
-         * 4) Client -> Server: chosen security type
-         * 5) Server -> Client: SecurityResult (0 = OK)
-         * 6) Client -> Server: ClientInit (shared flag)
-         * 7) Server -> Client: ServerInit (w,h,pixfmt,name)
-         */
-
-        /* 1) Send protocol version */
-        const char* ver = "RFB 003.008\n";
-        if (write_all(c, ver, 12)) { close(c); continue; }
-
-        /* 2) Read client protocol version (not validated beyond length) */
-        char cver[12];
-        if (read_all(c, cver, 12)) { close(c); continue; }
-
-        /*
-         * 3) Security handshake: "None" only
-         *
-         * For RFB 3.8, server sends:
-         *   [number-of-types:1][type1:1]...[typen:1]
-         * type 1 == "None"
-         */
-        uint8_t sec_types[2] = { 1, 1 }; /* 1 type: None */
-        if (write_all(c, sec_types, 2)) { close(c); continue; }
-
-        /* 4) Client chooses the security type */
-        uint8_t chosen = 0;
-        if (read_all(c, &chosen, 1)) { close(c); continue; }
-        if (chosen != 1) { close(c); continue; } /* client didn't accept "None" */
-
-        /* 5) SecurityResult: 4-byte status, 0 = OK */
-        uint32_t ok = htonl(0);
-        if (write_all(c, &ok, 4)) { close(c); continue; }
+    srv.lfd = -1;
+    if (port > 0) {
+        int s = socket(AF_INET, SOCK_STREAM | SOCK_NONBLOCK | SOCK_CLOEXEC, 0);
+        if (s < 0) die("socket");
 
-        /* 6) ClientInit: shared-flag (we ignore it) */
-        uint8_t shared = 0;
-        if (read_all(c, &shared, 1)) { close(c); continue; }
+        /* Allow quick restart if the port is in TIME_WAIT */
+        int one = 1;
+        setsockopt(s, SOL_SOCKET, SO_REUSEADDR, &one, sizeof(one));
+        transport_tune(s, &srv.tp);
+        transport_report(s, &srv.tp);
 
-        /*
-         * 7) ServerInit:
-         * - width (u16)
-         * - height (u16)
-         * - PixelFormat (16 bytes)
-         * - name length (u32)
-         * - name string
-         */
-        uint16_t w = htons((uint16_t)width);
-        uint16_t h = htons((uint16_t)height);
+        /* Bind to INADDR_ANY:port */
+        struct sockaddr_in addr;
+        memset(&addr, 0, sizeof(addr));
+        addr.sin_family = AF_INET;
+        addr.sin_addr.s_addr = htonl(INADDR_ANY);
+        addr.sin_port = htons((uint16_t)port);
 
-        /*
-         * PixelFormat is exactly 16 bytes per RFB spec.
-         * We pack it to guarantee layout on all compilers.
-         *
-         * We advertise:
-         * - 32 bits per pixel (4 bytes)
-         * - 24-bit "depth" (meaning only 24 meaningful color bits)
-         * - little-endian (big_endian_flag=0)
-         * - true color (true_color_flag=1)
-         * - 8-bit per channel (max=255)
-         * - shifts: R=16, G=8, B=0 (common XRGB/ARGB little-endian)
-         */
-        struct __attribute__((packed)) PixelFormat {
-            uint8_t  bits_per_pixel;
-            uint8_t  depth;
-            uint8_t  big_endian_flag;
-            uint8_t  true_color_flag;
-            uint16_t red_max, green_max, blue_max;
-            uint8_t  red_shift, green_shift, blue_shift;
-            uint8_t  pad[3];
-        } pf;
-
-        memset(&pf, 0, sizeof(pf));
-        pf.bits_per_pixel   = 32;
-        pf.depth            = 24;
-        pf.big_endian_flag  = 0;
-        pf.true_color_flag  = 1;
-        pf.red_max          = htons(255);
-        pf.green_max        = htons(255);
-        pf.blue_max         = htons(255);
-        pf.red_shift        = 16;
-        pf.green_shift      = 8;
-        pf.blue_shift       = 0;
-
-        const char* name = "OpenCentauri fb0 (RAW)";
-        uint32_t namelen = htonl((uint32_t)strlen(name));
-
-        if (write_all(c, &w, 2) ||
-            write_all(c, &h, 2) ||
-            write_all(c, &pf, sizeof(pf)) ||
-            write_all(c, &namelen, 4) ||
-            write_all(c, name, strlen(name))) {
-            close(c);
-            continue;
-        }
+        if (bind(s, (struct sockaddr*)&addr, sizeof(addr)) < 0) die("bind");
+        if (listen(s, 4) < 0) die("listen");
+        srv.lfd = s;
+    }
 
-        /*
-         * Allocate a single scanline buffer.
-         *
-         * We copy line-by-line from the framebuffer to avoid:
-         * - writing directly from mmap() memory into the socket (still possible),
-         * - and to ensure we only send width*4 bytes (not stride bytes).
-         *
-         * Note: If stride == width*4 (typical), copying can be removed and we can
-         * write directly from fbmem line pointer. But copy is safer if stride differs.
-         */
-        uint8_t* linebuf = (uint8_t*)malloc((size_t)width * 4);
-        if (!linebuf) { close(c); continue; }
+    /*
+     * Local consumers: viewers on a Unix socket skip the TCP/IP stack (no checksums,
+     * segmentation or ACKs; the kernel copies straight into the reader's socket), and the
+     * --shm ring skips the protocol altogether.
+     */
+    srv.ufd = -1;
+    if (unix_at && ((srv.ufd = unix_bind(unix_at)) < 0 || listen(srv.ufd, 4) < 0)) die("unix socket");
+    if (shm_at && !(srv.shm = shmring_create(shm_at, &srv.tm, &srv.pf))) die("shm ring");
+    if (record_at && record_start(&srv, record_at, record_key_s * 1000)) die("recording");
 
-        /*
-         * We don't start streaming frames until the client sends a
-         * FramebufferUpdateRequest (msgtype 3). Many viewers expect to drive updates.
-         */
-        int client_ready = 0;
+    /*
+     * Event loop plumbing: epoll over the listening socket, the frame clock and every
+     * client. The listener and the clock are told apart from clients by their tags.
+     */
+    srv.epfd = epoll_create1(EPOLL_CLOEXEC);
+    if (srv.epfd < 0) die("epoll_create1");
+    srv.tfd = timerfd_create(CLOCK_MONOTONIC, TFD_NONBLOCK | TFD_CLOEXEC);
+    if (srv.tfd < 0) die("timerfd_create");
 
-        /*
-         * Client message loop
-         *
-         * We poll the socket without blocking (select timeout {0,0}) so that we can:
-         * - read any pending client messages
-         * - stream frames at a controlled FPS
-         *
-         * This is intentionally simple: we ignore most client messages.
-         */
-        for (;;) {
-            fd_set rfds;
-            FD_ZERO(&rfds);
-            FD_SET(c, &rfds);
-            struct timeval tv = {0, 0};
+    struct epoll_event ev = { .events = EPOLLIN, .data.ptr = &srv.lfd };
+    if (srv.lfd >= 0 && epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.lfd, &ev)) die("epoll_ctl");
+    ev.data.ptr = &srv.ufd;
+    if (srv.ufd >= 0 && epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.ufd, &ev)) die("epoll_ctl");
+    ev.data.ptr = &srv.tfd;
+    if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.tfd, &ev)) die("epoll_ctl");
 
-            int r = select(c + 1, &rfds, NULL, NULL, &tv);
-            if (r < 0 && errno != EINTR) break;
+    /* Capture thread last: it starts from the snapshot set up above */
+    if (capture_thread) {
+        if (capture_start(&srv)) die("capture thread");
+        ev.data.ptr = &srv.cap->evfd;
+        if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.cap->evfd, &ev)) die("epoll_ctl");
+    }
 
-            /*
-             * If the client has sent data, read one RFB message and consume its payload.
-             *
-             * Client-to-server message types (subset):
-             * 0: SetPixelFormat (we ignore; assume server format)
-             * 2: SetEncodings   (we ignore; always RAW)
-             * 3: FramebufferUpdateRequest (we use as "ready" signal)
-             * 4: KeyEvent       (ignored)
-             * 5: PointerEvent   (ignored)
-             * 6: ClientCutText  (ignored)
-             */
-            if (r > 0 && FD_ISSET(c, &rfds)) {
-                uint8_t msgtype;
-
-                /* read() (not read_all) because we only need 1 byte here */
-                if (read(c, &msgtype, 1) != 1) break;
-
-                if (msgtype == 0) {
-                    /* SetPixelFormat: 3 padding + 16-byte PixelFormat = 19 bytes remaining */
-                    uint8_t rest[19];
-                    if (read_all(c, rest, 19)) break;
-                } else if (msgtype == 2) {
-                    /*
-                     * SetEncodings:
-                     *   padding(1) + number-of-encodings(2) + encodings(4*count)
-                     *
-                     * We consume the list but ignore it because we always send RAW.
-                     */
-                    uint8_t pad;
-                    uint16_t count;
-                    if (read_all(c, &pad, 1)) break;
-                    if (read_all(c, &count, 2)) break;
-                    count = ntohs(count);
-
-                    for (uint16_t i = 0; i < count; i++) {
-                        uint32_t enc;
-                        if (read_all(c, &enc, 4)) { count = 0; break; }
-                        (void)enc; /* unused */
-                    }
-                } else if (msgtype == 3) {
-                    /*
-                     * FramebufferUpdateRequest:
-                     *   incremental(1) + x(2) + y(2) + w(2) + h(2)
-                     *
-                     * We ignore the requested rectangle and always send full screen.
-                     * We also ignore "incremental" (we always send full frame).
-                     */
-                    uint8_t inc;
-                    uint16_t rx, ry, rw2, rh2;
-                    if (read_all(c, &inc, 1)) break;
-                    if (read_all(c, &rx, 2) ||
-                        read_all(c, &ry, 2) ||
-                        read_all(c, &rw2, 2) ||
-                        read_all(c, &rh2, 2)) break;
-
-                    (void)inc; (void)rx; (void)ry; (void)rw2; (void)rh2;
-
-                    client_ready = 1;
-                } else if (msgtype == 4) {
-                    /* KeyEvent: down-flag(1) + pad(2) + key(4) = 7 bytes */
-                    uint8_t rest[7];
-                    if (read_all(c, rest, 7)) break;
-                } else if (msgtype == 5) {
-                    /* PointerEvent: button-mask(1) + x(2) + y(2) = 5 bytes */
-                    uint8_t rest[5];
-                    if (read_all(c, rest, 5)) break;
-                } else if (msgtype == 6) {
-                    /*
-                     * ClientCutText:
-                     *   pad(3) + length(4) + text(length)
-                     *
-                     * We consume the text payload safely in chunks.
-                     */
-                    uint8_t pad3[3];
-                    uint32_t len;
-                    if (read_all(c, pad3, 3)) break;
-                    if (read_all(c, &len, 4)) break;
-                    len = ntohl(len);
-
-                    while (len) {
-                        uint8_t tmp[256];
-                        size_t n = len > sizeof(tmp) ? sizeof(tmp) : (size_t)len;
-                        if (read_all(c, tmp, n)) { len = 0; break; }
-                        len -= (uint32_t)n;
-                    }
-                } else {
-                    /* Unknown message type -> disconnect to keep implementation simple */
-                    break;
-                }
-            }
+    /* Optional instrumentation: scrape endpoint and periodic summary */
+    srv.sfd = -1;
+    if (stats_at) {
+        if ((srv.sfd = stats_listen(stats_at)) < 0) die("stats socket");
+        ev.data.ptr = &srv.sfd;
+        if (epoll_ctl(srv.epfd, EPOLL_CTL_ADD, srv.sfd, &ev)) die("epoll_ctl");
+    }
+    if (stats_log_s > 0) {
+        srv.stats_every = stats_log_s * 1000;
+        srv.stats_since = now_ms();
+        srv.stats_next = srv.stats_since + srv.stats_every;
+        srv.cpu_prev = cpu_us();
+    }
 
-            /*
-             * If the client hasn't requested updates yet, don't stream.
-             * This reduces unnecessary network use and matches many VNC viewers' expectations.
-             */
-            if (!client_ready) {
-                msleep(50);
-                continue;
-            }
+    char where[32] = "no TCP port";
+    if (port > 0) snprintf(where, sizeof(where), "0.0.0.0:%d", port);
+    fprintf(stderr,
+            "fb0rfb: listening on %s, fb=%s (%dx%d@%dbpp %s, stride=%d%s, %d lines%s), fps=%d, max-clients=%d\n",
+            where, fbpath, width, height, bpp, conv.name, stride, stride == width * conv.bytespp ? " unpadded" : "",
+            vlines, srv.vsync ? ", vsync" : "", fps, max_clients);
+    if (unix_at) fprintf(stderr, "fb0rfb: local viewers on unix:%s\n", unix_at);
+    if (shm_at) fprintf(stderr, "fb0rfb: frames published to %s (%zu KB ring)\n", shm_at, srv.shm->size / 1024);
+    if (record_at) {
+        fprintf(stderr, "fb0rfb: recording to %s (%s, keyframe every %d s, index %s.idx)\n", record_at,
+                encoding_name(srv.recorder->encoding), record_key_s, record_at);
+    }
 
-            /*
-             * Send a full FramebufferUpdate containing 1 RAW rectangle.
-             *
-             * Server-to-client FramebufferUpdate message:
-             *   message-type(1)=0
-             *   padding(1)=0
-             *   number-of-rectangles(2)
-             *
-             * Then for each rectangle:
-             *   x(2), y(2), w(2), h(2), encoding-type(4)
-             *   followed by pixel data (for RAW: w*h*bytespp)
-             */
-            uint8_t fbup[4];
-            fbup[0] = 0; /* FramebufferUpdate */
-            fbup[1] = 0; /* padding */
-
-            uint16_t nrect = htons(1);
-            memcpy(&fbup[2], &nrect, 2);
-
-            if (write_all(c, fbup, 4)) break;
-
-            /* Rectangle header: full-screen, RAW encoding (0) */
-            uint16_t x0 = 0, y0 = 0;
-            uint16_t ww = htons((uint16_t)width);
-            uint16_t hh = htons((uint16_t)height);
-            uint32_t enc_raw = htonl(0);
-
-            if (write_all(c, &x0, 2) ||
-                write_all(c, &y0, 2) ||
-                write_all(c, &ww, 2) ||
-                write_all(c, &hh, 2) ||
-                write_all(c, &enc_raw, 4)) {
-                break;
-            }
+    /*
+     * Main loop
+     *
+     * Everything is event driven:
+     * - new connections are accepted as they arrive, and their handshake runs from here;
+     * - client messages are handled as soon as they arrive; a request that can be
+     *   answered is answered right away;
+     * - while any update request is outstanding, the frame clock ticks once per frame
+     *   period to scan the framebuffer (once, for everybody) and answer whoever waits;
+     * - output the socket didn't take is flushed on EPOLLOUT.
+     *
+     * With no request outstanding the clock is stopped and epoll_wait() blocks until
+     * some client says something.
+     */
+    server_sync(&srv); /* a --record or --shm consumer may want frames from the start */
+    for (;;) {
+        struct epoll_event events[32];
+        stats.sys[SYS_EPOLL]++;
+        int n = epoll_wait(srv.epfd, events, 32, server_timeout(&srv));
+        if (n < 0) {
+            if (errno == EINTR) continue;
+            die("epoll_wait");
+        }
 
-            /*
-             * Pixel data transfer:
-             * - For each scanline:
-             *   copy width*4 bytes from fbmem using (y * stride) as the source.
-             * - Send exactly width*4 bytes (no padding bytes, even if stride > width*4).
-             *
-             * This is the heaviest part of the program:
-             * - CPU cost: memcpy per line + TCP write
-             * - Network cost: width*height*4 bytes per frame (e.g., 480*544*4 ≈ 1.04 MB/frame)
-             * At 3 FPS that is ~3.1 MB/s, which is reasonable on LAN but still non-trivial.
-             * Keep FPS low to remain printer-friendly.
-             */
-            for (int y = 0; y < height; y++) {
-                memcpy(linebuf, fbmem + (size_t)y * (size_t)stride, (size_t)width * 4);
-                if (write_all(c, linebuf, (size_t)width * 4)) {
-                    y = height; /* force loop exit */
-                    break;
-                }
+        for (int i = 0; i < n; i++) {
+            void* tag = events[i].data.ptr;
+            if (tag == &srv.lfd || tag == &srv.ufd) {
+                server_accept(&srv, *(int*)tag);
+            } else if (srv.cap && tag == &srv.cap->evfd) {
+                uint64_t frames;
+                stats.sys[SYS_READ]++;
+                if (read(srv.cap->evfd, &frames, sizeof(frames)) > 0) server_frame(&srv);
+            } else if (tag == &srv.sfd) {
+                stats_accept(&srv);
+            } else if (tag == &srv.tfd) {
+                uint64_t ticks;
+                stats.sys[SYS_READ]++;
+                if (read(srv.tfd, &ticks, sizeof(ticks)) > 0) server_frame(&srv);
+            } else {
+                client_on_event(&srv, (struct client*)tag, events[i].events);
             }
-
-            /* Frame pacing */
-            msleep(1000 / fps);
         }
 
-        /* Cleanup per-client allocations and socket */
-        free(linebuf);
-        close(c);
-        fprintf(stderr, "fb0rfb: client disconnected\n");
+        server_expire(&srv);
+        server_reap(&srv);
+        server_sync(&srv);
+        if (srv.stats_every && now_ms() >= srv.stats_next) stats_log(&srv, now_ms());
     }
 
     /* Unreachable in current design; left for completeness */